@@ -0,0 +1,219 @@
+#include "anel.h"
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// ============================================================================
+// FILA MPSC (VÁRIOS ESCRITORES, UM LEITOR)
+// ============================================================================
+
+static void fila_iniciar(Fila *f, CelulaAnel *c, uint32_t cap)
+{
+    memset(f, 0, sizeof(*f));
+    for (uint32_t i = 0; i < cap; i++)
+        c[i].seq = i;
+}
+
+// Devolve 0 se a fila estiver cheia
+static int fila_escrever(Fila *f, CelulaAnel *c, uint32_t cap, int canal, const Trama *m)
+{
+    uint32_t pos = __atomic_load_n(&f->cauda, __ATOMIC_RELAXED);
+    CelulaAnel *cel;
+    while (1)
+    {
+        cel = &c[pos & (cap - 1)];
+        uint32_t seq = __atomic_load_n(&cel->seq, __ATOMIC_ACQUIRE);
+        int32_t dif = (int32_t)(seq - pos);
+        if (dif == 0)
+        {
+            // Célula livre: tenta ficar com ela
+            if (__atomic_compare_exchange_n(&f->cauda, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+            return 0; // o leitor ainda não a esvaziou
+        else
+            pos = __atomic_load_n(&f->cauda, __ATOMIC_RELAXED);
+    }
+
+    cel->canal = canal;
+    memcpy(&cel->m, m, trama_tamanho(m));
+    __atomic_store_n(&cel->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // Só há syscall se o leitor estiver a dormir
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&f->a_dormir, __ATOMIC_RELAXED))
+    {
+        __atomic_add_fetch(&f->toque, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &f->toque, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    return 1;
+}
+
+// Devolve 0 se a fila estiver vazia
+static int fila_ler(Fila *f, CelulaAnel *c, uint32_t cap, int *canal, Trama *m)
+{
+    uint32_t pos = f->cabeca;
+    CelulaAnel *cel = &c[pos & (cap - 1)];
+    if (__atomic_load_n(&cel->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return 0;
+
+    if (canal != NULL)
+        *canal = cel->canal;
+    // O tamanho vem de outro processo: não deixa passar do fim da célula
+    uint16_t tamanho = cel->m.c.tamanho;
+    if (tamanho > TRAMA_DADOS_MAX)
+        tamanho = TRAMA_DADOS_MAX;
+    memcpy(m, &cel->m, sizeof(CabecalhoTrama) + tamanho);
+    m->c.tamanho = tamanho;
+    m->dados[tamanho] = '\0';
+    __atomic_store_n(&cel->seq, pos + cap, __ATOMIC_RELEASE);
+    f->cabeca = pos + 1;
+    return 1;
+}
+
+static void fila_esperar(Fila *f, CelulaAnel *c, uint32_t cap, int timeout_ms)
+{
+    uint32_t toque = __atomic_load_n(&f->toque, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&f->a_dormir, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // Se alguém escreveu antes de vermos a_dormir, não dormimos
+    uint32_t pos = f->cabeca;
+    if (__atomic_load_n(&c[pos & (cap - 1)].seq, __ATOMIC_ACQUIRE) != pos + 1)
+    {
+        struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+        syscall(SYS_futex, &f->toque, FUTEX_WAIT, toque, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+    }
+    __atomic_store_n(&f->a_dormir, 0, __ATOMIC_RELAXED);
+}
+
+// ============================================================================
+// CONTROLADOR
+// ============================================================================
+
+Transporte *anel_criar(void)
+{
+    shm_unlink(SHM_ANEL); // restos de uma execução anterior
+    int fd = shm_open(SHM_ANEL, O_CREAT | O_EXCL | O_RDWR, 0666);
+    if (fd == -1)
+        return NULL;
+    if (ftruncate(fd, sizeof(Transporte)) == -1)
+    {
+        close(fd);
+        shm_unlink(SHM_ANEL);
+        return NULL;
+    }
+    Transporte *t = mmap(NULL, sizeof(Transporte), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t == MAP_FAILED)
+    {
+        shm_unlink(SHM_ANEL);
+        return NULL;
+    }
+
+    fila_iniciar(&t->pedidos.f, t->pedidos.c, ANEL_PEDIDOS);
+    for (int i = 0; i < ANEL_CANAIS; i++)
+    {
+        t->canais[i].dono = 0;
+        fila_iniciar(&t->canais[i].f, t->canais[i].c, ANEL_RESPOSTAS);
+    }
+    return t;
+}
+
+void anel_destruir(Transporte *t)
+{
+    if (t != NULL)
+        munmap(t, sizeof(Transporte));
+    shm_unlink(SHM_ANEL);
+}
+
+int anel_receber_pedido(Transporte *t, int *canal, Trama *m)
+{
+    if (!fila_ler(&t->pedidos.f, t->pedidos.c, ANEL_PEDIDOS, canal, m))
+        return 0;
+    // O canal também vem de outro processo: fora da tabela responde-se
+    // pelo canal do pid (ou pelo FIFO)
+    if (canal != NULL && (*canal < 0 || *canal >= ANEL_CANAIS))
+        *canal = -1;
+    return 1;
+}
+
+void anel_esperar_pedido(Transporte *t)
+{
+    fila_esperar(&t->pedidos.f, t->pedidos.c, ANEL_PEDIDOS, -1);
+}
+
+// Canal de respostas do cliente, ou -1 se ele só usa o FIFO
+int anel_canal_de(Transporte *t, pid_t pid)
+{
+    for (int i = 0; i < ANEL_CANAIS; i++)
+        if (__atomic_load_n(&t->canais[i].dono, __ATOMIC_ACQUIRE) == pid)
+            return i;
+    return -1;
+}
+
+int anel_enviar_resposta(Transporte *t, int canal, const Trama *m)
+{
+    CanalResposta *c = &t->canais[canal];
+    return fila_escrever(&c->f, c->c, ANEL_RESPOSTAS, canal, m);
+}
+
+// ============================================================================
+// CLIENTE
+// ============================================================================
+
+Transporte *anel_ligar(void)
+{
+    int fd = shm_open(SHM_ANEL, O_RDWR, 0);
+    if (fd == -1)
+        return NULL;
+    Transporte *t = mmap(NULL, sizeof(Transporte), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return t == MAP_FAILED ? NULL : t;
+}
+
+// Fica com um canal livre (ou de um cliente que já morreu); -1 se não houver
+int anel_reservar_canal(Transporte *t, pid_t pid)
+{
+    for (int i = 0; i < ANEL_CANAIS; i++)
+    {
+        int32_t dono = __atomic_load_n(&t->canais[i].dono, __ATOMIC_ACQUIRE);
+        if (dono != 0 && (kill(dono, 0) == 0 || errno != ESRCH))
+            continue;
+        if (!__atomic_compare_exchange_n(&t->canais[i].dono, &dono, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            continue;
+
+        // Deita fora respostas que tenham ficado do dono anterior
+        Trama lixo;
+        while (anel_receber_resposta(t, i, &lixo))
+            ;
+        return i;
+    }
+    return -1;
+}
+
+void anel_libertar_canal(Transporte *t, int canal, pid_t pid)
+{
+    int32_t dono = pid;
+    __atomic_compare_exchange_n(&t->canais[canal].dono, &dono, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+int anel_enviar_pedido(Transporte *t, int canal, const Trama *m)
+{
+    return fila_escrever(&t->pedidos.f, t->pedidos.c, ANEL_PEDIDOS, canal, m);
+}
+
+int anel_receber_resposta(Transporte *t, int canal, Trama *m)
+{
+    CanalResposta *c = &t->canais[canal];
+    return fila_ler(&c->f, c->c, ANEL_RESPOSTAS, NULL, m);
+}
+
+// Dorme até chegar uma resposta ou passar timeout_ms (-1 = sem limite)
+void anel_esperar_resposta(Transporte *t, int canal, int timeout_ms)
+{
+    CanalResposta *c = &t->canais[canal];
+    fila_esperar(&c->f, c->c, ANEL_RESPOSTAS, timeout_ms);
+}
@@ -0,0 +1,64 @@
+#ifndef ANEL_H
+#define ANEL_H
+
+#include "comum.h"
+
+// Transporte opcional cliente <-> controlador em memória partilhada.
+// Há uma fila de pedidos (muitos clientes escrevem, o controlador lê) e um
+// canal de respostas por cliente. As filas são anéis de tamanho fixo
+// (algoritmo de Vyukov): cada célula tem um número de sequência que diz se
+// está livre ou preenchida, por isso enviar e receber não fazem syscalls.
+// Só quem espera numa fila vazia dorme num futex, e só então quem escreve
+// faz FUTEX_WAKE. As mensagens são as tramas do FIFO (Trama); só se copia
+// a parte usada de cada célula.
+#define SHM_ANEL "/controlador_anel"
+#define ANEL_PEDIDOS 256   // potência de 2
+#define ANEL_RESPOSTAS 64  // potência de 2
+#define ANEL_CANAIS 64     // clientes ligados ao anel em simultâneo
+
+typedef struct {
+    uint32_t seq;   // == posição: livre; == posição + 1: preenchida
+    int32_t canal;  // canal de respostas de quem enviou (só nos pedidos)
+    Trama m;
+} CelulaAnel;
+
+typedef struct {
+    uint32_t cauda __attribute__((aligned(64)));  // próxima posição a escrever
+    uint32_t cabeca __attribute__((aligned(64))); // próxima posição a ler
+    uint32_t toque;     // muda sempre que alguém acorda o leitor (palavra do futex)
+    uint32_t a_dormir;  // o leitor está (ou vai estar) no futex
+} Fila;
+
+typedef struct {
+    Fila f;
+    CelulaAnel c[ANEL_PEDIDOS];
+} FilaPedidos;
+
+typedef struct {
+    int32_t dono __attribute__((aligned(64))); // PID do cliente (0 = livre)
+    Fila f;
+    CelulaAnel c[ANEL_RESPOSTAS];
+} CanalResposta;
+
+typedef struct {
+    FilaPedidos pedidos;
+    CanalResposta canais[ANEL_CANAIS];
+} Transporte;
+
+// Controlador
+Transporte *anel_criar(void);
+void anel_destruir(Transporte *t);
+int anel_receber_pedido(Transporte *t, int *canal, Trama *m);
+void anel_esperar_pedido(Transporte *t);
+int anel_canal_de(Transporte *t, pid_t pid);
+int anel_enviar_resposta(Transporte *t, int canal, const Trama *m);
+
+// Cliente
+Transporte *anel_ligar(void);
+int anel_reservar_canal(Transporte *t, pid_t pid);
+void anel_libertar_canal(Transporte *t, int canal, pid_t pid);
+int anel_enviar_pedido(Transporte *t, int canal, const Trama *m);
+int anel_receber_resposta(Transporte *t, int canal, Trama *m);
+void anel_esperar_resposta(Transporte *t, int canal, int timeout_ms);
+
+#endif
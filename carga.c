@@ -0,0 +1,508 @@
+#include "comum.h"
+#include "anel.h"
+#include "locais.h"
+#include <poll.h>
+#include <sys/wait.h>
+
+// Gerador de carga: N utilizadores simulados (um processo cada) fazem login
+// no controlador e enviam uma mistura de comandos a um ritmo alvo. Cada
+// pedido espera pela resposta com o mesmo seq antes de avançar, e no fim o
+// processo principal junta as latências e mostra os percentis por comando.
+
+#define CMD_LOGIN 0
+#define CMD_AGENDAR 1
+#define CMD_CONSULTAR 2
+#define CMD_CANCELAR 3
+#define CMD_DECISAO 4
+#define NCOMANDOS 5
+
+const char *nomes_comandos[NCOMANDOS] = {"login", "agendar", "consultar", "cancelar", "decisao"};
+
+typedef struct {
+    int32_t comando;
+    int32_t ok;        // 1 = aceite, 0 = rejeitado pelo controlador
+    int64_t latencia;  // ns; -1 = sem resposta dentro do prazo
+} Amostra;
+
+typedef struct {
+    int utilizadores;
+    int taxa;       // pedidos por segundo, somando todos os utilizadores
+    int duracao;    // segundos
+    int peso[NCOMANDOS];
+    int horizonte;  // agendar entre 1 e horizonte unidades de tempo no futuro
+    int km;         // distância máxima de cada viagem
+    int mapa;       // > 0: locais "x,y" num quadrado com este lado (0 = nomes)
+    int catalogo;   // 1 = origem e destino do locais.bin, se existir (km e mapa não contam)
+    int espera;     // ms até desistir de uma resposta
+    int anel;       // 1 = pedidos e respostas pelo anel em memória partilhada
+} Config;
+
+static Config cfg;
+
+typedef struct {
+    const char *nome;
+    int *valor;
+    int omissao;
+} OpcaoConfig;
+
+static OpcaoConfig opcoes_config[] = {
+    {"utilizadores", &cfg.utilizadores, 10},
+    {"taxa", &cfg.taxa, 50},
+    {"duracao", &cfg.duracao, 10},
+    {"agendar", &cfg.peso[CMD_AGENDAR], 40},
+    {"consultar", &cfg.peso[CMD_CONSULTAR], 30},
+    {"cancelar", &cfg.peso[CMD_CANCELAR], 20},
+    {"decisao", &cfg.peso[CMD_DECISAO], 10},
+    {"horizonte", &cfg.horizonte, 20},
+    {"km", &cfg.km, 10},
+    {"mapa", &cfg.mapa, 0},
+    {"catalogo", &cfg.catalogo, 1},
+    {"espera", &cfg.espera, 2000},
+    {"anel", &cfg.anel, 0},
+};
+
+#define NOPCOES_CONFIG (int)(sizeof(opcoes_config) / sizeof(opcoes_config[0]))
+
+volatile sig_atomic_t parar = 0;
+
+// Com catálogo o controlador só aceita viagens entre locais dele (os km
+// vêm da matriz); os filhos herdam o mapeamento
+Catalogo *catalogo = NULL;
+
+// ============================================================================
+// FUNÇÕES AUXILIARES
+// ============================================================================
+
+int64_t agora_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void dormir_ate(int64_t alvo) {
+    struct timespec ts;
+    ts.tv_sec = alvo / 1000000000LL;
+    ts.tv_nsec = alvo % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !parar)
+        ;
+}
+
+void trata_sinal(int s) {
+    (void)s;
+    parar = 1;
+}
+
+void carregar_config(int argc, char *argv[]) {
+    for (int i = 0; i < NOPCOES_CONFIG; i++)
+        *opcoes_config[i].valor = opcoes_config[i].omissao;
+
+    for (int a = 1; a < argc; a++) {
+        int reconhecida = 0;
+        for (int i = 0; i < NOPCOES_CONFIG; i++) {
+            size_t len = strlen(opcoes_config[i].nome);
+            if (strncmp(argv[a], "--", 2) == 0 && strncmp(argv[a] + 2, opcoes_config[i].nome, len) == 0 && argv[a][2 + len] == '=') {
+                *opcoes_config[i].valor = atoi(argv[a] + 3 + len);
+                reconhecida = 1;
+                break;
+            }
+        }
+        if (!reconhecida) {
+            printf("Uso: ./carga");
+            for (int i = 0; i < NOPCOES_CONFIG; i++)
+                printf(" [--%s=N]", opcoes_config[i].nome);
+            printf("\n");
+            exit(1);
+        }
+    }
+
+    if (cfg.utilizadores < 1) cfg.utilizadores = 1;
+    if (cfg.taxa < 1) cfg.taxa = 1;
+    if (cfg.duracao < 1) cfg.duracao = 1;
+    if (cfg.horizonte < 1) cfg.horizonte = 1;
+    if (cfg.km < 1) cfg.km = 1;
+    if (cfg.espera < 1) cfg.espera = 1;
+    int total = 0;
+    for (int c = CMD_AGENDAR; c < NCOMANDOS; c++) {
+        if (cfg.peso[c] < 0) cfg.peso[c] = 0;
+        total += cfg.peso[c];
+    }
+    if (total == 0) cfg.peso[CMD_CONSULTAR] = 1;
+}
+
+// ============================================================================
+// UTILIZADOR SIMULADO (FILHO)
+// ============================================================================
+
+#define MAX_IDS 64
+
+typedef struct {
+    int fd_ctrl;
+    int fd_resp;
+    Transporte *anel;
+    int canal;           // -1 = só FIFO
+    char pipe_nome[100];
+    char username[50];
+    uint32_t chave;      // chave_utilizador(username), vai em todos os pedidos
+    int seq;
+    int tempo_estimado;  // último tempo simulado conhecido
+    int reservas[MAX_IDS], n_reservas;   // IDs que podemos cancelar
+    int propostas[MAX_IDS], n_propostas; // IDs com "decisao" pendente
+    Amostra *amostras;
+    int n_amostras, cap_amostras;
+} Utilizador;
+
+void guardar_id(int *lista, int *n, int id) {
+    if (*n == MAX_IDS) {
+        memmove(lista, lista + 1, (MAX_IDS - 1) * sizeof(int));
+        (*n)--;
+    }
+    lista[(*n)++] = id;
+}
+
+// Tira um ID ao acaso da lista; -1 se estiver vazia
+int tirar_id(int *lista, int *n) {
+    if (*n == 0) return -1;
+    int k = rand() % *n;
+    int id = lista[k];
+    lista[k] = lista[--(*n)];
+    return id;
+}
+
+// Aproveita o texto das respostas para saber o tempo atual e os IDs a usar
+void ler_avisos(Utilizador *u, const Trama *r) {
+    const char *p;
+    int v;
+    if ((p = strstr(r->dados, "Atual: ")) != NULL && sscanf(p, "Atual: %d", &v) == 1)
+        u->tempo_estimado = v;
+    if ((p = strstr(r->dados, "decisao ")) != NULL && sscanf(p, "decisao %d", &v) == 1)
+        guardar_id(u->propostas, &u->n_propostas, v);
+    else if (strncmp(r->dados, "Sucesso: Agendamento ID ", 24) == 0 && sscanf(r->dados + 24, "%d", &v) == 1)
+        guardar_id(u->reservas, &u->n_reservas, v);
+}
+
+// Lê até chegar a resposta com este seq; os avisos assíncronos (seq 0) e
+// respostas atrasadas de pedidos anteriores só atualizam o estado
+int esperar_resposta(Utilizador *u, int seq, Trama *r) {
+    int64_t limite = agora_ns() + (int64_t)cfg.espera * 1000000;
+    while (1) {
+        int64_t resta = limite - agora_ns();
+        if (resta <= 0) return 0;
+
+        if (u->canal != -1) {
+            // As mensagens dos veículos continuam a vir pelo FIFO: esvaziá-lo
+            // para os veículos nunca ficarem bloqueados a escrever
+            Trama lixo;
+            while (trama_ler(u->fd_resp, &lixo) > 0)
+                ler_avisos(u, &lixo);
+
+            if (anel_receber_resposta(u->anel, u->canal, r)) {
+                ler_avisos(u, r);
+                if (r->c.seq == seq) return 1;
+                continue;
+            }
+            anel_esperar_resposta(u->anel, u->canal, resta > 10000000 ? 10 : 1);
+            continue;
+        }
+
+        struct pollfd pfd = {u->fd_resp, POLLIN, 0};
+        int n = poll(&pfd, 1, (int)((resta + 999999) / 1000000));
+        if (n < 0 && errno != EINTR) return 0;
+        if (n <= 0) continue;
+
+        ssize_t lidos = trama_ler(u->fd_resp, r);
+        if (lidos < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (lidos <= 0) return 0;
+        ler_avisos(u, r);
+        if (r->c.seq == seq) return 1;
+    }
+}
+
+void registar_amostra(Utilizador *u, int comando, int ok, int64_t latencia) {
+    if (u->n_amostras == u->cap_amostras) {
+        u->cap_amostras = u->cap_amostras ? u->cap_amostras * 2 : 1024;
+        u->amostras = realloc(u->amostras, u->cap_amostras * sizeof(Amostra));
+        if (u->amostras == NULL) {
+            perror("[ERRO] Sem memória para as amostras");
+            exit(1);
+        }
+    }
+    Amostra *a = &u->amostras[u->n_amostras++];
+    a->comando = comando;
+    a->ok = ok;
+    a->latencia = latencia;
+}
+
+// Começa a trama de um pedido; os dados são acrescentados por quem chama
+Trama *novo_pedido(Utilizador *u, Trama *t, int opcode) {
+    trama_iniciar(t, opcode, getpid(), ++u->seq, u->chave);
+    return t;
+}
+
+// Envia um pedido e mede o tempo até à resposta; devolve 1 se foi aceite
+int pedido(Utilizador *u, int comando, const Trama *t) {
+    Trama r;
+    int64_t t0 = agora_ns();
+    if (u->canal != -1) {
+        while (!anel_enviar_pedido(u->anel, u->canal, t)) usleep(100);
+    } else if (!trama_escrever(u->fd_ctrl, t)) {
+        registar_amostra(u, comando, 0, -1);
+        return 0;
+    }
+    if (!esperar_resposta(u, t->c.seq, &r)) {
+        registar_amostra(u, comando, 0, -1);
+        return 0;
+    }
+    int ok = r.c.opcode != OP_ERRO;
+    registar_amostra(u, comando, ok, agora_ns() - t0);
+    return ok;
+}
+
+int escolher_comando() {
+    int total = 0;
+    for (int c = CMD_AGENDAR; c < NCOMANDOS; c++) total += cfg.peso[c];
+    int r = rand() % total;
+    for (int c = CMD_AGENDAR; c < NCOMANDOS; c++) {
+        if (r < cfg.peso[c]) return c;
+        r -= cfg.peso[c];
+    }
+    return CMD_CONSULTAR;
+}
+
+void simular_utilizador(int n, int fd_resultados) {
+    Utilizador u;
+    memset(&u, 0, sizeof(u));
+    srand(getpid());
+
+    sprintf(u.pipe_nome, PIPE_CLIENTE, getpid());
+    if (mkfifo(u.pipe_nome, 0666) == -1 && errno != EEXIST) _exit(1);
+    u.fd_resp = open(u.pipe_nome, O_RDWR | O_NONBLOCK); // O_RDWR para não dar EOF
+    u.fd_ctrl = open(PIPE_CONTROLADOR, O_WRONLY);
+    if (u.fd_resp == -1 || u.fd_ctrl == -1) {
+        unlink(u.pipe_nome);
+        _exit(1);
+    }
+    u.canal = -1;
+    if (cfg.anel && (u.anel = anel_ligar()) != NULL)
+        u.canal = anel_reservar_canal(u.anel, getpid());
+
+    snprintf(u.username, sizeof(u.username), "carga%d_%d", (int)getppid(), n);
+    u.chave = chave_utilizador(u.username);
+
+    Trama t;
+    trama_texto(novo_pedido(&u, &t, OP_LOGIN), u.username);
+    if (pedido(&u, CMD_LOGIN, &t)) {
+        // Ritmo de cada utilizador; se o controlador atrasar, o próximo pedido
+        // sai logo a seguir à resposta (ciclo fechado)
+        int64_t intervalo = (int64_t)cfg.utilizadores * 1000000000LL / cfg.taxa;
+        int64_t proximo = agora_ns() + rand() % (intervalo + 1);
+        int64_t fim = agora_ns() + (int64_t)cfg.duracao * 1000000000LL;
+        DadosAgendar ag;
+        char origem[LOCAIS_NOME];
+        const char *destino;
+        int32_t id;
+
+        while (!parar && proximo < fim) {
+            dormir_ate(proximo);
+            if (parar) break;
+
+            int c = escolher_comando();
+            switch (c) {
+            case CMD_AGENDAR:
+                ag.hora = u.tempo_estimado + 1 + rand() % cfg.horizonte;
+                destino = "";
+                if (catalogo != NULL) {
+                    uint32_t n = catalogo->cab->n;
+                    uint32_t a = rand() % n, b = (a + 1 + rand() % (n - 1)) % n;
+                    ag.km = -1;
+                    snprintf(origem, sizeof(origem), "%s", locais_local(catalogo, a)->nome);
+                    destino = locais_local(catalogo, b)->nome;
+                } else {
+                    ag.km = 1 + rand() % cfg.km;
+                    if (cfg.mapa > 0)
+                        snprintf(origem, sizeof(origem), "%d,%d", rand() % cfg.mapa, rand() % cfg.mapa);
+                    else
+                        snprintf(origem, sizeof(origem), "L%d", rand() % 100);
+                }
+                trama_acrescentar(novo_pedido(&u, &t, OP_AGENDAR), &ag, sizeof(ag));
+                trama_texto(&t, origem);
+                trama_texto(&t, destino);
+                pedido(&u, c, &t);
+                break;
+            case CMD_CONSULTAR:
+                pedido(&u, c, novo_pedido(&u, &t, OP_CONSULTAR));
+                break;
+            case CMD_CANCELAR:
+                // Sem reservas conhecidas o pedido é rejeitado, o que também conta
+                id = tirar_id(u.reservas, &u.n_reservas);
+                if (id == -1) id = 999999;
+                trama_acrescentar(novo_pedido(&u, &t, OP_CANCELAR), &id, sizeof(id));
+                pedido(&u, c, &t);
+                break;
+            case CMD_DECISAO: {
+                DadosDecisao dd = {tirar_id(u.propostas, &u.n_propostas), 1};
+                if (dd.id == -1) dd.id = 999999;
+                trama_acrescentar(novo_pedido(&u, &t, OP_DECISAO), &dd, sizeof(dd));
+                pedido(&u, c, &t);
+                break;
+            }
+            }
+
+            proximo += intervalo;
+            int64_t t = agora_ns();
+            if (proximo < t) proximo = t;
+        }
+
+        // Sair sem deixar serviços para trás (não conta para as estatísticas)
+        int n_antes = u.n_amostras;
+        // (o cancelamento de uma viagem só acaba quando o veículo responde)
+        id = 0;
+        trama_acrescentar(novo_pedido(&u, &t, OP_CANCELAR), &id, sizeof(id));
+        pedido(&u, CMD_CANCELAR, &t);
+        for (int k = 0; k < 20 && !pedido(&u, CMD_CONSULTAR, novo_pedido(&u, &t, OP_TERMINAR)); k++)
+            usleep(50000);
+        u.n_amostras = n_antes;
+    }
+
+    unlink(u.pipe_nome);
+    if (u.canal != -1)
+        anel_libertar_canal(u.anel, u.canal, getpid());
+    for (int i = 0; i < u.n_amostras; i++)
+        write(fd_resultados, &u.amostras[i], sizeof(Amostra));
+    close(fd_resultados);
+    _exit(0);
+}
+
+// ============================================================================
+// RELATÓRIO (PAI)
+// ============================================================================
+
+int comparar_latencia(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Percentil p (0-1) de um vetor já ordenado
+double percentil_ms(const int64_t *v, int n, double p) {
+    int i = (int)(p * n + 0.999999) - 1;
+    if (i < 0) i = 0;
+    if (i >= n) i = n - 1;
+    return v[i] / 1e6;
+}
+
+void relatorio(Amostra *a, int n, double segundos) {
+    printf("\n=== CARGA: %d utilizadores, alvo %d pedidos/s, %.1f s, %s ===\n", cfg.utilizadores, cfg.taxa, segundos,
+           cfg.anel ? "anel" : "FIFO");
+    printf("%-10s %8s %8s %8s %9s %9s %9s %9s %9s\n",
+           "comando", "pedidos", "aceites", "s/resp", "pedidos/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+
+    int64_t *lat = malloc((n > 0 ? n : 1) * sizeof(int64_t));
+    if (lat == NULL) {
+        perror("[ERRO] Sem memória para o relatório");
+        return;
+    }
+
+    int total = 0;
+    for (int c = 0; c < NCOMANDOS; c++) {
+        int pedidos = 0, aceites = 0, sem_resposta = 0, m = 0;
+        for (int i = 0; i < n; i++) {
+            if (a[i].comando != c) continue;
+            pedidos++;
+            aceites += a[i].ok;
+            if (a[i].latencia < 0) sem_resposta++;
+            else lat[m++] = a[i].latencia;
+        }
+        if (pedidos == 0) continue;
+        total += pedidos;
+
+        printf("%-10s %8d %8d %8d %9.1f", nomes_comandos[c], pedidos, aceites, sem_resposta, pedidos / segundos);
+        if (m > 0) {
+            qsort(lat, m, sizeof(int64_t), comparar_latencia);
+            printf(" %9.3f %9.3f %9.3f %9.3f\n", percentil_ms(lat, m, 0.50), percentil_ms(lat, m, 0.99),
+                   percentil_ms(lat, m, 0.999), lat[m - 1] / 1e6);
+        } else {
+            printf(" %9s %9s %9s %9s\n", "-", "-", "-", "-");
+        }
+    }
+    printf("%-10s %8d %8s %8s %9.1f\n", "total", total, "", "", total / segundos);
+    free(lat);
+}
+
+int main(int argc, char *argv[]) {
+    setbuf(stdout, NULL);
+    carregar_config(argc, argv);
+
+    if (access(PIPE_CONTROLADOR, F_OK) == -1) {
+        printf("[ERRO] Controlador inativo.\n");
+        return 1;
+    }
+    if (cfg.catalogo && (catalogo = locais_abrir("locais.bin")) != NULL && catalogo->cab->n < 2) {
+        locais_fechar(catalogo);
+        catalogo = NULL;
+    }
+
+    // SIGUSR1 = o controlador encerrou; os filhos param e saem de forma limpa
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trata_sinal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int *fds = malloc(cfg.utilizadores * sizeof(int));
+    pid_t *pids = malloc(cfg.utilizadores * sizeof(pid_t));
+    if (fds == NULL || pids == NULL) {
+        perror("[ERRO] Sem memória");
+        return 1;
+    }
+
+    int64_t inicio = agora_ns();
+    int lancados = 0;
+    for (int i = 0; i < cfg.utilizadores; i++) {
+        int p[2];
+        if (pipe(p) == -1) {
+            perror("[ERRO] pipe");
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(p[0]);
+            for (int k = 0; k < lancados; k++) close(fds[k]);
+            simular_utilizador(i, p[1]);
+        }
+        close(p[1]);
+        if (pid < 0) {
+            perror("[ERRO] fork");
+            close(p[0]);
+            break;
+        }
+        fds[lancados] = p[0];
+        pids[lancados++] = pid;
+    }
+
+    // Junta as amostras de todos os filhos (cada um só escreve no fim)
+    Amostra *amostras = NULL;
+    int n = 0, cap = 0;
+    for (int i = 0; i < lancados; i++) {
+        Amostra a;
+        while (read(fds[i], &a, sizeof(a)) == sizeof(a)) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 4096;
+                amostras = realloc(amostras, cap * sizeof(Amostra));
+                if (amostras == NULL) {
+                    perror("[ERRO] Sem memória para as amostras");
+                    return 1;
+                }
+            }
+            amostras[n++] = a;
+        }
+        close(fds[i]);
+        waitpid(pids[i], NULL, 0);
+    }
+
+    relatorio(amostras, n, (agora_ns() - inicio) / 1e9);
+    free(amostras);
+    free(fds);
+    free(pids);
+    return 0;
+}
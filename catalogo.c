@@ -0,0 +1,243 @@
+#include "locais.h"
+
+// Gera o catálogo de locais que o controlador mapeia ao arrancar
+// (locais.h). Lê um ficheiro de texto com uma linha por local e,
+// opcionalmente, as estradas entre eles:
+//   <nome> <x> <y>
+//   via <nome> <nome> <km>
+// Sem estradas a distância é a de quarteirão entre as coordenadas; com
+// estradas é o caminho mais curto por elas (Dijkstra a partir de cada
+// local). Linhas vazias ou começadas por # são ignoradas.
+
+typedef struct {
+    int para;
+    int km;
+} Estrada;
+
+typedef struct {
+    Local *locais;
+    int n, cap;
+    Estrada *estradas;  // cada via dá duas estradas, uma em cada sentido
+    int *de;            // local de onde parte cada estrada
+    int n_estradas, cap_estradas;
+} Mapa;
+
+static Mapa mapa;
+
+// ============================================================================
+// LEITURA
+// ============================================================================
+
+int procurar(const char *nome) {
+    for (int i = 0; i < mapa.n; i++)
+        if (strcmp(mapa.locais[i].nome, nome) == 0) return i;
+    return -1;
+}
+
+void acrescentar_estrada(int de, int para, int km) {
+    if (mapa.n_estradas == mapa.cap_estradas) {
+        mapa.cap_estradas = mapa.cap_estradas ? 2 * mapa.cap_estradas : 64;
+        mapa.estradas = realloc(mapa.estradas, mapa.cap_estradas * sizeof(Estrada));
+        mapa.de = realloc(mapa.de, mapa.cap_estradas * sizeof(int));
+        if (mapa.estradas == NULL || mapa.de == NULL) {
+            perror("[ERRO] Sem memória");
+            exit(1);
+        }
+    }
+    mapa.estradas[mapa.n_estradas].para = para;
+    mapa.estradas[mapa.n_estradas].km = km;
+    mapa.de[mapa.n_estradas++] = de;
+}
+
+void ler_mapa(const char *ficheiro) {
+    FILE *f = fopen(ficheiro, "r");
+    if (f == NULL) {
+        perror("[ERRO] Não foi possível abrir o ficheiro de locais");
+        exit(1);
+    }
+
+    char linha[256];
+    int num = 0;
+    while (fgets(linha, sizeof(linha), f) != NULL) {
+        num++;
+        char a[LOCAIS_NOME + 1], b[LOCAIS_NOME + 1];
+        int x, y, km;
+        char *p = linha + strspn(linha, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+
+        if (sscanf(p, "via %32s %32s %d", a, b, &km) == 3) {
+            int i = procurar(a), j = procurar(b);
+            if (i == -1 || j == -1 || km < 0 || km >= LOCAIS_SEM_CAMINHO) {
+                fprintf(stderr, "[ERRO] %s:%d: via entre locais desconhecidos ou km inválido.\n", ficheiro, num);
+                exit(1);
+            }
+            acrescentar_estrada(i, j, km);
+            acrescentar_estrada(j, i, km);
+        } else if (sscanf(p, "%32s %d %d", a, &x, &y) == 3) {
+            if (strlen(a) >= LOCAIS_NOME || strchr(a, '>') != NULL || procurar(a) != -1) {
+                fprintf(stderr, "[ERRO] %s:%d: nome '%s' repetido, com '>' ou com mais de %d caracteres.\n",
+                        ficheiro, num, a, LOCAIS_NOME - 1);
+                exit(1);
+            }
+            if (mapa.n == LOCAIS_MAX) {
+                fprintf(stderr, "[ERRO] Demasiados locais (máximo %d).\n", LOCAIS_MAX);
+                exit(1);
+            }
+            if (mapa.n == mapa.cap) {
+                mapa.cap = mapa.cap ? 2 * mapa.cap : 64;
+                mapa.locais = realloc(mapa.locais, mapa.cap * sizeof(Local));
+                if (mapa.locais == NULL) {
+                    perror("[ERRO] Sem memória");
+                    exit(1);
+                }
+            }
+            Local *l = &mapa.locais[mapa.n++];
+            memset(l, 0, sizeof(*l));
+            strcpy(l->nome, a);
+            l->x = x;
+            l->y = y;
+        } else {
+            fprintf(stderr, "[ERRO] %s:%d: linha inválida.\n", ficheiro, num);
+            exit(1);
+        }
+    }
+    fclose(f);
+
+    if (mapa.n == 0) {
+        fprintf(stderr, "[ERRO] %s não tem locais.\n", ficheiro);
+        exit(1);
+    }
+}
+
+// ============================================================================
+// DISTÂNCIAS
+// ============================================================================
+
+// Caminhos mais curtos a partir de cada local, com um heap binário de
+// (distância, local); uma linha da matriz por origem
+void calcular_por_estradas(uint16_t *dist) {
+    int n = mapa.n;
+    // Estradas agrupadas por origem (índices inicio[i] .. inicio[i+1]-1)
+    int *inicio = calloc(n + 1, sizeof(int));
+    Estrada *adj = malloc((mapa.n_estradas + 1) * sizeof(Estrada));
+    int *d = malloc(n * sizeof(int));
+    int64_t *heap = malloc((mapa.n_estradas + n + 1) * sizeof(int64_t));
+    if (inicio == NULL || adj == NULL || d == NULL || heap == NULL) {
+        perror("[ERRO] Sem memória");
+        exit(1);
+    }
+    for (int e = 0; e < mapa.n_estradas; e++) inicio[mapa.de[e] + 1]++;
+    for (int i = 0; i < n; i++) inicio[i + 1] += inicio[i];
+    int *pos = malloc((n + 1) * sizeof(int));
+    memcpy(pos, inicio, (n + 1) * sizeof(int));
+    for (int e = 0; e < mapa.n_estradas; e++) adj[pos[mapa.de[e]]++] = mapa.estradas[e];
+    free(pos);
+
+    for (int s = 0; s < n; s++) {
+        for (int i = 0; i < n; i++) d[i] = INT32_MAX;
+        d[s] = 0;
+        int hn = 0;
+        heap[hn++] = (int64_t)s;
+        while (hn > 0) {
+            // Retira o mínimo (a distância vai nos 32 bits de cima)
+            int64_t topo = heap[0];
+            heap[0] = heap[--hn];
+            for (int i = 0;;) {
+                int m = i, l = 2 * i + 1, r = l + 1;
+                if (l < hn && heap[l] < heap[m]) m = l;
+                if (r < hn && heap[r] < heap[m]) m = r;
+                if (m == i) break;
+                int64_t t = heap[i]; heap[i] = heap[m]; heap[m] = t;
+                i = m;
+            }
+            int u = (int)(topo & 0xFFFFFFFF), du = (int)(topo >> 32);
+            if (du != d[u]) continue;  // entrada antiga
+            for (int k = inicio[u]; k < inicio[u + 1]; k++) {
+                int v = adj[k].para, dv = du + adj[k].km;
+                if (dv >= d[v]) continue;
+                d[v] = dv;
+                int i = hn++;
+                heap[i] = (int64_t)dv << 32 | v;
+                while (i > 0 && heap[(i - 1) / 2] > heap[i]) {
+                    int64_t t = heap[i]; heap[i] = heap[(i - 1) / 2]; heap[(i - 1) / 2] = t;
+                    i = (i - 1) / 2;
+                }
+            }
+        }
+        for (int j = 0; j < n; j++)
+            dist[(size_t)s * n + j] = d[j] >= LOCAIS_SEM_CAMINHO ? LOCAIS_SEM_CAMINHO : d[j];
+    }
+    free(inicio);
+    free(adj);
+    free(d);
+    free(heap);
+}
+
+void calcular_quarteirao(uint16_t *dist) {
+    int n = mapa.n;
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < n; j++) {
+            long d = labs((long)mapa.locais[i].x - mapa.locais[j].x) + labs((long)mapa.locais[i].y - mapa.locais[j].y);
+            dist[(size_t)i * n + j] = d >= LOCAIS_SEM_CAMINHO ? LOCAIS_SEM_CAMINHO : d;
+        }
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("Uso: ./catalogo <locais.txt> <locais.bin>\n");
+        return 1;
+    }
+    ler_mapa(argv[1]);
+
+    uint32_t n = mapa.n, cap = 1;
+    while (cap < 2 * n) cap <<= 1;
+    size_t tamanho = locais_tamanho(n, cap);
+    char *buf = calloc(1, tamanho);
+    if (buf == NULL) {
+        perror("[ERRO] Sem memória");
+        return 1;
+    }
+
+    CabecalhoLocais *cab = (CabecalhoLocais *)buf;
+    memcpy(cab->magico, LOCAIS_MAGICO, sizeof(cab->magico));
+    cab->versao = LOCAIS_VERSAO;
+    cab->n = n;
+    cab->cap_tabela = cap;
+    Local *locais = (Local *)(cab + 1);
+    int32_t *tabela = (int32_t *)(locais + n);
+    uint16_t *dist = (uint16_t *)(tabela + cap);
+
+    memcpy(locais, mapa.locais, n * sizeof(Local));
+    for (uint32_t p = 0; p < cap; p++) tabela[p] = -1;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t p = locais_hash(locais[i].nome) & (cap - 1);
+        while (tabela[p] != -1) p = (p + 1) & (cap - 1);
+        tabela[p] = i;
+    }
+    if (mapa.n_estradas > 0) calcular_por_estradas(dist);
+    else calcular_quarteirao(dist);
+
+    // Escreve ao lado e troca, para um controlador a arrancar nunca ver
+    // um catálogo a meio
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", argv[2]);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write(fd, buf, tamanho) != (ssize_t)tamanho || fsync(fd) == -1 || close(fd) == -1 ||
+        rename(tmp, argv[2]) == -1) {
+        perror("[ERRO] Não foi possível escrever o catálogo");
+        unlink(tmp);
+        return 1;
+    }
+
+    int sem_caminho = 0;
+    for (size_t k = 0; k < (size_t)n * n; k++) sem_caminho += dist[k] == LOCAIS_SEM_CAMINHO;
+    printf("[CATÁLOGO] %u locais, %d estradas, %zu bytes em %s", n, mapa.n_estradas / 2, tamanho, argv[2]);
+    if (sem_caminho > 0) printf(" (%d pares sem caminho)", sem_caminho);
+    printf("\n");
+    free(buf);
+    return 0;
+}
@@ -1,8 +1,21 @@
 #include "comum.h"
+#include "anel.h"
+#include <poll.h>
 
 char pipe_cliente[100];
 int fd_controlador;
 
+// Transporte em memória partilhada (opção --anel); os veículos usam sempre o FIFO
+Transporte *anel = NULL;
+int canal_anel = -1;
+
+pid_t pid_principal;
+pid_t recetores[2];
+int n_recetores = 0;
+
+// Modo batch: linha do ficheiro a ser codificada (0 = modo interativo)
+int linha_batch = 0;
+
 // ============================================================================
 // FUNÇÕES AUXILIARES
 // ============================================================================
@@ -11,6 +24,21 @@ void sair() {
     printf("\n[CLIENTE] A desligar...\n");
     if (fd_controlador != -1) close(fd_controlador);
     unlink(pipe_cliente);
+
+    // Só o processo do menu liberta o canal e leva os recetores consigo
+    if (getpid() == pid_principal) {
+        for (int i = 0; i < n_recetores; i++) kill(recetores[i], SIGTERM);
+        if (canal_anel != -1) anel_libertar_canal(anel, canal_anel, getpid());
+    }
+}
+
+void enviarPedido(Trama *t) {
+    if (canal_anel != -1) {
+        // Fila cheia: o controlador está atrasado, tenta daqui a pouco
+        while (!anel_enviar_pedido(anel, canal_anel, t)) usleep(1000);
+    } else {
+        trama_escrever(fd_controlador, t);
+    }
 }
 
 // Trata CTRL+C (SIGINT) e Encerramento do Servidor (SIGUSR1)
@@ -25,6 +53,31 @@ void trataSinais(int s) {
 // RECEÇÃO (FILHO)
 // ============================================================================
 
+void mostrarMensagem(Trama *resp) {
+    if(resp->c.opcode == OP_STATUS) {
+        printf("[VEÍCULO] %s\n", resp->dados);
+    } 
+    else if(strstr(resp->dados, "concluída") != NULL || resp->c.opcode == OP_FIM){
+        printf("[VEÍCULO] Viagem terminada. (Podes agendar nova viagem)\n");
+    }
+    // --- NOVO: AUTORIZAÇÃO DE SAÍDA ---
+    else if(resp->c.opcode == OP_SAIR) {
+        printf("[SISTEMA] Saída autorizada. Até à próxima!\n");
+        kill(getppid(), SIGINT); // Mata o processo pai (que está no menu)
+        exit(0); // Mata este processo filho
+    }
+    // --- NOVO: MENSAGEM DE ERRO ---
+    else if(resp->c.opcode == OP_ERRO) {
+        printf("[ERRO] %s\n", resp->dados);
+    }
+    else {
+        printf("[CONTROLADOR] %s\n", resp->dados);
+    }
+    
+    printf("> "); 
+    fflush(stdout);
+}
+
 void receberMensagens() {
     int fd_recebe = open(pipe_cliente, O_RDWR); // O_RDWR para não dar EOF
     if(fd_recebe == -1) {
@@ -32,51 +85,112 @@ void receberMensagens() {
         exit(1);
     }
 
-    Mensagem resp;
-    while (read(fd_recebe, &resp, sizeof(resp)) > 0) {
-        
-        if(strcmp(resp.comando, "status") == 0) {
-            printf("[VEÍCULO] %s\n", resp.mensagem);
-        } 
-        else if(strstr(resp.mensagem, "concluída") != NULL || strcmp(resp.comando, "fim") == 0){
-            printf("[VEÍCULO] Viagem terminada. (Podes agendar nova viagem)\n");
-        }
-        // --- NOVO: AUTORIZAÇÃO DE SAÍDA ---
-        else if(strcmp(resp.comando, "exit_ok") == 0) {
-            printf("[SISTEMA] Saída autorizada. Até à próxima!\n");
-            kill(getppid(), SIGINT); // Mata o processo pai (que está no menu)
-            exit(0); // Mata este processo filho
-        }
-        // --- NOVO: MENSAGEM DE ERRO ---
-        else if(strcmp(resp.comando, "erro") == 0) {
-            printf("[ERRO] %s\n", resp.mensagem);
-        }
-        else {
-            printf("[CONTROLADOR] %s\n", resp.mensagem);
-        }
-        
-        printf("> "); 
-        fflush(stdout);
+    Trama resp;
+    ssize_t n;
+    while ((n = trama_ler(fd_recebe, &resp)) != 0) {
+        if (n > 0) mostrarMensagem(&resp);
+        else if (errno != EPROTO && errno != EINTR) break; // EPROTO: trama estragada, ignora
     }
     close(fd_recebe);
 }
 
+// Respostas do controlador pelo canal do anel (as dos veículos vêm pelo FIFO)
+void receberMensagensAnel() {
+    Trama resp;
+    while (1) {
+        while (anel_receber_resposta(anel, canal_anel, &resp)) mostrarMensagem(&resp);
+        anel_esperar_resposta(anel, canal_anel, -1);
+    }
+}
+
 // ============================================================================
 // ENVIO (PAI)
 // ============================================================================
 
+// No modo batch os erros dizem de que linha do ficheiro são
+void erroComando(const char *texto) {
+    if (linha_batch > 0) printf("[linha %d] ", linha_batch);
+    printf("%s\n", texto);
+}
+
+// Traduz a linha escrita para a trama do comando; devolve 0 (com a
+// mensagem de erro já mostrada) se a linha não é um comando válido
+int codificarComando(const char *cmd, const char *args, Trama *t) {
+    if (args == NULL) args = "";
+
+    if (strcmp(cmd, "agendar") == 0) {
+        DadosAgendar d;
+        char origem[100], fim[100];
+        int n = 0;
+        if (sscanf(args, "%d %99s %99s", &d.hora, origem, fim) != 3) {
+            erroComando("[ERRO] Erro sintaxe. Use: agendar <hora> <origem> <destino|km>");
+            return 0;
+        }
+        // Com km no fim a origem é um local livre; senão são dois locais do catálogo
+        if (sscanf(fim, "%d%n", &d.km, &n) == 1 && fim[n] == '\0') {
+            if (d.km < 0) {
+                erroComando("[ERRO] Os km não podem ser negativos.");
+                return 0;
+            }
+            fim[0] = '\0';
+        } else {
+            d.km = -1;
+        }
+        t->c.opcode = OP_AGENDAR;
+        trama_acrescentar(t, &d, sizeof(d));
+        trama_texto(t, origem);
+        trama_texto(t, fim);
+    } else if (strcmp(cmd, "consultar") == 0) {
+        t->c.opcode = OP_CONSULTAR;
+    } else if (strcmp(cmd, "terminar") == 0) {
+        t->c.opcode = OP_TERMINAR;
+    } else if (strcmp(cmd, "cancelar") == 0) {
+        int32_t id;
+        int n = 0;
+        if (sscanf(args, "%d%n", &id, &n) != 1 || args[n] != '\0') {
+            erroComando("[ERRO] ID inválido! Insira um número.");
+            return 0;
+        }
+        t->c.opcode = OP_CANCELAR;
+        trama_acrescentar(t, &id, sizeof(id));
+    } else if (strcmp(cmd, "capacidade") == 0) {
+        DadosCapacidade d;
+        if (sscanf(args, "%d %d", &d.t1, &d.t2) != 2 || d.t2 < d.t1) {
+            erroComando("[ERRO] Erro sintaxe. Use: capacidade <t1> <t2>");
+            return 0;
+        }
+        t->c.opcode = OP_CAPACIDADE;
+        trama_acrescentar(t, &d, sizeof(d));
+    } else if (strcmp(cmd, "decisao") == 0) {
+        DadosDecisao d;
+        char resposta;
+        if (sscanf(args, "%d %c", &d.id, &resposta) != 2) {
+            erroComando("[ERRO] Erro sintaxe. Use: decisao <ID> <s/n>");
+            return 0;
+        }
+        d.aceitar = resposta == 's' || resposta == 'S';
+        t->c.opcode = OP_DECISAO;
+        trama_acrescentar(t, &d, sizeof(d));
+    } else {
+        // Apenas aceita os comandos de gestão, já não aceita entrar/sair
+        erroComando("Comando desconhecido ou inválido.");
+        return 0;
+    }
+    return 1;
+}
+
 void enviarComandos(const char *username) {
     char input[100];
-    Mensagem msg;
-    
-    msg.pid = getpid();
-    strcpy(msg.username, username);
+    Trama msg;
+    int seq = 1; // o login foi o pedido 1
+    uint32_t chave = chave_utilizador(username);
 
     // MENU SIMPLIFICADO (Sem entrar/sair)
     printf("\n--- Comandos Disponíveis ---\n");
-    printf(" agendar <hora> <local> <km>\n");
+    printf(" agendar <hora> <origem> <destino|km>\n");
     printf(" cancelar <ID>\n");
     printf(" consultar\n");
+    printf(" capacidade <t1> <t2>  (Veículos livres no intervalo)\n");
     printf(" decisao <ID> <s/n>  (Responder a proposta)\n");
     printf(" terminar\n");
     printf("----------------------------\n");
@@ -95,36 +209,197 @@ void enviarComandos(const char *username) {
         
         char *cmd = strtok(input, " ");
         char *args = strtok(NULL, ""); 
-        
-        if (args == NULL && len > strlen(cmd)) {
-             args = input + strlen(cmd) + 1;
-             if (*args == '\0') args = NULL;
-        }
 
         if (cmd == NULL) continue;
 
-        strcpy(msg.comando, cmd);
-        
-        if (args != NULL) strcpy(msg.mensagem, args);
-        else msg.mensagem[0] = '\0';
+        // O comando é codificado uma vez aqui; o controlador já não o volta a interpretar
+        trama_iniciar(&msg, 0, getpid(), seq + 1, chave);
+        if (codificarComando(cmd, args, &msg)) {
+            seq++;
+            enviarPedido(&msg);
+        }
+    } 
+}
 
-        // Apenas aceita os comandos de gestão, já não aceita entrar/sair
-        if(strcmp(cmd, "agendar") == 0 || strcmp(cmd, "consultar") == 0 || strcmp(cmd, "cancelar") == 0 || strcmp(cmd,"decisao") == 0 || strcmp(cmd, "terminar") == 0) {
-            write(fd_controlador, &msg, sizeof(Mensagem));
-            
+// ============================================================================
+// MODO BATCH
+// ============================================================================
+
+// Os pedidos do ficheiro seguem uns atrás dos outros sem esperar pelas
+// respostas, com no máximo BATCH_JANELA por responder (o controlador
+// escreve as respostas sem bloquear, por isso o pipe tem de ir sendo lido)
+#define BATCH_JANELA 64
+#define BATCH_ESPERA_MS 5000 // sem respostas durante este tempo, desiste
+
+#define BATCH_PENDENTE 0
+#define BATCH_ACEITE 1
+#define BATCH_REJEITADO 2
+#define BATCH_REAGENDADO 3
+
+typedef struct {
+    Trama t;
+    int linha;
+    int estado;
+} PedidoBatch;
+
+int64_t agora_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Próxima resposta do controlador ou aviso de um veículo (estes vêm sempre
+// pelo FIFO); 0 se não chegou nada em timeout_ms
+int receberBatch(int fd, Trama *r, int timeout_ms) {
+    if (canal_anel != -1) {
+        if (trama_ler(fd, r) > 0 || anel_receber_resposta(anel, canal_anel, r)) return 1;
+        anel_esperar_resposta(anel, canal_anel, timeout_ms < 10 ? timeout_ms : 10);
+        return anel_receber_resposta(anel, canal_anel, r);
+    }
+    struct pollfd p = {fd, POLLIN, 0};
+    return poll(&p, 1, timeout_ms) > 0 && trama_ler(fd, r) > 0;
+}
+
+// Lê e codifica o ficheiro todo antes de enviar ("-" é o stdin); as linhas
+// com erros de sintaxe ficam de fora. Devolve 0 se não o conseguiu ler.
+int lerBatch(const char *ficheiro, uint32_t chave, PedidoBatch **lista, int *n, int *invalidos) {
+    FILE *f = strcmp(ficheiro, "-") == 0 ? stdin : fopen(ficheiro, "r");
+    if (f == NULL) {
+        perror("[ERRO] Não foi possível abrir o ficheiro batch");
+        return 0;
+    }
+
+    PedidoBatch *pedidos = NULL;
+    int cap = 0, num = 0;
+    char input[256];
+    *n = *invalidos = 0;
+    while (fgets(input, sizeof(input), f) != NULL) {
+        num++;
+        input[strcspn(input, "\n")] = '\0';
+        char *cmd = strtok(input, " \t");
+        if (cmd == NULL || cmd[0] == '#') continue;
+        char *args = strtok(NULL, "");
+
+        if (*n == cap) {
+            cap = cap ? 2 * cap : 256;
+            PedidoBatch *novo = realloc(pedidos, cap * sizeof(PedidoBatch));
+            if (novo == NULL) {
+                perror("[ERRO] Sem memória");
+                free(pedidos);
+                if (f != stdin) fclose(f);
+                return 0;
+            }
+            pedidos = novo;
+        }
+        PedidoBatch *p = &pedidos[*n];
+        linha_batch = num;
+        // seq 1 foi o login
+        trama_iniciar(&p->t, 0, getpid(), *n + 2, chave);
+        if (codificarComando(cmd, args, &p->t)) {
+            p->linha = num;
+            p->estado = BATCH_PENDENTE;
+            (*n)++;
         } else {
-            printf("Comando desconhecido ou inválido.\n");
+            (*invalidos)++;
         }
-    } 
+    }
+    linha_batch = 0;
+    if (f != stdin) fclose(f);
+    *lista = pedidos;
+    return 1;
+}
+
+int executarBatch(const char *ficheiro, const char *username, int fd_resposta) {
+    int n, invalidos;
+    PedidoBatch *pedidos;
+    if (!lerBatch(ficheiro, chave_utilizador(username), &pedidos, &n, &invalidos)) return 1;
+    fcntl(fd_resposta, F_SETFL, O_NONBLOCK);
+
+    int contagem[4] = {0};
+    int enviados = 0, respondidos = 0;
+    int64_t inicio = agora_ms(), ultima = inicio;
+    Trama r;
+    while (respondidos < n) {
+        while (enviados < n && enviados - respondidos < BATCH_JANELA)
+            enviarPedido(&pedidos[enviados++].t);
+
+        if (!receberBatch(fd_resposta, &r, 100)) {
+            if (agora_ms() - ultima > BATCH_ESPERA_MS) break;
+            continue;
+        }
+        ultima = agora_ms();
+
+        int k = r.c.seq - 2;
+        if (k < 0 || k >= enviados) {
+            // Avisos assíncronos (veículos, despacho): só se mostram
+            printf("[%s] %s\n", r.c.opcode == OP_STATUS || r.c.opcode == OP_FIM ? "VEÍCULO" : "CONTROLADOR", r.dados);
+            continue;
+        }
+
+        PedidoBatch *p = &pedidos[k];
+        printf("[linha %d] %s%s\n", p->linha, r.c.opcode == OP_ERRO ? "[ERRO] " : "", r.dados);
+        // consultar responde com várias linhas; só a primeira decide o estado
+        if (p->estado != BATCH_PENDENTE) continue;
+        if (r.c.opcode == OP_ERRO) p->estado = BATCH_REJEITADO;
+        else if (r.c.opcode == OP_STATUS || r.c.opcode == OP_AVISO) p->estado = BATCH_REAGENDADO;
+        else p->estado = BATCH_ACEITE;
+        contagem[p->estado]++;
+        respondidos++;
+    }
+    int64_t fim = agora_ms();
+
+    // Restos de respostas com várias linhas
+    while (respondidos == n && receberBatch(fd_resposta, &r, 50)) {
+        int k = r.c.seq - 2;
+        if (k >= 0 && k < n) printf("[linha %d] %s\n", pedidos[k].linha, r.dados);
+    }
+
+    double segundos = (fim - inicio) / 1000.0;
+    printf("\n--- RESUMO BATCH (%s) ---\n", ficheiro);
+    printf("Pedidos: %d enviados em %.3f s", enviados, segundos);
+    if (segundos > 0) printf(" (%.0f pedidos/s)", enviados / segundos);
+    printf("\n");
+    printf("Aceites: %d | Rejeitados: %d | Reagendados: %d | Sem resposta: %d | Linhas inválidas: %d\n",
+           contagem[BATCH_ACEITE], contagem[BATCH_REJEITADO], contagem[BATCH_REAGENDADO], n - respondidos, invalidos);
+
+    // Liberta o nome para a próxima execução; os agendamentos ficam no
+    // controlador e passam para quem voltar a entrar com este nome
+    int terminou = 0;
+    for (int k = 0; k < n; k++) terminou |= pedidos[k].t.c.opcode == OP_TERMINAR;
+    if (!terminou) {
+        Trama t;
+        DadosTerminar d = {1};
+        trama_iniciar(&t, OP_TERMINAR, getpid(), n + 2, chave_utilizador(username));
+        trama_acrescentar(&t, &d, sizeof(d));
+        enviarPedido(&t);
+        int confirmado = 0;
+        int64_t limite = agora_ms() + BATCH_ESPERA_MS;
+        while (!confirmado && agora_ms() < limite)
+            confirmado = receberBatch(fd_resposta, &r, 100) && r.c.seq == n + 2;
+        if (!confirmado) printf("[AVISO] O controlador não confirmou a saída.\n");
+        else if (r.c.opcode == OP_ERRO) printf("[ERRO] %s\n", r.dados);
+    }
+    free(pedidos);
+    return contagem[BATCH_REJEITADO] > 0 || respondidos < n || invalidos > 0;
 }
 
 int main(int argc, char *argv[]) {
     setbuf(stdout, NULL); 
     
-    if (argc != 2) {
-        printf("Uso: ./cliente <username>\n");
+    int usar_anel = 0;
+    const char *batch = NULL;
+    int a = 1;
+    for (; a < argc - 1; a++) {
+        if (strcmp(argv[a], "--anel") == 0) usar_anel = 1;
+        else if (strcmp(argv[a], "--batch") == 0 && a + 1 < argc - 1) batch = argv[++a];
+        else break;
+    }
+    if (a != argc - 1) {
+        printf("Uso: ./cliente [--anel] [--batch <ficheiro>] <username>\n");
         return 1;
     }
+    const char *username = argv[argc - 1];
+    pid_principal = getpid();
 
     if (access(PIPE_CONTROLADOR, F_OK) == -1) {
         printf("[ERRO] Controlador inativo.\n");
@@ -148,39 +423,54 @@ int main(int argc, char *argv[]) {
     signal(SIGUSR1, trataSinais); 
     atexit(sair);
 
-    printf("[CLIENTE %s] PID %d\n", argv[1], getpid());
+    if (usar_anel) {
+        anel = anel_ligar();
+        if (anel != NULL) canal_anel = anel_reservar_canal(anel, getpid());
+        if (canal_anel == -1) printf("[AVISO] Anel indisponível, a usar o FIFO.\n");
+    }
+
+    printf("[CLIENTE %s] PID %d\n", username, getpid());
 
     // LOGIN AUTOMÁTICO
-    Mensagem login;
-    login.pid = getpid();
-    strcpy(login.username, argv[1]);
-    strcpy(login.comando, "login");
-    strcpy(login.mensagem, "Entrei"); 
+    Trama login;
+    trama_iniciar(&login, OP_LOGIN, getpid(), 1, chave_utilizador(username));
+    trama_texto(&login, username);
     
-    write(fd_controlador, &login, sizeof(Mensagem));
+    enviarPedido(&login);
 
-    Mensagem resposta;
-    if(read(fd_resposta, &resposta, sizeof(Mensagem))<=0){
+    Trama resposta;
+    if (canal_anel != -1) {
+        while (!anel_receber_resposta(anel, canal_anel, &resposta))
+            anel_esperar_resposta(anel, canal_anel, -1);
+    }
+    else if(trama_ler(fd_resposta, &resposta)<=0){
         printf("[ERRO] Erro ao ler resposta ou pipe fechado.\n");
         close(fd_resposta);
         return 1;
     }
-    close(fd_resposta);
 
     // 3. VERIFICAR SE POSSO ENTRAR
-    if (strcmp(resposta.comando, "erro") == 0) {
-        printf("[ERRO FATAL] %s\n", resposta.mensagem);
+    if (resposta.c.opcode == OP_ERRO) {
+        printf("[ERRO FATAL] %s\n", resposta.dados);
         unlink(pipe_cliente); // Limpa o pipe antes de morrer
         return 1; // TERMINA O PROGRAMA AQUI! O menu nunca aparece.
     }
 
-    printf("[SUCESSO] %s\n", resposta.mensagem);
+    printf("[SUCESSO] %s\n", resposta.dados);
+
+    // Modo batch: sem menu nem recetores, este processo lê as respostas
+    if (batch != NULL) return executarBatch(batch, username, fd_resposta);
+    close(fd_resposta);
 
-    if (fork() == 0) {
+    if ((recetores[n_recetores++] = fork()) == 0) {
         receberMensagens();
         exit(0);
     }
+    if (canal_anel != -1 && (recetores[n_recetores++] = fork()) == 0) {
+        receberMensagensAnel();
+        exit(0);
+    }
 
-    enviarComandos(argv[1]);
+    enviarComandos(username);
     return 0;
 }
\ No newline at end of file
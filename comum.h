@@ -11,18 +11,216 @@
 #include <signal.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 #define PIPE_CONTROLADOR "controlador_fifo"
 #define PIPE_CLIENTE "pipe%d"
+// Tamanhos por omissão; o controlador aceita --pool-max, --utilizadores e --agendamentos
 #define NVEICULOS 10
 #define NUTILIZADORES 30
 #define MAX_AGENDAMENTOS 50
+#define VEICULO_ARG_POOL "--pool" // argumento com que o controlador lança os veículos
+
+// Protocolo cliente <-> controlador (FIFOs, anel e encaminhador). Cada
+// trama é um cabeçalho fixo seguido de `tamanho` bytes de dados com o
+// formato do opcode; uma trama cabe sempre num write() atómico (< PIPE_BUF).
+// Os textos vão com o '\0' e quem lê termina sempre os dados com '\0'.
+#define PROTOCOLO_VERSAO 2
+#define TRAMA_DADOS_MAX 256
+
+// Pedidos (dados entre parênteses)
+#define OP_LOGIN 1       // (username)
+#define OP_AGENDAR 2     // (DadosAgendar, origem, destino)
+#define OP_CONSULTAR 3   // ()
+#define OP_CANCELAR 4    // (int32 id; 0 = todos)
+#define OP_TERMINAR 5    // () ou (DadosTerminar)
+#define OP_DECISAO 6     // (DadosDecisao)
+#define OP_CAPACIDADE 7  // (DadosCapacidade)
+#define OP_ADMIN 8       // (linha de comando) só do encaminhador para um shard, pelo stdin deste
+#define N_OPCODES_PEDIDO 9
+
+// Respostas e avisos (todos com um texto)
+#define OP_OK 32
+#define OP_ERRO 33
+#define OP_AVISO 34
+#define OP_STATUS 35        // proposta do controlador ou progresso do veículo
+#define OP_FIM 36           // o veículo terminou a viagem
+#define OP_SAIR 37          // saída autorizada
+#define OP_ADMIN_TEXTO 38   // pedaço da resposta a OP_ADMIN
+#define OP_ADMIN_FIM 39
+
+typedef struct {
+    uint8_t versao;        // PROTOCOLO_VERSAO
+    uint8_t opcode;        // OP_*
+    uint16_t tamanho;      // bytes de dados a seguir ao cabeçalho
+    int32_t pid;           // quem envia
+    int32_t seq;           // nº do pedido; as respostas repetem-no (0 = aviso assíncrono)
+    uint32_t chave;        // chave_utilizador() do cliente; escolhe o shard
+} CabecalhoTrama;
+
+typedef struct {
+    CabecalhoTrama c;
+    char dados[TRAMA_DADOS_MAX + 1]; // + '\0' posto por quem lê
+} Trama;
+
+typedef struct {
+    int32_t hora;
+    int32_t km;            // >= 0: origem é um local livre com estes km; -1: destino do catálogo
+} DadosAgendar;
+
+typedef struct {
+    int32_t id;
+    int32_t aceitar;
+} DadosDecisao;
+
+typedef struct {
+    int32_t t1, t2;
+} DadosCapacidade;
+
+typedef struct {
+    int32_t manter;        // 1: os agendamentos ficam para o próximo login com o mesmo nome
+} DadosTerminar;
+
+// FNV-1a de 32 bits: o mesmo utilizador vai sempre parar ao mesmo shard
+static inline uint32_t chave_utilizador(const char *username) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)username; *p; p++)
+        h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+static inline void trama_iniciar(Trama *t, int opcode, pid_t pid, int seq, uint32_t chave) {
+    t->c.versao = PROTOCOLO_VERSAO;
+    t->c.opcode = opcode;
+    t->c.tamanho = 0;
+    t->c.pid = pid;
+    t->c.seq = seq;
+    t->c.chave = chave;
+}
+
+// Devolve 0 (sem mexer na trama) se os dados não couberem
+static inline int trama_acrescentar(Trama *t, const void *dados, size_t n) {
+    if (t->c.tamanho + n > TRAMA_DADOS_MAX) return 0;
+    memcpy(t->dados + t->c.tamanho, dados, n);
+    t->c.tamanho += n;
+    return 1;
+}
+
+// Acrescenta um texto com o '\0', cortado se não couber
+static inline void trama_texto(Trama *t, const char *s) {
+    size_t livre = TRAMA_DADOS_MAX - t->c.tamanho, n = strlen(s);
+    if (livre == 0) return;
+    if (n >= livre) n = livre - 1;
+    memcpy(t->dados + t->c.tamanho, s, n);
+    t->dados[t->c.tamanho + n] = '\0';
+    t->c.tamanho += n + 1;
+}
+
+static inline size_t trama_tamanho(const Trama *t) {
+    return sizeof(CabecalhoTrama) + t->c.tamanho;
+}
+
+// Tira do início de buf (n bytes) a próxima trama. Devolve os bytes que
+// ocupava, 0 se ainda não chegou toda, ou -1 se não é uma trama desta
+// versão (o resto do buffer já não se consegue alinhar).
+static inline int trama_extrair(const char *buf, size_t n, Trama *t) {
+    if (n < sizeof(CabecalhoTrama)) return 0;
+    memcpy(&t->c, buf, sizeof(CabecalhoTrama));
+    if (t->c.versao != PROTOCOLO_VERSAO || t->c.tamanho > TRAMA_DADOS_MAX) return -1;
+    if (n < trama_tamanho(t)) return 0;
+    memcpy(t->dados, buf + sizeof(CabecalhoTrama), t->c.tamanho);
+    t->dados[t->c.tamanho] = '\0';
+    return trama_tamanho(t);
+}
+
+// Lê uma trama de um pipe. Como cada trama foi escrita de uma vez, quando
+// o cabeçalho está no pipe os dados também estão. Devolve o tamanho, 0 no
+// EOF, ou -1 (errno EPROTO se o que veio não é uma trama).
+static inline ssize_t trama_ler(int fd, Trama *t) {
+    ssize_t n = read(fd, &t->c, sizeof(CabecalhoTrama));
+    if (n <= 0) return n;
+    if (n != sizeof(CabecalhoTrama) || t->c.versao != PROTOCOLO_VERSAO || t->c.tamanho > TRAMA_DADOS_MAX ||
+        (t->c.tamanho > 0 && read(fd, t->dados, t->c.tamanho) != t->c.tamanho)) {
+        errno = EPROTO;
+        return -1;
+    }
+    t->dados[t->c.tamanho] = '\0';
+    return trama_tamanho(t);
+}
+
+static inline int trama_escrever(int fd, const Trama *t) {
+    return write(fd, t, trama_tamanho(t)) == (ssize_t)trama_tamanho(t);
+}
+
+// Viagem atribuída pelo controlador a um veículo livre (enviada pelo stdin
+// do veículo). Numa viagem partilhada vão vários pedidos seguidos, um por
+// passageiro, todos com a mesma recolha e o mesmo t_inicio; o primeiro diz
+// quantos são.
+#define LUGARES_MAX 4
+
+typedef struct {
+    int id_servico;
+    pid_t pid_cliente;
+    int distancia;         // km até deixar este passageiro, já com a recolha
+    int recolha;           // km até ao local do cliente (no início da viagem)
+    int t_inicio;          // tempo simulado em que a viagem foi atribuída
+    int passageiros;       // pedidos desta viagem (1..LUGARES_MAX)
+    char username[50];
+    char local[100];
+} PedidoViagem;
+
+// Cancela um só passageiro de uma viagem partilhada: sinal de tempo real
+// (não se perdem sinais seguidos) com o id do serviço em si_value
+#define SINAL_CANCELAR_PASSAGEIRO (SIGRTMIN + 1)
+
+// Reparte os km de uma viagem partilhada pelos passageiros: cada troço
+// entre duas paragens é dividido por quem ainda ia no carro (o resto da
+// divisão fica para os primeiros). fim[i] é o km em que o passageiro i
+// saiu ou vai sair e km o que o carro já andou; a soma das partes é o
+// que o carro andou até deixar o último.
+static inline void repartir_km(int n, const int *fim, int km, int *parte) {
+    for (int i = 0; i < n; i++) parte[i] = 0;
+    int ant = 0;
+    while (ant < km) {
+        int prox = km, a_bordo = 0;
+        for (int i = 0; i < n; i++) {
+            if (fim[i] <= ant) continue;
+            a_bordo++;
+            if (fim[i] < prox) prox = fim[i];
+        }
+        if (a_bordo == 0) break;
+        int troco = prox - ant, k = 0;
+        for (int i = 0; i < n; i++)
+            if (fim[i] > ant) parte[i] += troco / a_bordo + (k++ < troco % a_bordo);
+        ant = prox;
+    }
+}
+
+// Relógio simulado partilhado: o controlador cria-o num memfd, os veículos
+// herdam o descritor (número na variável RELOGIO_ENV) e mapeiam-no só para
+// leitura. A cada avanço o controlador acorda quem espera com FUTEX_WAKE.
+#define RELOGIO_ENV "TAXI_RELOGIO_FD"
+
+typedef struct {
+    int32_t tempo;
+} RelogioPartilhado;
+
+// Telemetria binária veículo -> controlador (stdout do veículo).
+// Cada frame tem tamanho fixo e é escrito com um único write(), que é
+// atómico num pipe, por isso o controlador nunca recebe frames misturados.
+#define TEL_INICIO 1     // chegou ao cliente e começou a viagem
+#define TEL_PROGRESSO 2  // avançou mais 10%
+#define TEL_CONCLUIDO 3  // fim da viagem; km = total percorrido
+#define TEL_CANCELADO 4  // cancelada a meio; km = percorridos até aí
+#define TEL_FALHA 5      // não conseguiu contactar o cliente
 
 typedef struct {
-    pid_t pid;             // PID do cliente
-    char comando[50];      // tipo de comando
-    char username[50];     // nome do utilizador
-    char mensagem[256];    // mensagem adicional
-} Mensagem;
+    int32_t tipo;
+    int32_t id_servico;
+    int32_t km;
+    int32_t percentagem;
+    int64_t timestamp;   // CLOCK_MONOTONIC em nanossegundos
+} TelemetriaFrame;
 
 #endif 
\ No newline at end of file
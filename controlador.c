@@ -1,18 +1,51 @@
+#define _GNU_SOURCE
 #include "comum.h"
+#include "anel.h"
+#include "diario.h"
+#include "locais.h"
+#include "traco.h"
+#include <stdint.h>
+#include <limits.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+
+// Passageiro de uma viagem (uma viagem partilhada leva vários)
+typedef struct
+{
+    int id_servico; // 0 = lugar vazio (ou já saiu)
+    pid_t pid_cliente;
+    int distancia; // km desde a atribuição até o deixar
+    int no_diario; // o serviço tem registo DESPACHADO no diário
+} Passageiro;
 
 // Estrutura do Veículo (Frota)
 typedef struct
 {
-    pid_t pid;
-    int fd_leitura;
+    pid_t pid; // 0 = slot sem veículo, -1 = veículo a ser criado
+    int fd_leitura; // stdout do veículo (relatórios)
+    int fd_escrita; // stdin do veículo (atribuição de viagens)
     int ocupado;
-    pid_t pid_cliente;
+    Passageiro passageiros[LUGARES_MAX];
+    int n_passageiros; // ainda a bordo (ou por recolher)
     char ultimo_status[50];
-    int distancia_viagem;
-    int id_servico;
-    pthread_t thread_id;
-    int thread_finalizada;
+    int distancia_viagem; // km até deixar o último passageiro
+    int km_viagem;        // km já contabilizados dos que saíram
     int tempo_conclusao_estimado;
+    int livre_desde; // tempo em que terminou a última viagem
+    int ocup_ini, ocup_fim; // intervalo da viagem contado na linha de ocupação
+    int x, y;      // posição; numa viagem, onde vai ficar (recolha ou destino)
+    int recolha;   // km da viagem atual até ao cliente
+    int na_grelha; // livre e no índice espacial (ctrl.grelha)
+    int lugar;     // local do catálogo onde está (ou vai ficar), -1 = fora dele
+    int sinais_pendentes; // cancelamentos decididos e ainda por enviar: fica fora da grelha
+    char buffer[16 * sizeof(TelemetriaFrame)]; // frames lidos e ainda não tratados
+    int buffer_len;
 } Veiculo;
 
 // Estrutura de Agendamento (Lista de Espera)
@@ -24,10 +57,14 @@ typedef struct
     int hora;
     int distancia;
     char local[100];
+    int origem, destino; // locais do catálogo, -1 = local livre ("nome" ou "x,y")
     int ativo; // 1 = Pendente, 0 = Vazio
     int ultimo_aviso;
     int aguardar_confirmacao;
     int hora_proposta;
+    int pos_heap; // posição no heap de despacho (-1 = fora do heap)
+    int ocup_ini, ocup_fim; // intervalo reservado na linha de ocupação
+    int orfao; // recuperado do diário; espera que o cliente volte a entrar
 } Agendamento;
 
 // Estrutura de Informação do Cliente
@@ -37,1132 +74,4950 @@ typedef struct
     char username[50];
 } ClienteInfo;
 
+// Tabela de slots alocada em blocos de tamanho fixo. Crescer só acrescenta
+// blocos (os slots existentes não mudam de sítio) e os slots libertados
+// são reaproveitados a partir de uma pilha, por isso alocar é O(1).
+#define SLAB_BLOCO 64
+
+typedef struct
+{
+    size_t tam_slot;
+    int capacidade; // slots já alocados (percorrer com i < capacidade)
+    int maximo;     // limite configurado
+    char **blocos;  // reservado para o máximo: nunca é realocado
+    int *livres;    // pilha de índices livres
+    int n_livres;
+} Slab;
+
+// Índice de hash com endereçamento aberto (sondagem linear) de chave
+// inteira para índice de slot. A mesma chave pode aparecer várias vezes,
+// o que serve para "PID -> serviços desse cliente".
+typedef struct
+{
+    uint64_t chave;
+    int valor; // -1 = entrada vazia
+} EntradaIndice;
+
+typedef struct
+{
+    EntradaIndice *e;
+    int cap; // potência de 2
+    int n;
+} Indice;
+
 // Estrutura Geral do Controlador
 typedef struct
 {
-    Veiculo frota[NVEICULOS];
-    ClienteInfo clientes[NUTILIZADORES];
-    Agendamento agenda[MAX_AGENDAMENTOS];
-    int num_veiculos;
+    Slab frota;    // Veiculo
+    Slab clientes; // ClienteInfo
+    Slab agenda;   // Agendamento
+    Indice cli_nome;   // hash do username -> cliente (m_clientes)
+    Indice agenda_id;  // id de serviço -> agendamento (m_agenda)
+    Indice agenda_pid; // pid do cliente -> agendamentos (m_agenda)
+    Indice frota_id;   // id de serviço -> veículo (m_frota)
+    Indice frota_pid;  // pid do cliente -> veículos (m_frota)
+    Indice grelha;     // célula da grelha -> veículos livres nela (m_frota)
+    int grelha_n;      // veículos livres na grelha (m_frota)
+    int *heap_agenda; // slots pendentes, o mais cedo no topo
+    int heap_n;
+    int acordar_agenda; // há trabalho novo para o despacho (protegido por m_despacho)
+    int despacho_ativo; // o despacho está a meio de uma ronda (protegido por m_despacho)
+    int num_veiculos; // veículos (processos) existentes no pool
     int fd_clientes;
-    int tempo;
-    int total_km;
-    int proximo_id;
+    int fd_clientes_escrita; // mantém o FIFO aberto para nunca dar EOF
+    int fd_epoll;
+    int fd_relogio; // timerfd; no modo discreto é um eventfd (fim de ronda do despacho)
+    int tempo;              // atómico: só a thread de eventos o avança (acertar_relogio)
+    int64_t instante_tempo; // agora_ns() do último avanço do relógio (atómico)
+    RelogioPartilhado *relogio; // cópia de tempo que os veículos leem
+    Transporte *anel; // filas em memória partilhada (NULL = só FIFO)
+    Catalogo *locais; // catálogo de locais com distâncias (NULL = km dados pelo cliente)
+    int total_km;   // atómico
+    int km_recolha; // parte de total_km feita em vazio até ao cliente (atómico)
+    int proximo_id; // atómico: cada agendamento tira o seu com fetch_add
+    int agendamentos_orfaos; // recuperados do diário e ainda sem cliente (m_agenda)
+    char fifo[64]; // FIFO dos pedidos: PIPE_CONTROLADOR, ou PIPE_CONTROLADOR.k num shard
 } Controlador;
 
 static Controlador ctrl;
 
-// mutex para sincronização
-pthread_mutex_t m_clientes = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t m_frota = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t m_agenda = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t m_km = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t m_tempo = PTHREAD_MUTEX_INITIALIZER;
+#define FROTA(i) ((Veiculo *)slab_slot(&ctrl.frota, (i)))
+#define CLIENTE(i) ((ClienteInfo *)slab_slot(&ctrl.clientes, (i)))
+#define AGENDA(i) ((Agendamento *)slab_slot(&ctrl.agenda, (i)))
+
+// Registos do diário (ver diario.h) e respetivos dados
+#define DIARIO_CRIADO 1     // DiarioAgendamento: agendamento novo
+#define DIARIO_REAGENDADO 2 // DiarioAgendamento: hora, proposta ou cliente mudou
+#define DIARIO_REMOVIDO 3   // DiarioId: cancelado, recusado ou despachado
+#define DIARIO_DESPACHADO 4 // DiarioViagem: viagem entregue a um veículo
+#define DIARIO_CONCLUIDO 5  // DiarioConcluido: fim da viagem e km feitos
+#define DIARIO_ENTROU 6     // DiarioCliente: login
+#define DIARIO_SAIU 7       // DiarioCliente: logout ou cliente desaparecido
+
+typedef struct
+{
+    int32_t id;
+    int32_t pid_cliente;
+    int32_t hora;
+    int32_t distancia;
+    int32_t aguardar_confirmacao;
+    int32_t hora_proposta;
+    char username[50];
+    char local[100];
+} DiarioAgendamento;
+
+typedef struct
+{
+    int32_t id;
+} DiarioId;
+
+typedef struct
+{
+    int32_t id;
+    int32_t pid_veiculo;
+    int32_t pid_cliente;
+    int32_t distancia;
+    int32_t t_inicio;
+    char username[50];
+} DiarioViagem;
+
+typedef struct
+{
+    int32_t id;
+    int32_t km;
+} DiarioConcluido;
+
+typedef struct
+{
+    int32_t pid;
+    char username[50];
+} DiarioCliente;
+
+// Estado guardado (checkpoint): cabeçalho seguido dos agendamentos ativos,
+// dos clientes e das viagens em curso, com os mesmos registos do diário.
+// Inclui tudo até ao registo lsn; no arranque basta mapear o ficheiro e
+// reproduzir o diário a partir daí.
+#define ESTADO_MAGICO "TAXIEST"
+#define ESTADO_VERSAO 1
+
+typedef struct
+{
+    char magico[8];
+    uint32_t versao;
+    uint32_t crc; // CRC32 de tudo o que vem depois do cabeçalho
+    uint64_t lsn;
+    int32_t tempo;
+    int32_t proximo_id;
+    int32_t total_km;
+    int32_t n_agendamentos;
+    int32_t n_clientes;
+    int32_t n_viagens;
+    uint16_t tam_agendamento; // sizeof de cada registo, para detetar outra disposição
+    uint16_t tam_cliente;
+    uint16_t tam_viagem;
+    uint16_t reservado;
+} CabecalhoEstado;
+
+// Configuração: valor por omissão, variável de ambiente ou --nome=valor
+typedef struct
+{
+    int pool_min;     // veículos sempre prontos
+    int pool_max;     // máximo de veículos em simultâneo
+    int pool_inativo; // tempo livre até um veículo extra ser recolhido
+    int max_utilizadores;
+    int max_agendamentos;
+    int escala;   // unidades de tempo simulado por segundo real
+    int discreto; // 1 = o relógio salta logo para o próximo evento
+    int anel;     // 1 = aceitar também clientes pelo transporte em memória partilhada
+    int trabalhadores; // threads para os pedidos dos clientes (0 = tratados por quem os lê)
+    int log_nivel;           // registos abaixo deste nível são ignorados (LOG_*)
+    const char *log_binario; // ficheiro onde guardar também os registos em binário
+    const char *stats;       // ficheiro com as estatísticas à saída ("" = não escrever)
+    const char *diario;      // diário para recuperar o estado ("" = sem diário)
+    int diario_sync;         // ms entre fdatasync do diário (0 = a cada escrita, -1 = nunca)
+    const char *estado;      // estado guardado para arrancar depressa ("" = só o diário)
+    int checkpoint;          // registos do diário entre dois estados guardados
+    int lugares;             // passageiros por viagem partilhada (1 = não partilhar)
+    int partilha_janela;     // junta agendamentos até este tempo depois do primeiro
+    int partilha_raio;       // distância máxima entre os locais de recolha
+    const char *locais;      // catálogo de locais gerado pelo catalogo ("" = não usar)
+    int shard;               // número deste controlador (0..shards-1) atrás do encaminhador
+    int shards;              // 1 = controlador único
+    const char *traco;       // grava aqui tudo o que entra, para reproduzir ("" = não gravar)
+    const char *replay;      // reproduz este traço em vez de servir clientes ("" = normal)
+    int replay_velocidade;   // 0 = o mais depressa possível, N = N vezes o ritmo gravado
+} Config;
+
+static Config cfg;
+
+typedef struct
+{
+    const char *nome;
+    const char *env;
+    int *valor;
+    int omissao;
+    const char **texto; // opções com texto em vez de número (valor == NULL)
+} OpcaoConfig;
+
+static OpcaoConfig opcoes_config[] = {
+    {"pool-min", "TAXI_POOL_MIN", &cfg.pool_min, 2},
+    {"pool-max", "TAXI_POOL_MAX", &cfg.pool_max, NVEICULOS},
+    {"pool-inativo", "TAXI_POOL_INATIVO", &cfg.pool_inativo, 30},
+    {"utilizadores", "TAXI_UTILIZADORES", &cfg.max_utilizadores, NUTILIZADORES},
+    {"agendamentos", "TAXI_AGENDAMENTOS", &cfg.max_agendamentos, MAX_AGENDAMENTOS},
+    {"escala", "TAXI_ESCALA", &cfg.escala, 1},
+    {"discreto", "TAXI_DISCRETO", &cfg.discreto, 0},
+    {"anel", "TAXI_ANEL", &cfg.anel, 1},
+    {"trabalhadores", "TAXI_TRABALHADORES", &cfg.trabalhadores, 4},
+    {"log-nivel", "TAXI_LOG_NIVEL", &cfg.log_nivel, 1},
+    {"log-binario", "TAXI_LOG_BINARIO", NULL, 0, &cfg.log_binario},
+    {"stats", "TAXI_STATS", NULL, 0, &cfg.stats},
+    {"diario", "TAXI_DIARIO", NULL, 0, &cfg.diario},
+    {"diario-sync", "TAXI_DIARIO_SYNC", &cfg.diario_sync, 0},
+    {"estado", "TAXI_ESTADO", NULL, 0, &cfg.estado},
+    {"checkpoint", "TAXI_CHECKPOINT", &cfg.checkpoint, 1000},
+    {"locais", "TAXI_LOCAIS", NULL, 0, &cfg.locais},
+    {"lugares", "TAXI_LUGARES", &cfg.lugares, LUGARES_MAX},
+    {"partilha-janela", "TAXI_PARTILHA_JANELA", &cfg.partilha_janela, 0},
+    {"partilha-raio", "TAXI_PARTILHA_RAIO", &cfg.partilha_raio, 0},
+    {"shard", "TAXI_SHARD", &cfg.shard, 0},
+    {"shards", "TAXI_SHARDS", &cfg.shards, 1},
+    {"traco", "TAXI_TRACO", NULL, 0, &cfg.traco},
+    {"replay", "TAXI_REPLAY", NULL, 0, &cfg.replay},
+    {"replay-velocidade", "TAXI_REPLAY_VELOCIDADE", &cfg.replay_velocidade, 0},
+};
+
+#define NOPCOES_CONFIG (int)(sizeof(opcoes_config) / sizeof(opcoes_config[0]))
+
+// --- Estatísticas: histogramas de latência log-lineares (estilo HDR) ---
+// Cada potência de 2 é dividida em HIST_SUB baldes, por isso o erro relativo
+// de um percentil é no máximo 1/HIST_SUB. Registar é um incremento atómico.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BALDES (64 * HIST_SUB)
+#define STATS_FICHEIRO "controlador_stats.txt"
+#define DIARIO_FICHEIRO "controlador.diario"
+#define ESTADO_FICHEIRO "controlador.estado"
+#define LOCAIS_FICHEIRO "locais.bin"
+#define TRABALHADORES_MAX 64
+
+typedef struct
+{
+    const char *nome;
+    uint64_t n;
+    uint64_t soma; // ns
+    uint64_t max;  // ns
+    uint64_t baldes[HIST_BALDES];
+} Histograma;
+
+// Histograma por opcode de pedido; o 0 apanha as tramas que não são pedidos
+static const char *comandos_stats[N_OPCODES_PEDIDO] = {
+    [0] = "outro", [OP_LOGIN] = "login", [OP_AGENDAR] = "agendar", [OP_CONSULTAR] = "consultar",
+    [OP_CANCELAR] = "cancelar", [OP_TERMINAR] = "terminar", [OP_DECISAO] = "decisao",
+    [OP_CAPACIDADE] = "capacidade", [OP_ADMIN] = "admin"};
+
+static struct
+{
+    Histograma comando[N_OPCODES_PEDIDO]; // da leitura do pedido ao fim do tratamento
+    Histograma despacho;                 // da hora do agendamento ao veículo enviado
+    Histograma criar_veiculo;            // posix_spawn do veículo (até ao exec)
+    Histograma ronda;                    // uma passagem de verificar_agendamentos
+    uint64_t pedidos_fifo;
+    uint64_t pedidos_anel;
+    uint64_t pedidos_recusados; // fila do trabalhador cheia
+} stats = {.despacho = {"despacho"}, .criar_veiculo = {"spawn"}, .ronda = {"ronda"}};
+
+// Trinco de uma tabela: o mutex serializa quem lhe mexe e o contador de
+// sequência (seqlock) deixa as consultas copiá-la sem o mutex. O contador
+// fica ímpar enquanto o mutex está tomado; uma cópia só é válida se o
+// contador era par e não mudou durante a cópia.
+typedef struct
+{
+    pthread_mutex_t mutex;
+    unsigned seq;
+    uint64_t aquisicoes;
+    Histograma espera; // só as aquisições em que o mutex estava ocupado
+} Trinco;
+
+#define TRINCO_INICIAL(nome) {PTHREAD_MUTEX_INITIALIZER, 0, 0, {nome}}
+#define LEITURA_TENTATIVAS 8 // cópias falhadas até a consulta tomar o mutex
+
+// Ordem dos trincos: quem precisa de vários toma-os sempre por esta ordem
+//   m_clientes -> m_agenda -> m_frota
+// Os outros mutexes são folhas (com um deles tomado não se pede mais
+// nenhum): as faixas de sessões, m_ocupacao, m_despacho e os do registo,
+// do diário, do traço e das filas dos trabalhadores. O tempo, os km e o
+// próximo id de serviço são atómicos. Com um trinco tomado não se envia
+// nada a clientes nem sinais a veículos: fica para depois de o largar.
+Trinco m_clientes = TRINCO_INICIAL("m_clientes");
+Trinco m_frota = TRINCO_INICIAL("m_frota");
+Trinco m_agenda = TRINCO_INICIAL("m_agenda");
+
+// Sessões dos clientes (pid -> slot em ctrl.clientes) repartidas em faixas
+// pelo pid, cada uma com o seu mutex: um pedido procura a sessão só com a
+// faixa do cliente, sem disputar m_clientes com os outros trabalhadores.
+// Entrar e sair mexem na faixa com m_clientes tomado, e o username de um
+// slot só muda quando ele não está em nenhuma faixa.
+#define SESSOES_FAIXAS 16
+
+typedef struct
+{
+    pthread_mutex_t m;
+    Indice pid;
+} FaixaSessoes;
+
+static FaixaSessoes sessoes[SESSOES_FAIXAS];
+// linha temporal de ocupação (folha: não se bloqueia nenhum outro mutex com este)
+pthread_mutex_t m_ocupacao = PTHREAD_MUTEX_INITIALIZER;
+// acorda o despacho de agendamentos (não se bloqueia nenhum outro mutex com este)
+pthread_mutex_t m_despacho = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t c_despacho = PTHREAD_COND_INITIALIZER;
+
+// seq do pedido de cliente que esta thread está a tratar; as respostas
+// levam-no de volta para o cliente as poder emparelhar (0 fora de um pedido)
+static __thread int seq_pedido_atual = 0;
+// canal do anel por onde chegou esse pedido (-1 = FIFO)
+static __thread int canal_pedido_atual = -1;
+
+// Reprodução de um traço (--replay): as respostas não saem do processo,
+// entram num resumo FNV-1a de 64 bits que tem de dar igual de uma
+// reprodução para a outra. Os veículos são virtuais, com pids a contar de
+// REPLAY_PID_VEICULO, e nenhum sinal sai do processo.
+#define REPLAY_PID_VEICULO 1000000
+
+static struct
+{
+    int ativa;
+    uint64_t resumo;
+    uint64_t respostas;
+    pid_t proximo_pid;
+} reproducao = {0, 14695981039346656037ULL, 0, REPLAY_PID_VEICULO};
+
+static void resumir(const void *dados, size_t n)
+{
+    const unsigned char *p = dados;
+    while (n--)
+        reproducao.resumo = (reproducao.resumo ^ *p++) * 1099511628211ULL;
+}
+
+// Origem de cada evento do reactor (campo data.u64 do epoll)
+#define EV_CLIENTES 1
+#define EV_ADMIN 2
+#define EV_RELOGIO 3
+#define EV_VEICULO 4
+#define EV_TAG(tipo, idx) (((uint64_t)(tipo) << 32) | (uint32_t)(idx))
 
 // ============================================================================
 // FUNÇÕES AUXILIARES GERAIS
 // ============================================================================
 
-void log_msg(const char *tag, const char *msg)
+int64_t agora_ns(void)
 {
-    int tempo;
-    pthread_mutex_lock(&m_tempo);
-    tempo = ctrl.tempo;
-    pthread_mutex_unlock(&m_tempo);
-    printf("[TEMPO %03d] %-12s %s\n", tempo, tag, msg);
-    fflush(stdout);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-void limpar_recursos()
+static inline int ler_tempo(void)
 {
-    printf("\n[SISTEMA] A encerrar controlador e notificar todos...\n");
-    pthread_mutex_lock(&m_clientes);
-    for (int i = 0; i < NUTILIZADORES; i++)
-    {
-        if (ctrl.clientes[i].pid > 0)
-        {
-            kill(ctrl.clientes[i].pid, SIGUSR1);
-        }
-    }
-    pthread_mutex_unlock(&m_clientes);
+    return __atomic_load_n(&ctrl.tempo, __ATOMIC_ACQUIRE);
+}
 
-    pthread_mutex_lock(&m_frota);
-    for (int i = 0; i < NVEICULOS; i++)
-    {
-        if (ctrl.frota[i].pid > 0)
-        {
-            kill(ctrl.frota[i].pid, SIGKILL);
-            close(ctrl.frota[i].fd_leitura);
-        }
-    }
-    pthread_mutex_unlock(&m_frota);
+// Muda o tempo simulado (só a thread de eventos, ou no arranque). O instante
+// vai antes do tempo: quem lê o tempo vê um instante desse avanço ou de outro
+// mais recente.
+void acertar_relogio(int tempo)
+{
+    __atomic_store_n(&ctrl.instante_tempo, agora_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&ctrl.tempo, tempo, __ATOMIC_RELEASE);
+    __atomic_store_n(&ctrl.relogio->tempo, tempo, __ATOMIC_RELEASE);
+}
 
-    if (ctrl.fd_clientes != -1)
-        close(ctrl.fd_clientes);
-    unlink(PIPE_CONTROLADOR);
+static inline int hist_balde(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return (int)v;
+    int desloc = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (desloc + 1) * HIST_SUB + (int)((v >> desloc) & (HIST_SUB - 1));
 }
 
-void handler_sinal(int s)
+// Menor valor que cai no balde b
+static inline uint64_t hist_valor(int b)
 {
-    exit(0);
+    if (b < HIST_SUB)
+        return b;
+    int desloc = b / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + b % HIST_SUB) << desloc;
 }
 
-// CORREÇÃO: Agora retorna int (1=Sucesso, 0=Cheio)
-int registar_cliente(pid_t pid, char *nome)
+void hist_registar(Histograma *h, int64_t ns)
 {
-    pthread_mutex_lock(&m_clientes);
-    for (int i = 0; i < NUTILIZADORES; i++)
-    {
-        if (ctrl.clientes[i].pid == 0)
-        { // Encontrou slot vazio
-            ctrl.clientes[i].pid = pid;
-            strcpy(ctrl.clientes[i].username, nome); // ver diferença entre strcpy e strncpy
-            pthread_mutex_unlock(&m_clientes);
-            return 1; // Sucesso
-        }
-    }
-    pthread_mutex_unlock(&m_clientes);
-    return 0; // Lista cheia
+    uint64_t v = ns < 0 ? 0 : (uint64_t)ns;
+    __atomic_add_fetch(&h->baldes[hist_balde(v)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->n, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->soma, v, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
 }
 
-void remover_cliente(pid_t pid)
+// Percentil p (0-1) em ns; devolve o meio do balde onde cai
+uint64_t hist_percentil(Histograma *h, double p)
 {
-    int cancelados = 0;
-    pthread_mutex_lock(&m_clientes);
-    for (int i = 0; i < NUTILIZADORES; i++)
-    {
-        if (ctrl.clientes[i].pid == pid)
-        {
-            ctrl.clientes[i].pid = 0;
-            ctrl.clientes[i].username[0] = '\0';
-            break;
-        }
-    }
-    pthread_mutex_unlock(&m_clientes);
+    uint64_t total = 0;
+    for (int b = 0; b < HIST_BALDES; b++)
+        total += __atomic_load_n(&h->baldes[b], __ATOMIC_RELAXED);
+    if (total == 0)
+        return 0;
 
-    // Cancelar agendamentos pendentes deste cliente
-    pthread_mutex_lock(&m_agenda);
-    for (int i = 0; i < MAX_AGENDAMENTOS; i++)
+    uint64_t alvo = (uint64_t)(p * total + 0.999999);
+    if (alvo == 0)
+        alvo = 1;
+    uint64_t acumulado = 0;
+    for (int b = 0; b < HIST_BALDES; b++)
     {
-        if (ctrl.agenda[i].ativo == 1 && ctrl.agenda[i].pid_cliente == pid)
+        acumulado += __atomic_load_n(&h->baldes[b], __ATOMIC_RELAXED);
+        if (acumulado >= alvo)
         {
-            ctrl.agenda[i].ativo = 0;
-            cancelados++;
+            uint64_t largura = hist_valor(b + 1) - hist_valor(b);
+            uint64_t v = hist_valor(b) + largura / 2;
+            uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+            return v < max ? v : max;
         }
     }
-    pthread_mutex_unlock(&m_agenda);
-    if (cancelados > 0)
-    {
-        char msg[100];
-        sprintf(msg, "Cancelados %d agendamentos pendentes do cliente (PID %d).", cancelados, pid);
-        log_msg("[CANCELAR]", msg);
-    }
+    return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
 }
 
-// thread para simulaer o tempo
-// uso de mutex para porque é necessário ler e escrever o tempo
-void *thread_relogio(void *arg)
+void trancar(Trinco *t)
 {
-    (void)arg;
-    while (1)
+    // Só se mede a espera quando o mutex já estava ocupado
+    if (pthread_mutex_trylock(&t->mutex) != 0)
     {
-        sleep(1);
-        pthread_mutex_lock(&m_tempo);
-        ctrl.tempo++;
-        pthread_mutex_unlock(&m_tempo);
+        int64_t inicio = agora_ns();
+        pthread_mutex_lock(&t->mutex);
+        hist_registar(&t->espera, agora_ns() - inicio);
     }
-    return NULL;
+    t->aquisicoes++;
+    __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-void setup_inicial()
+void destrancar(Trinco *t)
 {
-    setbuf(stdout, NULL);
-    memset(&ctrl, 0, sizeof(Controlador));
-    ctrl.fd_clientes = -1;
-    ctrl.proximo_id = 1;
-
-    int fd_check = open(PIPE_CONTROLADOR, O_WRONLY | O_NONBLOCK);
-    if (fd_check != -1)
-    {
-        printf("[ERRO] Já existe uma instância do programa controlador em execução!\n");
-        close(fd_check);
-        exit(1);
-    }
-
-    signal(SIGINT, handler_sinal);
-    atexit(limpar_recursos);
+    __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&t->mutex);
+}
 
-    if (mkfifo(PIPE_CONTROLADOR, 0666) == -1 && errno != EEXIST)
-    {
-        perror("[ERRO] Falha no mkfifo");
-        exit(1);
-    }
+// --- Slab (cada tabela é protegida pelo mutex respetivo) ---
 
-    ctrl.fd_clientes = open(PIPE_CONTROLADOR, O_RDONLY | O_NONBLOCK);
-    if (ctrl.fd_clientes == -1)
+void slab_iniciar(Slab *s, size_t tam_slot, int maximo)
+{
+    s->tam_slot = tam_slot;
+    s->capacidade = 0;
+    s->maximo = maximo;
+    s->blocos = calloc(maximo / SLAB_BLOCO + 1, sizeof(char *));
+    s->livres = malloc(maximo * sizeof(int));
+    s->n_livres = 0;
+    if (s->blocos == NULL || s->livres == NULL)
     {
-        perror("[ERRO] Falha no open do FIFO");
+        perror("[ERRO] Sem memória para as tabelas");
         exit(1);
     }
-
-    int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
-
-    printf("\n=== CONTROLADOR DE TÁXIS ===\n");
-    printf("--- Comandos Admin ---\n");
-    printf(" listar        -> Ver agendamentos\n");
-    printf(" utiliz        -> Ver utilizadores ligados\n");
-    printf(" frota         -> Ver estado dos veículos\n");
-    printf(" km            -> Ver total de KMs\n");
-    printf(" hora          -> Ver tempo simulado\n");
-    printf(" cancelar <ID> -> Cancelar serviço (0 para todos)\n");
-    printf(" terminar      -> Encerrar sistema\n");
-    printf("----------------------------\n");
-
-    log_msg("[SISTEMA]", "Controlador iniciado.");
 }
 
-void enviar_resposta(pid_t pid_cli, const char *comando, const char *mensagem)
+static inline void *slab_slot(Slab *s, int i)
 {
-    char pipe_name[100];
-    snprintf(pipe_name, sizeof(pipe_name), PIPE_CLIENTE, pid_cli);
-    int fd = open(pipe_name, O_WRONLY | O_NONBLOCK);
-    if (fd == -1)
-    {
-        log_msg("[AVISO]", "Não consegui abrir pipe do cliente");
-        return;
-    }
-
-    Mensagem resp;
-    memset(&resp, 0, sizeof(Mensagem));
-    resp.pid = getpid();
-    snprintf(resp.comando, sizeof(resp.comando), "%s", comando);
-    snprintf(resp.mensagem, sizeof(resp.mensagem), "%s", mensagem);
-
-    if (write(fd, &resp, sizeof(Mensagem)) == -1)
-    {
-        perror("Erro ao enviar resposta");
-    }
-    close(fd);
+    return s->blocos[i / SLAB_BLOCO] + (size_t)(i % SLAB_BLOCO) * s->tam_slot;
 }
 
-// ============================================================================
-// GESTÃO DE AGENDAMENTOS E FROTA (IDs)
-// ============================================================================
-
-int registar_agendamento_na_lista(int id_servico, char *user, pid_t pid, int h, int d, char *loc, int executar)
+// Devolve um slot a zeros, ou -1 se a tabela já está no máximo
+int slab_alocar(Slab *s)
 {
-    pthread_mutex_lock(&m_agenda);
-    for (int i = 0; i < MAX_AGENDAMENTOS; i++)
+    if (s->n_livres == 0)
     {
-        if (ctrl.agenda[i].ativo == 0)
-        {
-            ctrl.agenda[i].id = id_servico;
-            strcpy(ctrl.agenda[i].username, user);
-            ctrl.agenda[i].pid_cliente = pid;
-            ctrl.agenda[i].hora = h;
-            ctrl.agenda[i].distancia = d;
-            strcpy(ctrl.agenda[i].local, loc);
-            ctrl.agenda[i].ativo = 1;
-            ctrl.agenda[i].ultimo_aviso = -10;
-            ctrl.agenda[i].aguardar_confirmacao = executar;
-
-            char msg[100];
-            sprintf(msg, "Agendado ID %d para t=%d (Slot %d)", id_servico, h, i);
-            log_msg("[AGENDA]", msg);
-
-            pthread_mutex_unlock(&m_agenda);
-            return i;
-        }
+        if (s->capacidade >= s->maximo)
+            return -1;
+        int b = s->capacidade / SLAB_BLOCO;
+        s->blocos[b] = calloc(SLAB_BLOCO, s->tam_slot);
+        if (s->blocos[b] == NULL)
+            return -1;
+        int novos = SLAB_BLOCO;
+        if (s->capacidade + novos > s->maximo)
+            novos = s->maximo - s->capacidade;
+        // Empilha ao contrário para os índices baixos saírem primeiro
+        for (int i = s->capacidade + novos - 1; i >= s->capacidade; i--)
+            s->livres[s->n_livres++] = i;
+        // Quem copia a tabela sem o mutex lê a capacidade antes dos blocos
+        __atomic_store_n(&s->capacidade, s->capacidade + novos, __ATOMIC_RELEASE);
     }
-    pthread_mutex_unlock(&m_agenda);
-    log_msg("[ERRO]", "Lista de agendamentos cheia!");
-    return -1;
+    int i = s->livres[--s->n_livres];
+    memset(slab_slot(s, i), 0, s->tam_slot);
+    return i;
 }
 
-int cancelar_servico(pid_t pid_solicitante, int id_cancelar)
+void slab_libertar(Slab *s, int i)
 {
-    int cancelados = 0;
-    pthread_mutex_lock(&m_frota);
+    s->livres[s->n_livres++] = i;
+}
 
-    // --- 1. Cancelar Veículos em Andamento (FROTA) ---
-    for (int i = 0; i < ctrl.num_veiculos; i++)
+// Copia os slots da tabela para *copia (realocada se preciso) sem bloquear
+// os escritores; devolve o número de slots copiados. Se a tabela estiver
+// sempre a mudar, ao fim de LEITURA_TENTATIVAS copia com o mutex.
+int slab_copiar(Slab *s, Trinco *t, char **copia, size_t *tam_copia)
+{
+    for (int tentativa = 0; tentativa <= LEITURA_TENTATIVAS; tentativa++)
     {
-        if (ctrl.frota[i].pid > 0)
+        int com_mutex = tentativa == LEITURA_TENTATIVAS;
+        unsigned seq = 0;
+        if (com_mutex)
+            trancar(t);
+        else
         {
-            int alvo = 0;
-
-            if (pid_solicitante == -1)
-            { // ADMIN
-                if (id_cancelar == 0)
-                    alvo = 1;
-                else if (ctrl.frota[i].id_servico == id_cancelar)
-                    alvo = 1;
-            }
-            else
-            { // CLIENTE
-                if (ctrl.frota[i].pid_cliente == pid_solicitante)
-                {
-                    if (id_cancelar == 0)
-                        alvo = 1;
-                    else if (ctrl.frota[i].id_servico == id_cancelar)
-                        alvo = 1;
-                }
-            }
-
-            if (alvo)
+            seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1)
             {
-                kill(ctrl.frota[i].pid, SIGUSR1);
-                strcpy(ctrl.frota[i].ultimo_status, "A cancelar...");
-
-                cancelados++;
-                printf("[SISTEMA] Sinal de cancelamento enviado ao Veículo %d (Serviço ID %d).\n", ctrl.frota[i].pid, ctrl.frota[i].id_servico);
+                sched_yield();
+                continue;
             }
         }
-    }
-    pthread_mutex_unlock(&m_frota);
 
-    pthread_mutex_lock(&m_agenda);
-    // --- 2. Cancelar Agendamentos Pendentes (AGENDA) ---
-    for (int i = 0; i < MAX_AGENDAMENTOS; i++)
-    {
-        if (ctrl.agenda[i].ativo)
+        int cap = __atomic_load_n(&s->capacidade, __ATOMIC_ACQUIRE);
+        size_t precisa = (size_t)cap * s->tam_slot;
+        if (*tam_copia < precisa)
         {
-            int alvo = 0;
-
-            if (pid_solicitante == -1)
-            { // ADMIN
-                if (id_cancelar == 0)
-                    alvo = 1;
-                else if (ctrl.agenda[i].id == id_cancelar)
-                    alvo = 1;
-            }
-            else
-            { // CLIENTE
-                if (ctrl.agenda[i].pid_cliente == pid_solicitante)
-                {
-                    if (id_cancelar == 0)
-                        alvo = 1;
-                    else if (ctrl.agenda[i].id == id_cancelar)
-                        alvo = 1;
-                }
-            }
-
-            if (alvo)
+            char *nova = realloc(*copia, precisa);
+            if (nova == NULL)
             {
-                ctrl.agenda[i].ativo = 0;
-                cancelados++;
-
-                if (pid_solicitante == -1)
-                {
-                    char aviso[100];
-                    sprintf(aviso, "O teu agendamento (ID %d) foi cancelado pelo Admin.", ctrl.agenda[i].id);
-                    enviar_resposta(ctrl.agenda[i].pid_cliente, "cancelar", aviso);
-                }
-
-                printf("[SISTEMA] Agendamento ID %d removido da lista.\n", ctrl.agenda[i].id);
+                if (com_mutex)
+                    destrancar(t);
+                return 0;
             }
+            *copia = nova;
+            *tam_copia = precisa;
         }
-    }
-    pthread_mutex_unlock(&m_agenda);
-    return cancelados;
-}
-
-// ============================================================================
-// GESTÃO DE VEÍCULOS
-// ============================================================================
-
-void *thread_veiculo(void *arg)
-{
-    Veiculo *v = (Veiculo *)arg;
-    char buffer[256];
-    int km_reportados = 0;
-
-    while (1)
-    {
-        pthread_mutex_lock(&m_frota);
-        int fd = v->fd_leitura;
-        pthread_mutex_unlock(&m_frota);
-
-        int n = read(fd, buffer, sizeof(buffer) - 1);
-        if (n <= 0)
-            break;
 
-        buffer[n] = '\0';
-        //printf("[VEÍCULO %d] %s", v->pid, buffer);
-        
-
-        char *ptr_relatorio = strstr(buffer, "[RELATORIO]");
-
-        if (ptr_relatorio != NULL)
+        int valida = 1;
+        for (int i = 0; i < cap; i += SLAB_BLOCO)
         {
-            // Lemos o número a partir do ponteiro encontrado, ignorando o lixo antes
-            if (sscanf(ptr_relatorio, "[RELATORIO] %d", &km_reportados) == 1)
+            char *bloco = __atomic_load_n(&s->blocos[i / SLAB_BLOCO], __ATOMIC_ACQUIRE);
+            int n = cap - i < SLAB_BLOCO ? cap - i : SLAB_BLOCO;
+            if (bloco == NULL)
             {
-                pthread_mutex_lock(&m_km);
-                ctrl.total_km += km_reportados;
-                pthread_mutex_unlock(&m_km);
-
-                // Confirmação visual para saberes que contou
-                printf("[SISTEMA] Contabilizados +%d Km (Total: %d).\n",km_reportados, ctrl.total_km);
+                valida = 0; // a tabela cresceu a meio da cópia
+                break;
             }
+            memcpy(*copia + (size_t)i * s->tam_slot, bloco, (size_t)n * s->tam_slot);
         }
 
-        if (strstr(buffer, "Progresso:") != NULL || strstr(buffer, "Início") != NULL)
+        if (com_mutex)
         {
-            pthread_mutex_lock(&m_frota);
-            
-            // Copia do buffer para a variável final
-            strncpy(v->ultimo_status, buffer, sizeof(v->ultimo_status) - 1);
-            
-            // Remove o \n final para ficar bonito no comando 'frota'
-            char *enter = strchr(v->ultimo_status, '\n');
-            if (enter) *enter = '\0';
-            
-            pthread_mutex_unlock(&m_frota);
+            destrancar(t);
+            return cap;
         }
-
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (valida && __atomic_load_n(&t->seq, __ATOMIC_RELAXED) == seq)
+            return cap;
     }
-    pthread_mutex_lock(&m_frota);
-    v->thread_finalizada = 1;
-    pthread_mutex_unlock(&m_frota);
-    return NULL;
+    return 0;
 }
 
-int obter_proxima_vaga(){
-    int menor_tempo_fim = 99999;
-    int encontrou = 0;
+// --- Índices de hash (cada índice é protegido pelo mutex da sua tabela) ---
 
-    pthread_mutex_lock(&m_frota);
-    for(int i = 0; i< NVEICULOS; i++){
-        if(ctrl.frota[i].ocupado){
-            if(ctrl.frota[i].tempo_conclusao_estimado < menor_tempo_fim){
-                menor_tempo_fim = ctrl.frota[i].tempo_conclusao_estimado;
-                encontrou = 1;
-            }
-        }else{
-            pthread_mutex_unlock(&m_frota);
-            return -1;
-        }
+static inline uint64_t misturar_hash(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+uint64_t hash_texto(const char *s)
+{
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
     }
-    pthread_mutex_unlock(&m_frota);
+    return h;
+}
 
-    if(encontrou){
-        return menor_tempo_fim + 1; 
+void indice_iniciar(Indice *ind, int cap)
+{
+    ind->cap = 16;
+    while (ind->cap < cap * 2)
+        ind->cap *= 2;
+    ind->n = 0;
+    ind->e = malloc(ind->cap * sizeof(EntradaIndice));
+    if (ind->e == NULL)
+    {
+        perror("[ERRO] Sem memória para os índices");
+        exit(1);
     }
-    return ctrl.tempo + 10;
+    for (int i = 0; i < ind->cap; i++)
+        ind->e[i].valor = -1;
+}
+
+void indice_inserir(Indice *ind, uint64_t chave, int valor);
 
+// Duplica a tabela quando passa de metade da ocupação
+void indice_crescer(Indice *ind)
+{
+    EntradaIndice *antigas = ind->e;
+    int cap_antiga = ind->cap;
+    indice_iniciar(ind, cap_antiga);
+    for (int i = 0; i < cap_antiga; i++)
+        if (antigas[i].valor != -1)
+            indice_inserir(ind, antigas[i].chave, antigas[i].valor);
+    free(antigas);
 }
 
-int lancar_veiculo(char *user, int pid_cli, int dist, char *local, int id_servico)
+void indice_inserir(Indice *ind, uint64_t chave, int valor)
 {
-    int p[2];
-    pid_t pid;
-    char str_pid[20], str_dist[20], buffer[200];
+    if ((ind->n + 1) * 2 > ind->cap)
+        indice_crescer(ind);
+    int mascara = ind->cap - 1;
+    int i = misturar_hash(chave) & mascara;
+    while (ind->e[i].valor != -1)
+        i = (i + 1) & mascara;
+    ind->e[i].chave = chave;
+    ind->e[i].valor = valor;
+    ind->n++;
+}
 
-    pthread_mutex_lock(&m_frota);
-    int idx = -1;
-    for (int i = 0; i < NVEICULOS; ++i)
+// Percorre os valores de uma chave:
+//   for (int p = -1, v; (v = indice_proximo(ind, chave, &p)) != -1;)
+int indice_proximo(Indice *ind, uint64_t chave, int *pos)
+{
+    int mascara = ind->cap - 1;
+    int i = (*pos == -1) ? (int)(misturar_hash(chave) & mascara) : ((*pos + 1) & mascara);
+    while (ind->e[i].valor != -1)
     {
-        if (!ctrl.frota[i].ocupado)
+        if (ind->e[i].chave == chave)
         {
-            idx = i;
-            ctrl.frota[i].ocupado = 1;
-            break;
+            *pos = i;
+            return ind->e[i].valor;
         }
+        i = (i + 1) & mascara;
     }
-    pthread_mutex_unlock(&m_frota);
+    return -1;
+}
 
-    if (idx == -1){
-        printf("[DEBUG] FALHA: Não encontrei slot livre (NVEICULOS=%d)\n", NVEICULOS);
-        return 0;
-    }
-    
+// Remove o par (chave, valor), fechando o buraco para não precisar de lápides
+void indice_remover(Indice *ind, uint64_t chave, int valor)
+{
+    int mascara = ind->cap - 1;
+    int i = misturar_hash(chave) & mascara;
+    while (ind->e[i].valor != -1 && !(ind->e[i].chave == chave && ind->e[i].valor == valor))
+        i = (i + 1) & mascara;
+    if (ind->e[i].valor == -1)
+        return;
 
-    if (pipe(p) == -1)
+    ind->e[i].valor = -1;
+    ind->n--;
+    int j = i;
+    while (1)
     {
-        
-        log_msg("[ERRO]", "Falha pipe anónimo");
-        pthread_mutex_lock(&m_frota);
-        ctrl.frota[idx].ocupado = 0;
-        pthread_mutex_unlock(&m_frota);
-
-        return 0;
-    }
-
-    pid = fork();
+        j = (j + 1) & mascara;
+        if (ind->e[j].valor == -1)
+            break;
+        int casa = misturar_hash(ind->e[j].chave) & mascara;
+        // Só recua a entrada j se a sua posição natural não estiver em ]i, j]
+        if ((j > i && (casa <= i || casa > j)) || (j < i && (casa <= i && casa > j)))
+        {
+            ind->e[i] = ind->e[j];
+            ind->e[j].valor = -1;
+            i = j;
+        }
+    }
+}
+
+// --- Registo (log) assíncrono ---
+// Quem regista só copia o registo para um anel sem locks (o mesmo esquema
+// de Vyukov do anel dos clientes) e segue. Uma thread própria formata os
+// registos e escreve-os em lotes. Com o anel cheio o registo é descartado
+// e contado, e a thread de escrita avisa quantos se perderam.
+
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_AVISO 2
+#define LOG_ERRO 3
+
+#define LOG_CAPACIDADE 1024 // potência de 2
+#define LOG_LOTE 64         // registos por write()
+
+// Formato também usado no ficheiro binário (--log-binario)
+typedef struct
+{
+    int64_t instante; // CLOCK_REALTIME em nanossegundos
+    int32_t tempo;    // tempo simulado
+    int32_t nivel;
+    char tag[16];
+    char texto[232];
+} RegistoLog;
+
+typedef struct
+{
+    unsigned seq;
+    RegistoLog r;
+} CelulaLog;
+
+static struct
+{
+    CelulaLog celulas[LOG_CAPACIDADE];
+    unsigned cauda __attribute__((aligned(64)));
+    unsigned cabeca __attribute__((aligned(64)));
+    unsigned toque;
+    unsigned a_dormir;
+    unsigned long descartados;
+    int ativo;    // a thread de escrita está a correr
+    int terminar; // pedir à thread para esvaziar o anel e sair
+    int fd_binario;
+    pthread_t escritor;
+} registo = {.fd_binario = -1};
+
+void registo_acordar(void)
+{
+    __atomic_add_fetch(&registo.toque, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &registo.toque, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+void log_nivel(int nivel, const char *tag, const char *msg)
+{
+    if (nivel < cfg.log_nivel)
+        return;
+
+    RegistoLog r;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r.instante = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    r.tempo = __atomic_load_n(&ctrl.tempo, __ATOMIC_RELAXED);
+    r.nivel = nivel;
+    snprintf(r.tag, sizeof(r.tag), "%s", tag);
+    snprintf(r.texto, sizeof(r.texto), "%s", msg);
+
+    if (!__atomic_load_n(&registo.ativo, __ATOMIC_ACQUIRE))
+    {
+        // Antes de a thread arrancar ou depois de sair: escreve já
+        printf("[TEMPO %03d] %-12s %s\n", r.tempo, r.tag, r.texto);
+        return;
+    }
+
+    unsigned pos = __atomic_load_n(&registo.cauda, __ATOMIC_RELAXED);
+    CelulaLog *cel;
+    while (1)
+    {
+        cel = &registo.celulas[pos & (LOG_CAPACIDADE - 1)];
+        int dif = (int)(__atomic_load_n(&cel->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0 && __atomic_compare_exchange_n(&registo.cauda, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        if (dif < 0)
+        {
+            __atomic_add_fetch(&registo.descartados, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (dif > 0)
+            pos = __atomic_load_n(&registo.cauda, __ATOMIC_RELAXED);
+    }
+    cel->r = r;
+    __atomic_store_n(&cel->seq, pos + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&registo.a_dormir, __ATOMIC_RELAXED))
+        registo_acordar();
+}
+
+void log_msg(const char *tag, const char *msg)
+{
+    log_nivel(LOG_INFO, tag, msg);
+}
+
+int registo_ler(RegistoLog *r)
+{
+    unsigned pos = registo.cabeca;
+    CelulaLog *cel = &registo.celulas[pos & (LOG_CAPACIDADE - 1)];
+    if (__atomic_load_n(&cel->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return 0;
+    *r = cel->r;
+    __atomic_store_n(&cel->seq, pos + LOG_CAPACIDADE, __ATOMIC_RELEASE);
+    registo.cabeca = pos + 1;
+    return 1;
+}
+
+void registo_esperar(void)
+{
+    unsigned toque = __atomic_load_n(&registo.toque, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&registo.a_dormir, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    unsigned pos = registo.cabeca;
+    if (__atomic_load_n(&registo.celulas[pos & (LOG_CAPACIDADE - 1)].seq, __ATOMIC_ACQUIRE) != pos + 1 &&
+        !__atomic_load_n(&registo.terminar, __ATOMIC_ACQUIRE))
+        syscall(SYS_futex, &registo.toque, FUTEX_WAIT, toque, NULL, NULL, 0);
+    __atomic_store_n(&registo.a_dormir, 0, __ATOMIC_RELAXED);
+}
+
+void *thread_registo(void *arg)
+{
+    (void)arg;
+    static RegistoLog lote[LOG_LOTE + 1];
+    static char saida[(LOG_LOTE + 1) * (sizeof(RegistoLog) + 32)];
+    unsigned long descartados_avisados = 0;
+
+    while (1)
+    {
+        int n = 0;
+        while (n < LOG_LOTE && registo_ler(&lote[n]))
+            n++;
+
+        unsigned long descartados = __atomic_load_n(&registo.descartados, __ATOMIC_RELAXED);
+        if (descartados != descartados_avisados)
+        {
+            // O aviso também vai para o ficheiro binário, como um registo normal
+            RegistoLog *r = &lote[n++];
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            memset(r, 0, sizeof(*r));
+            r->instante = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            r->tempo = __atomic_load_n(&ctrl.tempo, __ATOMIC_RELAXED);
+            r->nivel = LOG_AVISO;
+            strcpy(r->tag, "[LOG]");
+            snprintf(r->texto, sizeof(r->texto), "%lu registos descartados (fila cheia).",
+                     descartados - descartados_avisados);
+            descartados_avisados = descartados;
+        }
+
+        if (n == 0)
+        {
+            if (__atomic_load_n(&registo.terminar, __ATOMIC_ACQUIRE))
+                break;
+            registo_esperar();
+            continue;
+        }
+
+        size_t len = 0;
+        for (int i = 0; i < n; i++)
+            len += snprintf(saida + len, sizeof(saida) - len, "[TEMPO %03d] %-12s %s\n",
+                            lote[i].tempo, lote[i].tag, lote[i].texto);
+        write(STDOUT_FILENO, saida, len);
+        if (registo.fd_binario != -1)
+            write(registo.fd_binario, lote, n * sizeof(RegistoLog));
+    }
+    return NULL;
+}
+
+void registo_iniciar(void)
+{
+    for (int i = 0; i < LOG_CAPACIDADE; i++)
+        registo.celulas[i].seq = i;
+
+    if (cfg.log_binario != NULL)
+    {
+        registo.fd_binario = open(cfg.log_binario, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (registo.fd_binario == -1)
+            perror("[AVISO] Não consegui abrir o ficheiro de log binário");
+    }
+
+    if (pthread_create(&registo.escritor, NULL, thread_registo, NULL) != 0)
+    {
+        perror("[AVISO] Sem thread de log; os registos vão ser escritos logo");
+        return;
+    }
+    __atomic_store_n(&registo.ativo, 1, __ATOMIC_RELEASE);
+}
+
+// Espera que a thread escreva tudo o que está no anel (chamado à saída)
+void registo_terminar(void)
+{
+    if (!__atomic_load_n(&registo.ativo, __ATOMIC_ACQUIRE) || pthread_equal(pthread_self(), registo.escritor))
+        return;
+    __atomic_store_n(&registo.terminar, 1, __ATOMIC_RELEASE);
+    registo_acordar();
+    pthread_join(registo.escritor, NULL);
+    __atomic_store_n(&registo.ativo, 0, __ATOMIC_RELEASE);
+    if (registo.fd_binario != -1)
+        close(registo.fd_binario);
+}
+
+void carregar_config(int argc, char *argv[])
+{
+    for (int i = 0; i < NOPCOES_CONFIG; i++)
+    {
+        char *env = getenv(opcoes_config[i].env);
+        if (opcoes_config[i].valor == NULL)
+        {
+            *opcoes_config[i].texto = env;
+            continue;
+        }
+        *opcoes_config[i].valor = opcoes_config[i].omissao;
+        if (env != NULL)
+            *opcoes_config[i].valor = atoi(env);
+    }
+
+    for (int a = 1; a < argc; a++)
+    {
+        int reconhecida = 0;
+        for (int i = 0; i < NOPCOES_CONFIG; i++)
+        {
+            size_t len = strlen(opcoes_config[i].nome);
+            if (strncmp(argv[a], "--", 2) == 0 && strncmp(argv[a] + 2, opcoes_config[i].nome, len) == 0 && argv[a][2 + len] == '=')
+            {
+                if (opcoes_config[i].valor == NULL)
+                    *opcoes_config[i].texto = argv[a] + 3 + len;
+                else
+                    *opcoes_config[i].valor = atoi(argv[a] + 3 + len);
+                reconhecida = 1;
+                break;
+            }
+        }
+        if (!reconhecida)
+        {
+            printf("Uso: ./controlador");
+            for (int i = 0; i < NOPCOES_CONFIG; i++)
+                printf(opcoes_config[i].valor ? " [--%s=N]" : " [--%s=FICHEIRO]", opcoes_config[i].nome);
+            printf("\n");
+            exit(1);
+        }
+    }
+
+    if (cfg.pool_max < 1)
+        cfg.pool_max = NVEICULOS;
+    if (cfg.max_utilizadores < 1)
+        cfg.max_utilizadores = NUTILIZADORES;
+    if (cfg.max_agendamentos < 1)
+        cfg.max_agendamentos = MAX_AGENDAMENTOS;
+    if (cfg.pool_min < 0)
+        cfg.pool_min = 0;
+    if (cfg.pool_min > cfg.pool_max)
+        cfg.pool_min = cfg.pool_max;
+    if (cfg.trabalhadores < 0)
+        cfg.trabalhadores = 0;
+    if (cfg.trabalhadores > TRABALHADORES_MAX)
+        cfg.trabalhadores = TRABALHADORES_MAX;
+    if (cfg.escala < 1)
+        cfg.escala = 1;
+    if (cfg.escala > 1000000)
+        cfg.escala = 1000000;
+    // Reprodução de um traço: parte do estado vazio (sem diário nem estado
+    // guardado) e corre tudo numa só thread, sem clientes nem veículos reais;
+    // as estatísticas só vão para ficheiro se forem pedidas
+    if (cfg.replay != NULL && cfg.replay[0] != '\0')
+    {
+        cfg.diario = "";
+        cfg.estado = "";
+        cfg.traco = "";
+        if (cfg.stats == NULL)
+            cfg.stats = "";
+        cfg.anel = 0;
+        cfg.discreto = 0;
+        cfg.trabalhadores = 0;
+        reproducao.ativa = 1;
+    }
+    if (cfg.stats == NULL)
+        cfg.stats = STATS_FICHEIRO;
+    if (cfg.diario == NULL)
+        cfg.diario = DIARIO_FICHEIRO;
+    if (cfg.estado == NULL)
+        cfg.estado = ESTADO_FICHEIRO;
+    if (cfg.checkpoint < 1)
+        cfg.checkpoint = 1000;
+    if (cfg.locais == NULL)
+        cfg.locais = LOCAIS_FICHEIRO;
+    if (cfg.lugares < 1)
+        cfg.lugares = 1;
+    if (cfg.lugares > LUGARES_MAX)
+        cfg.lugares = LUGARES_MAX;
+    if (cfg.partilha_janela < 0)
+        cfg.partilha_janela = 0;
+    if (cfg.partilha_raio < 0)
+        cfg.partilha_raio = 0;
+    if (cfg.traco == NULL)
+        cfg.traco = "";
+    if (cfg.replay == NULL)
+        cfg.replay = "";
+    if (cfg.replay_velocidade < 0)
+        cfg.replay_velocidade = 0;
+
+    // Shard: os limites são do sistema todo e cada shard fica com a sua
+    // parte; os ficheiros levam o número do shard e o anel (um só nome em
+    // memória partilhada) fica desligado, porque o encaminhador só fala FIFO
+    if (cfg.shards < 1)
+        cfg.shards = 1;
+    if (cfg.shard < 0 || cfg.shard >= cfg.shards)
+    {
+        printf("[ERRO] --shard tem de estar entre 0 e %d.\n", cfg.shards - 1);
+        exit(1);
+    }
+    if (cfg.shards > 1)
+    {
+        const char **nomes[] = {&cfg.stats, &cfg.diario, &cfg.estado, &cfg.log_binario, &cfg.traco};
+        static char ficheiros[sizeof(nomes) / sizeof(nomes[0])][PATH_MAX];
+        for (size_t i = 0; i < sizeof(nomes) / sizeof(nomes[0]); i++)
+        {
+            if (*nomes[i] == NULL || (*nomes[i])[0] == '\0')
+                continue;
+            snprintf(ficheiros[i], sizeof(ficheiros[i]), "%s.%d", *nomes[i], cfg.shard);
+            *nomes[i] = ficheiros[i];
+        }
+        cfg.pool_max = (cfg.pool_max + cfg.shards - 1) / cfg.shards;
+        cfg.pool_min = (cfg.pool_min + cfg.shards - 1) / cfg.shards;
+        cfg.max_utilizadores = (cfg.max_utilizadores + cfg.shards - 1) / cfg.shards;
+        cfg.max_agendamentos = (cfg.max_agendamentos + cfg.shards - 1) / cfg.shards;
+        cfg.anel = 0;
+    }
+}
+
+void gravar_stats(void);
+
+void limpar_recursos()
+{
+    registo_terminar();
+    gravar_stats();
+    diario_fechar();
+    traco_fechar();
+    if (reproducao.ativa)
+    {
+        // Os clientes e os veículos do traço não são processos nossos
+        locais_fechar(ctrl.locais);
+        return;
+    }
+    printf("\n[SISTEMA] A encerrar controlador e notificar todos...\n");
+    trancar(&m_clientes);
+    for (int i = 0; i < ctrl.clientes.capacidade; i++)
+    {
+        if (CLIENTE(i)->pid > 0)
+        {
+            kill(CLIENTE(i)->pid, SIGUSR1);
+        }
+    }
+    destrancar(&m_clientes);
+
+    trancar(&m_frota);
+    for (int i = 0; i < ctrl.frota.capacidade; i++)
+    {
+        if (FROTA(i)->pid > 0)
+        {
+            kill(FROTA(i)->pid, SIGKILL);
+            close(FROTA(i)->fd_leitura);
+            close(FROTA(i)->fd_escrita);
+        }
+    }
+    destrancar(&m_frota);
+
+    if (ctrl.fd_clientes != -1)
+        close(ctrl.fd_clientes);
+    if (ctrl.fd_clientes_escrita != -1)
+        close(ctrl.fd_clientes_escrita);
+    unlink(ctrl.fifo);
+    if (ctrl.anel != NULL)
+        anel_destruir(ctrl.anel);
+    locais_fechar(ctrl.locais);
+}
+
+void handler_sinal(int s)
+{
+    exit(0);
+}
+
+// --- Heap de despacho: agendamentos ativos e sem proposta pendente, por hora ---
+// (todas as funções heap_* e desativar_agendamento são chamadas com m_agenda)
+
+int heap_antes(int a, int b)
+{
+    if (AGENDA(a)->hora != AGENDA(b)->hora)
+        return AGENDA(a)->hora < AGENDA(b)->hora;
+    return AGENDA(a)->id < AGENDA(b)->id; // mesma hora: por ordem de pedido
+}
+
+void heap_colocar(int pos, int slot)
+{
+    ctrl.heap_agenda[pos] = slot;
+    AGENDA(slot)->pos_heap = pos;
+}
+
+void heap_subir(int pos)
+{
+    int slot = ctrl.heap_agenda[pos];
+    while (pos > 0)
+    {
+        int pai = (pos - 1) / 2;
+        if (!heap_antes(slot, ctrl.heap_agenda[pai]))
+            break;
+        heap_colocar(pos, ctrl.heap_agenda[pai]);
+        pos = pai;
+    }
+    heap_colocar(pos, slot);
+}
+
+void heap_descer(int pos)
+{
+    int slot = ctrl.heap_agenda[pos];
+    while (1)
+    {
+        int filho = 2 * pos + 1;
+        if (filho >= ctrl.heap_n)
+            break;
+        if (filho + 1 < ctrl.heap_n && heap_antes(ctrl.heap_agenda[filho + 1], ctrl.heap_agenda[filho]))
+            filho++;
+        if (!heap_antes(ctrl.heap_agenda[filho], slot))
+            break;
+        heap_colocar(pos, ctrl.heap_agenda[filho]);
+        pos = filho;
+    }
+    heap_colocar(pos, slot);
+}
+
+void heap_inserir(int slot)
+{
+    if (AGENDA(slot)->pos_heap != -1)
+        return;
+    heap_colocar(ctrl.heap_n++, slot);
+    heap_subir(ctrl.heap_n - 1);
+}
+
+void heap_remover(int slot)
+{
+    int pos = AGENDA(slot)->pos_heap;
+    if (pos == -1)
+        return;
+    AGENDA(slot)->pos_heap = -1;
+    ctrl.heap_n--;
+    if (pos == ctrl.heap_n)
+        return;
+    int ultimo = ctrl.heap_agenda[ctrl.heap_n];
+    heap_colocar(pos, ultimo);
+    heap_subir(pos);
+    heap_descer(AGENDA(ultimo)->pos_heap);
+}
+
+// Hora do próximo agendamento a despachar (-1 se não houver)
+int heap_proxima_hora(void)
+{
+    return ctrl.heap_n > 0 ? AGENDA(ctrl.heap_agenda[0])->hora : -1;
+}
+
+void ocupacao_libertar(int *ini, int *fim);
+void diario_agendamento(int tipo, int slot);
+
+void desativar_agendamento(int slot)
+{
+    diario_agendamento(DIARIO_REMOVIDO, slot);
+    AGENDA(slot)->ativo = 0;
+    heap_remover(slot);
+    ocupacao_libertar(&AGENDA(slot)->ocup_ini, &AGENDA(slot)->ocup_fim);
+    indice_remover(&ctrl.agenda_id, AGENDA(slot)->id, slot);
+    indice_remover(&ctrl.agenda_pid, AGENDA(slot)->pid_cliente, slot);
+    slab_libertar(&ctrl.agenda, slot);
+}
+
+// Agendamento ativo com este id (-1 se não existe)
+int procurar_agendamento(int id)
+{
+    int p = -1;
+    return indice_proximo(&ctrl.agenda_id, id, &p);
+}
+
+// Avisa o despacho de que pode haver agendamentos para lançar
+void acordar_despacho(void)
+{
+    pthread_mutex_lock(&m_despacho);
+    ctrl.acordar_agenda = 1;
+    pthread_cond_signal(&c_despacho);
+    pthread_mutex_unlock(&m_despacho);
+}
+
+void diario_registar(int tipo, const void *dados, int tamanho);
+
+// Regista a entrada ou saída de um cliente (chamar com m_clientes)
+void diario_cliente(int tipo, int slot)
+{
+    DiarioCliente r;
+    memset(&r, 0, sizeof(r));
+    r.pid = CLIENTE(slot)->pid;
+    snprintf(r.username, sizeof(r.username), "%s", CLIENTE(slot)->username);
+    diario_registar(tipo, &r, sizeof(r));
+}
+
+static inline FaixaSessoes *faixa_de(pid_t pid)
+{
+    return &sessoes[(uint32_t)pid % SESSOES_FAIXAS];
+}
+
+// Slot do cliente com sessão neste pid, ou -1; com username copia também o
+// nome (tam bytes). Não precisa de m_clientes, só da faixa do pid.
+int procurar_sessao(pid_t pid, char *username, size_t tam)
+{
+    FaixaSessoes *f = faixa_de(pid);
+    pthread_mutex_lock(&f->m);
+    int p = -1;
+    int i = indice_proximo(&f->pid, pid, &p);
+    if (i != -1 && username != NULL)
+        snprintf(username, tam, "%s", CLIENTE(i)->username);
+    pthread_mutex_unlock(&f->m);
+    return i;
+}
+
+// CORREÇÃO: Agora retorna int (1=Sucesso, 0=Cheio, -1=Nome já em uso). O
+// nome é verificado com o mesmo trinco da inserção: os logins chegam por
+// vários trabalhadores e pelo anel ao mesmo tempo.
+int registar_cliente(pid_t pid, const char *nome)
+{
+    trancar(&m_clientes);
+    uint64_t h_nome = hash_texto(nome);
+    int i;
+    for (int p = -1; (i = indice_proximo(&ctrl.cli_nome, h_nome, &p)) != -1;)
+    {
+        if (strcmp(CLIENTE(i)->username, nome) == 0)
+        {
+            destrancar(&m_clientes);
+            return -1;
+        }
+    }
+    i = slab_alocar(&ctrl.clientes);
+    if (i == -1)
+    {
+        destrancar(&m_clientes);
+        return 0; // Lista cheia
+    }
+    CLIENTE(i)->pid = pid;
+    strcpy(CLIENTE(i)->username, nome); // ver diferença entre strcpy e strncpy
+    indice_inserir(&ctrl.cli_nome, hash_texto(nome), i);
+    FaixaSessoes *f = faixa_de(pid);
+    pthread_mutex_lock(&f->m);
+    indice_inserir(&f->pid, pid, i);
+    pthread_mutex_unlock(&f->m);
+    diario_cliente(DIARIO_ENTROU, i);
+    destrancar(&m_clientes);
+    return 1; // Sucesso
+}
+
+// Tira o cliente da tabela sem mexer nos agendamentos dele
+void retirar_cliente(pid_t pid)
+{
+    trancar(&m_clientes);
+    FaixaSessoes *f = faixa_de(pid);
+    pthread_mutex_lock(&f->m);
+    int p = -1;
+    int i = indice_proximo(&f->pid, pid, &p);
+    if (i != -1)
+        indice_remover(&f->pid, pid, i);
+    pthread_mutex_unlock(&f->m);
+    if (i != -1)
+    {
+        diario_cliente(DIARIO_SAIU, i);
+        indice_remover(&ctrl.cli_nome, hash_texto(CLIENTE(i)->username), i);
+        CLIENTE(i)->pid = 0;
+        CLIENTE(i)->username[0] = '\0';
+        slab_libertar(&ctrl.clientes, i);
+    }
+    destrancar(&m_clientes);
+}
+
+void remover_cliente(pid_t pid)
+{
+    int cancelados = 0;
+    retirar_cliente(pid);
+
+    // Cancelar agendamentos pendentes deste cliente
+    trancar(&m_agenda);
+    int i, p = -1;
+    while ((i = indice_proximo(&ctrl.agenda_pid, pid, &p)) != -1)
+    {
+        // desativar mexe no índice, por isso recomeça a procura
+        desativar_agendamento(i);
+        cancelados++;
+        p = -1;
+    }
+    destrancar(&m_agenda);
+    if (cancelados > 0)
+    {
+        char msg[100];
+        sprintf(msg, "Cancelados %d agendamentos pendentes do cliente (PID %d).", cancelados, pid);
+        log_msg("[CANCELAR]", msg);
+    }
+}
+
+// Sai sem cancelar nada: os agendamentos ficam órfãos, como os recuperados
+// do diário, até alguém voltar a entrar com o mesmo nome. Devolve quantos.
+int largar_cliente(pid_t pid)
+{
+    int orfaos = 0;
+    retirar_cliente(pid);
+
+    trancar(&m_agenda);
+    int i, p = -1;
+    while ((i = indice_proximo(&ctrl.agenda_pid, pid, &p)) != -1)
+    {
+        if (AGENDA(i)->orfao)
+            continue;
+        AGENDA(i)->orfao = 1;
+        ctrl.agendamentos_orfaos++;
+        orfaos++;
+    }
+    destrancar(&m_agenda);
+    return orfaos;
+}
+
+// FIFO dos clientes e, se estiver ligado, o anel em memória partilhada
+void abrir_transportes(void)
+{
+    if (mkfifo(ctrl.fifo, 0666) == -1 && errno != EEXIST)
+    {
+        perror("[ERRO] Falha no mkfifo");
+        exit(1);
+    }
+
+    ctrl.fd_clientes = open(ctrl.fifo, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (ctrl.fd_clientes == -1)
+    {
+        perror("[ERRO] Falha no open do FIFO");
+        exit(1);
+    }
+    // Com uma ponta de escrita nossa o FIFO nunca fica sem escritores,
+    // por isso o epoll não acorda com EPOLLHUP quando o último cliente sai
+    ctrl.fd_clientes_escrita = open(ctrl.fifo, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (ctrl.fd_clientes_escrita == -1)
+    {
+        perror("[ERRO] Falha no open do FIFO (escrita)");
+        exit(1);
+    }
+
+    if (cfg.anel)
+    {
+        ctrl.anel = anel_criar();
+        if (ctrl.anel == NULL)
+            perror("[AVISO] Transporte em memória partilhada indisponível");
+    }
+}
+
+void setup_inicial()
+{
+    setbuf(stdout, NULL);
+    memset(&ctrl, 0, sizeof(Controlador));
+    ctrl.fd_clientes = -1;
+    ctrl.fd_clientes_escrita = -1;
+    ctrl.fd_epoll = -1;
+    ctrl.fd_relogio = -1;
+    // IDs de serviço únicos entre shards: o shard k usa k+1, k+1+shards, ...
+    ctrl.proximo_id = cfg.shard + 1;
+    if (cfg.shards > 1)
+        snprintf(ctrl.fifo, sizeof(ctrl.fifo), "%s.%d", PIPE_CONTROLADOR, cfg.shard);
+    else
+        snprintf(ctrl.fifo, sizeof(ctrl.fifo), "%s", PIPE_CONTROLADOR);
+
+    slab_iniciar(&ctrl.frota, sizeof(Veiculo), cfg.pool_max);
+    slab_iniciar(&ctrl.clientes, sizeof(ClienteInfo), cfg.max_utilizadores);
+    slab_iniciar(&ctrl.agenda, sizeof(Agendamento), cfg.max_agendamentos);
+    indice_iniciar(&ctrl.cli_nome, SLAB_BLOCO);
+    for (int f = 0; f < SESSOES_FAIXAS; f++)
+    {
+        pthread_mutex_init(&sessoes[f].m, NULL);
+        indice_iniciar(&sessoes[f].pid, SLAB_BLOCO);
+    }
+    indice_iniciar(&ctrl.agenda_id, SLAB_BLOCO);
+    indice_iniciar(&ctrl.agenda_pid, SLAB_BLOCO);
+    indice_iniciar(&ctrl.frota_id, SLAB_BLOCO);
+    indice_iniciar(&ctrl.frota_pid, SLAB_BLOCO);
+    indice_iniciar(&ctrl.grelha, SLAB_BLOCO);
+    ctrl.heap_agenda = malloc(cfg.max_agendamentos * sizeof(int));
+    if (ctrl.heap_agenda == NULL)
+    {
+        perror("[ERRO] Sem memória para a agenda");
+        exit(1);
+    }
+
+    // A reprodução não mexe no FIFO: pode correr ao lado de um controlador
+    int fd_check = reproducao.ativa ? -1 : open(ctrl.fifo, O_WRONLY | O_NONBLOCK);
+    if (fd_check != -1)
+    {
+        printf("[ERRO] Já existe uma instância do programa controlador em execução!\n");
+        close(fd_check);
+        exit(1);
+    }
+
+    signal(SIGINT, handler_sinal);
+    // Escrever para um veículo ou cliente que já morreu não pode matar o controlador
+    signal(SIGPIPE, SIG_IGN);
+    atexit(limpar_recursos);
+
+    if (!reproducao.ativa)
+        abrir_transportes();
+
+    // Relógio partilhado com os veículos: o memfd não tem O_CLOEXEC para ser
+    // herdado no exec, e o número do descritor vai no ambiente
+    int fd_mem = memfd_create("relogio", 0);
+    if (fd_mem == -1 || ftruncate(fd_mem, sizeof(RelogioPartilhado)) == -1)
+    {
+        perror("[ERRO] Falha ao criar relógio partilhado");
+        exit(1);
+    }
+    void *mapa = mmap(NULL, sizeof(RelogioPartilhado), PROT_READ | PROT_WRITE, MAP_SHARED, fd_mem, 0);
+    if (mapa == MAP_FAILED)
+    {
+        perror("[ERRO] Falha no mmap do relógio");
+        exit(1);
+    }
+    ctrl.relogio = mapa;
+    char num_fd[16];
+    snprintf(num_fd, sizeof(num_fd), "%d", fd_mem);
+    setenv(RELOGIO_ENV, num_fd, 1);
+
+    if (cfg.discreto)
+    {
+        // Modo discreto: não há ticks, o reactor salta o relógio quando tudo
+        // o que estava pendente já aconteceu
+        ctrl.fd_relogio = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (ctrl.fd_relogio == -1)
+        {
+            perror("[ERRO] Falha ao criar relógio");
+            exit(1);
+        }
+    }
+    else if (!reproducao.ativa) // na reprodução o relógio só avança com o traço
+    {
+        // Relógio simulado: cfg.escala unidades de tempo por segundo
+        long periodo_ns = 1000000000L / cfg.escala;
+        struct itimerspec periodo;
+        periodo.it_interval.tv_sec = periodo_ns / 1000000000L;
+        periodo.it_interval.tv_nsec = periodo_ns % 1000000000L;
+        periodo.it_value = periodo.it_interval;
+        ctrl.fd_relogio = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (ctrl.fd_relogio == -1 || timerfd_settime(ctrl.fd_relogio, 0, &periodo, NULL) == -1)
+        {
+            perror("[ERRO] Falha ao criar relógio");
+            exit(1);
+        }
+    }
+
+    ctrl.fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (ctrl.fd_epoll == -1)
+    {
+        perror("[ERRO] Falha no epoll_create");
+        exit(1);
+    }
+
+    int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+
+    printf("\n=== CONTROLADOR DE TÁXIS ===\n");
+    if (reproducao.ativa)
+        printf("(a reproduzir o traço %s)\n", cfg.replay);
+    else
+    {
+        printf("--- Comandos Admin ---\n");
+        printf(" listar        -> Ver agendamentos\n");
+        printf(" utiliz        -> Ver utilizadores ligados\n");
+        printf(" frota         -> Ver estado dos veículos\n");
+        printf(" km            -> Ver total de KMs\n");
+        printf(" hora          -> Ver tempo simulado\n");
+        printf(" stats         -> Ver latências e contadores\n");
+        printf(" cancelar <ID> -> Cancelar serviço (0 para todos)\n");
+        printf(" terminar      -> Encerrar sistema\n");
+        printf("----------------------------\n");
+    }
+
+    registo_iniciar();
+    log_msg("[SISTEMA]", "Controlador iniciado.");
+
+    // Sem o ficheiro do catálogo os pedidos continuam a trazer os km
+    if (cfg.locais[0] != '\0' && (ctrl.locais = locais_abrir(cfg.locais)) != NULL)
+    {
+        char msg[200];
+        snprintf(msg, sizeof(msg), "Catálogo %s: %u locais.", cfg.locais, ctrl.locais->cab->n);
+        log_msg("[LOCAIS]", msg);
+    }
+}
+
+// Entrega uma mensagem a um cliente: pelo canal dele no anel, se o tiver,
+// senão pelo FIFO. Se o canal estiver cheio usa o FIFO na mesma.
+void entregar_mensagem(pid_t pid_cli, const Trama *m)
+{
+    if (reproducao.ativa)
+    {
+        // Conta o destino e a resposta, mas não o pid do controlador
+        int32_t destino = pid_cli;
+        resumir(&destino, sizeof(destino));
+        resumir(&m->c.opcode, sizeof(m->c.opcode));
+        resumir(&m->c.seq, sizeof(m->c.seq));
+        resumir(m->dados, m->c.tamanho);
+        reproducao.respostas++;
+        return;
+    }
+    if (ctrl.anel != NULL)
+    {
+        int canal = canal_pedido_atual;
+        if (canal == -1 || ctrl.anel->canais[canal].dono != pid_cli)
+            canal = anel_canal_de(ctrl.anel, pid_cli);
+        if (canal != -1 && anel_enviar_resposta(ctrl.anel, canal, m))
+            return;
+    }
+
+    char pipe_name[100];
+    snprintf(pipe_name, sizeof(pipe_name), PIPE_CLIENTE, pid_cli);
+    int fd = open(pipe_name, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+    {
+        log_nivel(LOG_AVISO, "[AVISO]", "Não consegui abrir pipe do cliente");
+        return;
+    }
+
+    if (!trama_escrever(fd, m))
+    {
+        perror("Erro ao enviar resposta");
+    }
+    close(fd);
+}
+
+void enviar_resposta(pid_t pid_cli, int opcode, const char *mensagem)
+{
+    Trama resp;
+    trama_iniciar(&resp, opcode, getpid(), seq_pedido_atual, 0);
+    trama_texto(&resp, mensagem);
+    entregar_mensagem(pid_cli, &resp);
+}
+
+// ============================================================================
+// ESTATÍSTICAS
+// ============================================================================
+
+void mostrar_histograma(FILE *f, const char *nome, Histograma *h)
+{
+    uint64_t n = __atomic_load_n(&h->n, __ATOMIC_RELAXED);
+    if (n == 0)
+    {
+        fprintf(f, "%-14s %8s\n", nome, "0");
+        return;
+    }
+    fprintf(f, "%-14s %8lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", nome, (unsigned long)n,
+            __atomic_load_n(&h->soma, __ATOMIC_RELAXED) / 1e3 / n,
+            hist_percentil(h, 0.50) / 1e3, hist_percentil(h, 0.90) / 1e3,
+            hist_percentil(h, 0.99) / 1e3, hist_percentil(h, 0.999) / 1e3,
+            __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e3);
+}
+
+void mostrar_stats(FILE *f)
+{
+    fprintf(f, "--- LATÊNCIAS (us) ---\n");
+    fprintf(f, "%-14s %8s %9s %9s %9s %9s %9s %9s\n", "", "n", "media", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 1; i <= N_OPCODES_PEDIDO; i++)
+        mostrar_histograma(f, comandos_stats[i % N_OPCODES_PEDIDO], &stats.comando[i % N_OPCODES_PEDIDO]);
+    mostrar_histograma(f, stats.despacho.nome, &stats.despacho);
+    mostrar_histograma(f, stats.criar_veiculo.nome, &stats.criar_veiculo);
+    mostrar_histograma(f, stats.ronda.nome, &stats.ronda);
+
+    fprintf(f, "--- ESPERA POR TRINCOS (us, só com contenção) ---\n");
+    Trinco *trincos[] = {&m_clientes, &m_frota, &m_agenda};
+    for (int i = 0; i < 3; i++)
+    {
+        fprintf(f, "%s: %lu aquisições\n", trincos[i]->espera.nome,
+                (unsigned long)__atomic_load_n(&trincos[i]->aquisicoes, __ATOMIC_RELAXED));
+        mostrar_histograma(f, "  espera", &trincos[i]->espera);
+    }
+
+    fprintf(f, "--- CONTADORES ---\n");
+    fprintf(f, "Pedidos FIFO: %lu | Pedidos anel: %lu | Recusados (fila cheia): %lu | Registos descartados: %lu\n",
+            (unsigned long)__atomic_load_n(&stats.pedidos_fifo, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&stats.pedidos_anel, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&stats.pedidos_recusados, __ATOMIC_RELAXED),
+            __atomic_load_n(&registo.descartados, __ATOMIC_RELAXED));
+}
+
+void gravar_stats(void)
+{
+    if (cfg.stats == NULL || cfg.stats[0] == '\0')
+        return;
+    FILE *f = fopen(cfg.stats, "w");
+    if (f == NULL)
+    {
+        perror("[ERRO] Falha ao gravar estatísticas");
+        return;
+    }
+    mostrar_stats(f);
+    fclose(f);
+}
+
+// ============================================================================
+// LINHA TEMPORAL DE OCUPAÇÃO
+// ============================================================================
+
+// Quantos veículos estão comprometidos em cada unidade de tempo, contando
+// as viagens a decorrer e os agendamentos já aceites. É uma árvore de
+// segmentos (soma num intervalo, máximo e mínimo num intervalo) sobre uma
+// janela circular de OCUPACAO_JANELA unidades a partir do tempo atual: o
+// slot de t é t % OCUPACAO_JANELA e os slots que ficam para trás são
+// postos a zero para servirem para o futuro.
+#define OCUPACAO_JANELA (1 << 16) // potência de 2
+
+static struct
+{
+    int max[2 * OCUPACAO_JANELA];
+    int min[2 * OCUPACAO_JANELA];
+    int somar[2 * OCUPACAO_JANELA]; // ainda por passar aos filhos
+    char zerar[2 * OCUPACAO_JANELA]; // idem, aplicado antes de somar
+    int base; // tempo mais antigo da janela
+} ocupacao;
+
+static void ocup_aplicar(int no, int zerar, int v)
+{
+    if (zerar)
+    {
+        ocupacao.max[no] = ocupacao.min[no] = ocupacao.somar[no] = 0;
+        ocupacao.zerar[no] = 1;
+    }
+    ocupacao.max[no] += v;
+    ocupacao.min[no] += v;
+    ocupacao.somar[no] += v;
+}
+
+static void ocup_descer(int no)
+{
+    if (ocupacao.zerar[no] || ocupacao.somar[no])
+    {
+        ocup_aplicar(2 * no, ocupacao.zerar[no], ocupacao.somar[no]);
+        ocup_aplicar(2 * no + 1, ocupacao.zerar[no], ocupacao.somar[no]);
+        ocupacao.zerar[no] = 0;
+        ocupacao.somar[no] = 0;
+    }
+}
+
+// Soma v (ou põe a zero) os slots [a, b) do nó que cobre [l, r)
+static void ocup_alterar(int no, int l, int r, int a, int b, int zerar, int v)
+{
+    if (b <= l || r <= a)
+        return;
+    if (a <= l && r <= b)
+    {
+        ocup_aplicar(no, zerar, v);
+        return;
+    }
+    ocup_descer(no);
+    int m = (l + r) / 2;
+    ocup_alterar(2 * no, l, m, a, b, zerar, v);
+    ocup_alterar(2 * no + 1, m, r, a, b, zerar, v);
+    ocupacao.max[no] = ocupacao.max[2 * no] > ocupacao.max[2 * no + 1] ? ocupacao.max[2 * no] : ocupacao.max[2 * no + 1];
+    ocupacao.min[no] = ocupacao.min[2 * no] < ocupacao.min[2 * no + 1] ? ocupacao.min[2 * no] : ocupacao.min[2 * no + 1];
+}
+
+static int ocup_maximo(int no, int l, int r, int a, int b)
+{
+    if (b <= l || r <= a)
+        return 0;
+    if (a <= l && r <= b)
+        return ocupacao.max[no];
+    ocup_descer(no);
+    int m = (l + r) / 2;
+    int e = ocup_maximo(2 * no, l, m, a, b), d = ocup_maximo(2 * no + 1, m, r, a, b);
+    return e > d ? e : d;
+}
+
+// Primeiro slot de [a, b) com ocupação < limite (cheio = 0) ou >= limite (cheio = 1); -1 se não há
+static int ocup_procurar(int no, int l, int r, int a, int b, int limite, int cheio)
+{
+    if (b <= l || r <= a)
+        return -1;
+    if (cheio ? ocupacao.max[no] < limite : ocupacao.min[no] >= limite)
+        return -1;
+    if (r - l == 1)
+        return l;
+    ocup_descer(no);
+    int m = (l + r) / 2;
+    int e = ocup_procurar(2 * no, l, m, a, b, limite, cheio);
+    return e != -1 ? e : ocup_procurar(2 * no + 1, m, r, a, b, limite, cheio);
+}
+
+// As funções seguintes recebem tempos (não slots) e são chamadas com m_ocupacao.
+// Um intervalo [ta, tb) dentro da janela dá no máximo dois pedaços de slots.
+
+static void ocup_alterar_tempos(int ta, int tb, int zerar, int v)
+{
+    if (ta >= tb)
+        return;
+    int a = ta & (OCUPACAO_JANELA - 1), fim = a + (tb - ta);
+    ocup_alterar(1, 0, OCUPACAO_JANELA, a, fim < OCUPACAO_JANELA ? fim : OCUPACAO_JANELA, zerar, v);
+    if (fim > OCUPACAO_JANELA)
+        ocup_alterar(1, 0, OCUPACAO_JANELA, 0, fim - OCUPACAO_JANELA, zerar, v);
+}
+
+static int ocup_maximo_tempos(int ta, int tb)
+{
+    if (ta >= tb)
+        return 0;
+    int a = ta & (OCUPACAO_JANELA - 1), fim = a + (tb - ta);
+    int m = ocup_maximo(1, 0, OCUPACAO_JANELA, a, fim < OCUPACAO_JANELA ? fim : OCUPACAO_JANELA);
+    if (fim > OCUPACAO_JANELA)
+    {
+        int m2 = ocup_maximo(1, 0, OCUPACAO_JANELA, 0, fim - OCUPACAO_JANELA);
+        if (m2 > m)
+            m = m2;
+    }
+    return m;
+}
+
+static int ocup_procurar_tempos(int ta, int tb, int limite, int cheio)
+{
+    if (ta >= tb)
+        return -1;
+    int a = ta & (OCUPACAO_JANELA - 1), fim = a + (tb - ta);
+    int s = ocup_procurar(1, 0, OCUPACAO_JANELA, a, fim < OCUPACAO_JANELA ? fim : OCUPACAO_JANELA, limite, cheio);
+    if (s == -1 && fim > OCUPACAO_JANELA)
+        s = ocup_procurar(1, 0, OCUPACAO_JANELA, 0, fim - OCUPACAO_JANELA, limite, cheio);
+    return s == -1 ? -1 : ta + ((s - a) & (OCUPACAO_JANELA - 1));
+}
+
+// Último tempo que a janela cobre (exclusive)
+static int ocup_fim_janela(void)
+{
+    return ocupacao.base + OCUPACAO_JANELA;
+}
+
+// Chamado a cada avanço do relógio: o passado deixa de contar
+void ocupacao_avancar(int tempo)
+{
+    pthread_mutex_lock(&m_ocupacao);
+    if (tempo > ocupacao.base)
+    {
+        if (tempo - ocupacao.base >= OCUPACAO_JANELA)
+            ocup_aplicar(1, 1, 0);
+        else
+            ocup_alterar_tempos(ocupacao.base, tempo, 1, 0);
+        ocupacao.base = tempo;
+    }
+    pthread_mutex_unlock(&m_ocupacao);
+}
+
+// Conta [a, b) na linha temporal se em nenhum instante ficar com limite
+// ou mais veículos; guarda em *ini/*fim o que ficou contado (cortado à
+// janela) para depois o libertar. Chamar com o mutex do dono dos campos.
+int ocupacao_reservar(int *ini, int *fim, int a, int b, int limite)
+{
+    pthread_mutex_lock(&m_ocupacao);
+    if (a < ocupacao.base)
+        a = ocupacao.base;
+    if (b > ocup_fim_janela())
+        b = ocup_fim_janela();
+    if (ocup_maximo_tempos(a, b) >= limite)
+    {
+        pthread_mutex_unlock(&m_ocupacao);
+        return 0;
+    }
+    ocup_alterar_tempos(a, b, 0, 1);
+    *ini = a;
+    *fim = b;
+    pthread_mutex_unlock(&m_ocupacao);
+    return 1;
+}
+
+// Desconta o que ocupacao_reservar contou (o que já passou foi posto a zero)
+void ocupacao_libertar(int *ini, int *fim)
+{
+    pthread_mutex_lock(&m_ocupacao);
+    int a = *ini > ocupacao.base ? *ini : ocupacao.base;
+    ocup_alterar_tempos(a, *fim, 0, -1);
+    *ini = *fim = 0;
+    pthread_mutex_unlock(&m_ocupacao);
+}
+
+// Máximo de veículos comprometidos em algum instante de [a, b)
+int ocupacao_maxima(int a, int b)
+{
+    pthread_mutex_lock(&m_ocupacao);
+    if (a < ocupacao.base)
+        a = ocupacao.base;
+    if (b > ocup_fim_janela())
+        b = ocup_fim_janela();
+    int m = ocup_maximo_tempos(a, b);
+    pthread_mutex_unlock(&m_ocupacao);
+    return m;
+}
+
+// Primeiro t >= desde em que cabe uma viagem de duracao unidades sem
+// passar de limite veículos; -1 se não houver nenhum dentro da janela
+int ocupacao_proxima_vaga(int desde, int duracao, int limite)
+{
+    pthread_mutex_lock(&m_ocupacao);
+    int t = desde > ocupacao.base ? desde : ocupacao.base;
+    int ultimo = ocup_fim_janela() - duracao; // último início possível
+    while (t <= ultimo)
+    {
+        t = ocup_procurar_tempos(t, ultimo + 1, limite, 0);
+        if (t == -1)
+            break;
+        int cheio = ocup_procurar_tempos(t, t + duracao, limite, 1);
+        if (cheio == -1)
+            break;
+        t = cheio + 1;
+    }
+    pthread_mutex_unlock(&m_ocupacao);
+    return t <= ultimo ? t : -1;
+}
+
+// ============================================================================
+// DIÁRIO E RECUPERAÇÃO
+// ============================================================================
+
+void diario_registar(int tipo, const void *dados, int tamanho)
+{
+    diario_escrever(tipo, __atomic_load_n(&ctrl.tempo, __ATOMIC_RELAXED), dados, tamanho);
+}
+
+// Acrescenta ao traço (--traco) uma entrada que vai ser tratada
+void traco_evento(int tipo, const void *dados, int tamanho)
+{
+    if (traco_ativo())
+        traco_registar(tipo, __atomic_load_n(&ctrl.tempo, __ATOMIC_RELAXED), dados, tamanho);
+}
+
+// Regista o estado de um agendamento (chamar com m_agenda)
+void diario_agendamento(int tipo, int slot)
+{
+    Agendamento *a = AGENDA(slot);
+    if (tipo == DIARIO_REMOVIDO)
+    {
+        DiarioId r = {a->id};
+        diario_registar(tipo, &r, sizeof(r));
+        return;
+    }
+
+    DiarioAgendamento r;
+    memset(&r, 0, sizeof(r));
+    r.id = a->id;
+    r.pid_cliente = a->pid_cliente;
+    r.hora = a->hora;
+    r.distancia = a->distancia;
+    r.aguardar_confirmacao = a->aguardar_confirmacao;
+    r.hora_proposta = a->hora_proposta;
+    snprintf(r.username, sizeof(r.username), "%s", a->username);
+    snprintf(r.local, sizeof(r.local), "%s", a->local);
+    diario_registar(tipo, &r, sizeof(r));
+}
+
+void ler_percurso(const char *local, int *origem, int *destino);
+
+// O que a reprodução do diário vai encontrando
+static struct
+{
+    DiarioViagem *viagens; // despachadas e ainda sem registo de fim
+    int n_viagens;
+    int cap_viagens;
+    int tempo;
+    int ultimo_id;
+    long km;
+} recuperacao;
+
+static void recuperar_id(int id)
+{
+    if (id > recuperacao.ultimo_id)
+        recuperacao.ultimo_id = id;
+}
+
+static void recuperar_agendamento(int tipo, const DiarioAgendamento *r)
+{
+    int slot = procurar_agendamento(r->id);
+    if (slot == -1)
+    {
+        if (tipo != DIARIO_CRIADO)
+            return;
+        if ((slot = slab_alocar(&ctrl.agenda)) == -1)
+        {
+            log_nivel(LOG_AVISO, "[DIARIO]", "Agenda cheia: agendamento do diário ignorado.");
+            return;
+        }
+        AGENDA(slot)->id = r->id;
+        AGENDA(slot)->pid_cliente = r->pid_cliente;
+        AGENDA(slot)->ativo = 1;
+        AGENDA(slot)->pos_heap = -1;
+        AGENDA(slot)->ultimo_aviso = -10;
+        indice_inserir(&ctrl.agenda_id, r->id, slot);
+        indice_inserir(&ctrl.agenda_pid, r->pid_cliente, slot);
+    }
+    else if (AGENDA(slot)->pid_cliente != r->pid_cliente)
+    {
+        indice_remover(&ctrl.agenda_pid, AGENDA(slot)->pid_cliente, slot);
+        AGENDA(slot)->pid_cliente = r->pid_cliente;
+        indice_inserir(&ctrl.agenda_pid, r->pid_cliente, slot);
+    }
+    AGENDA(slot)->hora = r->hora;
+    AGENDA(slot)->distancia = r->distancia;
+    AGENDA(slot)->aguardar_confirmacao = r->aguardar_confirmacao;
+    AGENDA(slot)->hora_proposta = r->hora_proposta;
+    snprintf(AGENDA(slot)->username, sizeof(AGENDA(slot)->username), "%s", r->username);
+    snprintf(AGENDA(slot)->local, sizeof(AGENDA(slot)->local), "%s", r->local);
+    ler_percurso(AGENDA(slot)->local, &AGENDA(slot)->origem, &AGENDA(slot)->destino);
+}
+
+static void recuperar_viagem(const DiarioViagem *r)
+{
+    if (recuperacao.n_viagens == recuperacao.cap_viagens)
+    {
+        int cap = recuperacao.cap_viagens ? 2 * recuperacao.cap_viagens : 16;
+        DiarioViagem *novo = realloc(recuperacao.viagens, cap * sizeof(DiarioViagem));
+        if (novo == NULL)
+            return;
+        recuperacao.viagens = novo;
+        recuperacao.cap_viagens = cap;
+    }
+    recuperacao.viagens[recuperacao.n_viagens++] = *r;
+}
+
+static void recuperar_cliente(int tipo, const DiarioCliente *r)
+{
+    char nome[sizeof(r->username)];
+    snprintf(nome, sizeof(nome), "%.*s", (int)sizeof(nome) - 1, r->username);
+    if (tipo == DIARIO_ENTROU)
+        registar_cliente(r->pid, nome);
+    else
+        retirar_cliente(r->pid);
+}
+
+static void recuperar_fim_viagem(int id)
+{
+    for (int k = 0; k < recuperacao.n_viagens; k++)
+    {
+        if (recuperacao.viagens[k].id == id)
+        {
+            recuperacao.viagens[k] = recuperacao.viagens[--recuperacao.n_viagens];
+            return;
+        }
+    }
+}
+
+// Aplica um registo às tabelas (só no arranque, antes das outras threads)
+void aplicar_registo_diario(const CabecalhoDiario *c, const void *dados)
+{
+    if (c->tempo > recuperacao.tempo)
+        recuperacao.tempo = c->tempo;
+
+    switch (c->tipo)
+    {
+    case DIARIO_CRIADO:
+    case DIARIO_REAGENDADO:
+        if (c->tamanho != sizeof(DiarioAgendamento))
+            return;
+        recuperar_id(((const DiarioAgendamento *)dados)->id);
+        recuperar_agendamento(c->tipo, dados);
+        return;
+    case DIARIO_REMOVIDO:
+    {
+        if (c->tamanho != sizeof(DiarioId))
+            return;
+        int slot = procurar_agendamento(((const DiarioId *)dados)->id);
+        if (slot != -1)
+            desativar_agendamento(slot);
+        return;
+    }
+    case DIARIO_DESPACHADO:
+    {
+        if (c->tamanho != sizeof(DiarioViagem))
+            return;
+        const DiarioViagem *r = dados;
+        recuperar_id(r->id);
+        // O agendamento sai da agenda logo a seguir; se não chegou a sair, sai aqui
+        int slot = procurar_agendamento(r->id);
+        if (slot != -1)
+            desativar_agendamento(slot);
+        recuperar_viagem(r);
+        return;
+    }
+    case DIARIO_CONCLUIDO:
+        if (c->tamanho != sizeof(DiarioConcluido))
+            return;
+        recuperacao.km += ((const DiarioConcluido *)dados)->km;
+        recuperar_fim_viagem(((const DiarioConcluido *)dados)->id);
+        return;
+    case DIARIO_ENTROU:
+    case DIARIO_SAIU:
+        if (c->tamanho != sizeof(DiarioCliente))
+            return;
+        recuperar_cliente(c->tipo, dados);
+        return;
+    }
+}
+
+// Mapeia o estado guardado e carrega-o nas tabelas; devolve o LSN até onde
+// chega (0 se não houver estado utilizável)
+uint64_t carregar_estado(void)
+{
+    if (cfg.estado[0] == '\0')
+        return 0;
+    int fd = open(cfg.estado, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(CabecalhoEstado))
+    {
+        close(fd);
+        return 0;
+    }
+    const char *mapa = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapa == MAP_FAILED)
+        return 0;
+
+    const CabecalhoEstado *h = (const CabecalhoEstado *)mapa;
+    const char *corpo = mapa + sizeof(*h);
+    size_t tam_corpo = st.st_size - sizeof(*h);
+    if (memcmp(h->magico, ESTADO_MAGICO, sizeof(h->magico)) != 0 || h->versao != ESTADO_VERSAO ||
+        h->tam_agendamento != sizeof(DiarioAgendamento) || h->tam_cliente != sizeof(DiarioCliente) ||
+        h->tam_viagem != sizeof(DiarioViagem) || h->n_agendamentos < 0 || h->n_clientes < 0 || h->n_viagens < 0 ||
+        tam_corpo != (size_t)h->n_agendamentos * h->tam_agendamento + (size_t)h->n_clientes * h->tam_cliente +
+                         (size_t)h->n_viagens * h->tam_viagem ||
+        h->crc != diario_crc32(corpo, tam_corpo))
+    {
+        fprintf(stderr, "[AVISO] Estado guardado em %s inválido ou de outra versão: ignorado.\n", cfg.estado);
+        munmap((void *)mapa, st.st_size);
+        return 0;
+    }
+
+    const DiarioAgendamento *ag = (const DiarioAgendamento *)corpo;
+    for (int k = 0; k < h->n_agendamentos; k++)
+    {
+        recuperar_id(ag[k].id);
+        recuperar_agendamento(DIARIO_CRIADO, &ag[k]);
+    }
+    const DiarioCliente *cl = (const DiarioCliente *)(ag + h->n_agendamentos);
+    for (int k = 0; k < h->n_clientes; k++)
+        recuperar_cliente(DIARIO_ENTROU, &cl[k]);
+    const DiarioViagem *vg = (const DiarioViagem *)(cl + h->n_clientes);
+    for (int k = 0; k < h->n_viagens; k++)
+    {
+        recuperar_id(vg[k].id);
+        recuperar_viagem(&vg[k]);
+    }
+    recuperacao.tempo = h->tempo;
+    recuperacao.km = h->total_km;
+    recuperar_id(h->proximo_id - 1);
+
+    uint64_t lsn = h->lsn;
+    munmap((void *)mapa, st.st_size);
+    return lsn;
+}
+
+// --- Estado guardado: de cfg.checkpoint em cfg.checkpoint registos do
+// diário, as tabelas são copiadas para memória (com os trincos tomados
+// pela ordem clientes -> agenda -> frota, para a cópia corresponder
+// exatamente ao LSN lido) e só depois de os largar vão para um ficheiro
+// novo, que substitui o anterior com rename; depois o diário deita fora o
+// que o estado já inclui. ---
+static struct
+{
+    uint64_t lsn; // LSN do último estado guardado (só a thread de checkpoint mexe)
+    int ativo;
+    pthread_t t;
+} checkpoint;
+
+// 0 se falhar, com o errno da chamada que falhou
+int gravar_estado(void)
+{
+    trancar(&m_clientes);
+    trancar(&m_agenda);
+    trancar(&m_frota);
+
+    CabecalhoEstado h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magico, ESTADO_MAGICO, sizeof(h.magico));
+    h.versao = ESTADO_VERSAO;
+    h.lsn = diario_ultimo_lsn();
+    h.tempo = __atomic_load_n(&ctrl.tempo, __ATOMIC_RELAXED);
+    h.proximo_id = __atomic_load_n(&ctrl.proximo_id, __ATOMIC_RELAXED);
+    h.total_km = __atomic_load_n(&ctrl.total_km, __ATOMIC_RELAXED);
+    h.tam_agendamento = sizeof(DiarioAgendamento);
+    h.tam_cliente = sizeof(DiarioCliente);
+    h.tam_viagem = sizeof(DiarioViagem);
+    for (int i = 0; i < ctrl.agenda.capacidade; i++)
+        h.n_agendamentos += AGENDA(i)->ativo;
+    for (int i = 0; i < ctrl.clientes.capacidade; i++)
+        h.n_clientes += CLIENTE(i)->pid > 0;
+    for (int i = 0; i < ctrl.frota.capacidade; i++)
+        for (int p = 0; p < LUGARES_MAX; p++)
+            h.n_viagens += FROTA(i)->pid > 0 && FROTA(i)->ocupado && FROTA(i)->passageiros[p].no_diario;
+
+    size_t tam_corpo = (size_t)h.n_agendamentos * sizeof(DiarioAgendamento) +
+                       (size_t)h.n_clientes * sizeof(DiarioCliente) + (size_t)h.n_viagens * sizeof(DiarioViagem);
+    // Cabeçalho e corpo num só bloco, para irem num só write()
+    char *copia = calloc(1, sizeof(h) + tam_corpo);
+    int erro = errno; // os destrancar abaixo podem mexer no errno
+    if (copia != NULL)
+    {
+        DiarioAgendamento *ag = (DiarioAgendamento *)(copia + sizeof(h));
+        for (int i = 0; i < ctrl.agenda.capacidade; i++)
+        {
+            Agendamento *a = AGENDA(i);
+            if (!a->ativo)
+                continue;
+            ag->id = a->id;
+            ag->pid_cliente = a->pid_cliente;
+            ag->hora = a->hora;
+            ag->distancia = a->distancia;
+            ag->aguardar_confirmacao = a->aguardar_confirmacao;
+            ag->hora_proposta = a->hora_proposta;
+            snprintf(ag->username, sizeof(ag->username), "%s", a->username);
+            snprintf(ag->local, sizeof(ag->local), "%s", a->local);
+            ag++;
+        }
+        DiarioCliente *cl = (DiarioCliente *)ag;
+        for (int i = 0; i < ctrl.clientes.capacidade; i++)
+        {
+            if (CLIENTE(i)->pid <= 0)
+                continue;
+            cl->pid = CLIENTE(i)->pid;
+            snprintf(cl->username, sizeof(cl->username), "%s", CLIENTE(i)->username);
+            cl++;
+        }
+        DiarioViagem *vg = (DiarioViagem *)cl;
+        for (int i = 0; i < ctrl.frota.capacidade; i++)
+        {
+            Veiculo *v = FROTA(i);
+            if (v->pid <= 0 || !v->ocupado)
+                continue;
+            for (int p = 0; p < LUGARES_MAX; p++)
+            {
+                Passageiro *ps = &v->passageiros[p];
+                if (!ps->no_diario)
+                    continue;
+                vg->id = ps->id_servico;
+                vg->pid_veiculo = v->pid;
+                vg->pid_cliente = ps->pid_cliente;
+                vg->distancia = ps->distancia;
+                vg->t_inicio = v->tempo_conclusao_estimado - v->distancia_viagem;
+                vg++;
+            }
+        }
+    }
+
+    destrancar(&m_frota);
+    destrancar(&m_agenda);
+    destrancar(&m_clientes);
+
+    if (copia == NULL)
+    {
+        errno = erro;
+        return 0;
+    }
+    h.crc = diario_crc32(copia + sizeof(h), tam_corpo);
+    memcpy(copia, &h, sizeof(h));
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cfg.estado);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd != -1;
+    for (size_t feito = 0, tam = sizeof(h) + tam_corpo; ok && feito < tam;)
+    {
+        ssize_t w = write(fd, copia + feito, tam - feito);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            ok = 0;
+        else
+            feito += w;
+    }
+    ok = ok && fsync(fd) == 0;
+    erro = errno;
+    free(copia);
+    if (fd == -1)
+    {
+        errno = erro;
+        return 0;
+    }
+    close(fd);
+    if (ok && rename(tmp, cfg.estado) == -1)
+    {
+        ok = 0;
+        erro = errno;
+    }
+    if (!ok)
+    {
+        unlink(tmp);
+        errno = erro;
+        return 0;
+    }
+
+    // O rename tem de chegar ao disco antes de o diário ser cortado
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", cfg.estado);
+    char *barra = strrchr(dir, '/');
+    if (barra != NULL)
+        barra[1] = '\0';
+    int fd_dir = open(barra != NULL ? dir : ".", O_RDONLY | O_CLOEXEC);
+    if (fd_dir != -1)
+    {
+        fsync(fd_dir);
+        close(fd_dir);
+    }
+    diario_compactar(h.lsn);
+    checkpoint.lsn = h.lsn;
+
+    char msg[150];
+    snprintf(msg, sizeof(msg), "Estado guardado até ao LSN %llu (%d agendamentos, %d clientes, %d viagens).",
+             (unsigned long long)h.lsn, h.n_agendamentos, h.n_clientes, h.n_viagens);
+    log_nivel(LOG_DEBUG, "[ESTADO]", msg);
+    return 1;
+}
+
+// Verifica uma vez por segundo se o diário já cresceu o suficiente
+void *thread_checkpoint(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        sleep(1);
+        if (diario_ultimo_lsn() - checkpoint.lsn >= (uint64_t)cfg.checkpoint && !gravar_estado())
+            perror("[ERRO] Falha ao guardar o estado");
+    }
+    return NULL;
+}
+
+void iniciar_checkpoint(void)
+{
+    if (!checkpoint.ativo)
+        return;
+    if (pthread_create(&checkpoint.t, NULL, thread_checkpoint, NULL) != 0)
+    {
+        perror("[ERRO] Falha ao criar thread de checkpoint");
+        exit(1);
+    }
+    pthread_detach(checkpoint.t);
+}
+
+// O processo ainda é um veículo nosso que ficou órfão?
+int veiculo_orfao(pid_t pid)
+{
+    char caminho[64], nome[32] = "";
+    snprintf(caminho, sizeof(caminho), "/proc/%d/comm", (int)pid);
+    FILE *f = fopen(caminho, "r");
+    if (f == NULL)
+        return 0;
+    if (fgets(nome, sizeof(nome), f) == NULL)
+        nome[0] = '\0';
+    fclose(f);
+    return strcmp(nome, "veiculo\n") == 0;
+}
+
+// Carrega o estado guardado, reproduz o resto do diário e retoma o estado:
+// tempo, ids, km, clientes e agendamentos pendentes. Os pipes dos veículos
+// que estavam em viagem morreram com o controlador anterior, por isso essas
+// viagens são dadas como terminadas no último tempo conhecido (e o veículo,
+// se ainda existir, é terminado). Os clientes que ainda estão vivos
+// continuam a falar para o mesmo FIFO e ficam como estavam.
+void recuperar_estado(void)
+{
+    if (cfg.diario[0] == '\0')
+        return;
+
+    int64_t inicio = agora_ns();
+    uint64_t desde = carregar_estado();
+    long n = diario_abrir(cfg.diario, cfg.diario_sync, desde, aplicar_registo_diario);
+    if (n == -2)
+    {
+        fprintf(stderr, "[ERRO] O diário %s não continua o estado guardado em %s (LSN %llu).\n",
+                cfg.diario, cfg.estado, (unsigned long long)desde);
+        exit(1);
+    }
+    if (n == -1)
+    {
+        perror("[AVISO] Diário indisponível, o estado não será guardado");
+        return;
+    }
+    checkpoint.lsn = desde;
+    checkpoint.ativo = cfg.estado[0] != '\0';
+    if (n == 0 && desde == 0)
+        return;
+
+    // Clientes que morreram enquanto o controlador esteve em baixo
+    int clientes = 0;
+    trancar(&m_clientes);
+    for (int i = 0; i < ctrl.clientes.capacidade; i++)
+    {
+        pid_t pid = CLIENTE(i)->pid;
+        if (pid <= 0)
+            continue;
+        if (kill(pid, 0) == -1 && errno == ESRCH)
+        {
+            destrancar(&m_clientes);
+            retirar_cliente(pid);
+            trancar(&m_clientes);
+        }
+        else
+            clientes++;
+    }
+    destrancar(&m_clientes);
+
+    int tempo = recuperacao.tempo;
+    acertar_relogio(tempo);
+    ocupacao_avancar(tempo);
+
+    trancar(&m_clientes);
+    trancar(&m_agenda);
+    if (recuperacao.ultimo_id >= ctrl.proximo_id)
+    {
+        // O próximo ID deste shard depois do último usado
+        int id = recuperacao.ultimo_id + 1;
+        ctrl.proximo_id = id + ((cfg.shard - (id - 1)) % cfg.shards + cfg.shards) % cfg.shards;
+    }
+    int pendentes = 0, orfaos = 0;
+    for (int i = 0; i < ctrl.agenda.capacidade; i++)
+    {
+        if (!AGENDA(i)->ativo)
+            continue;
+        pendentes++;
+        AGENDA(i)->orfao = procurar_sessao(AGENDA(i)->pid_cliente, NULL, 0) == -1;
+        orfaos += AGENDA(i)->orfao;
+        if (!AGENDA(i)->aguardar_confirmacao)
+        {
+            heap_inserir(i);
+            ocupacao_reservar(&AGENDA(i)->ocup_ini, &AGENDA(i)->ocup_fim,
+                              AGENDA(i)->hora, AGENDA(i)->hora + AGENDA(i)->distancia, INT_MAX);
+        }
+    }
+    ctrl.agendamentos_orfaos = orfaos;
+    destrancar(&m_agenda);
+    destrancar(&m_clientes);
+
+    // Os passageiros de uma viagem partilhada (mesmo veículo e mesmo
+    // início) dividem os km entre si como o veículo teria feito
+    char msg[200];
+    for (int k = 0; k < recuperacao.n_viagens; k++)
+    {
+        DiarioViagem *v = &recuperacao.viagens[k];
+        if (v->id == 0)
+            continue;
+        DiarioViagem *grupo[LUGARES_MAX];
+        int fins[LUGARES_MAX], partes[LUGARES_MAX], n = 0, fim = 0;
+        for (int j = k; j < recuperacao.n_viagens && n < LUGARES_MAX; j++)
+        {
+            DiarioViagem *w = &recuperacao.viagens[j];
+            if (w->id == 0 || w->pid_veiculo != v->pid_veiculo || w->t_inicio != v->t_inicio)
+                continue;
+            grupo[n] = w;
+            fins[n++] = w->distancia;
+            if (w->distancia > fim)
+                fim = w->distancia;
+        }
+        if (v->pid_veiculo > 0 && veiculo_orfao(v->pid_veiculo))
+            kill(v->pid_veiculo, SIGKILL);
+        int km = tempo - v->t_inicio;
+        if (km > fim)
+            km = fim;
+        if (km < 0)
+            km = 0;
+        repartir_km(n, fins, km, partes);
+        for (int j = 0; j < n; j++)
+        {
+            recuperacao.km += partes[j];
+            DiarioConcluido r = {grupo[j]->id, partes[j]};
+            diario_registar(DIARIO_CONCLUIDO, &r, sizeof(r));
+            snprintf(msg, sizeof(msg), "Viagem ID %d (cliente PID %d) interrompida: contabilizados %d de %d km.",
+                     grupo[j]->id, grupo[j]->pid_cliente, partes[j], grupo[j]->distancia);
+            log_msg("[DIARIO]", msg);
+            grupo[j]->id = 0;
+        }
+    }
+
+    __atomic_store_n(&ctrl.total_km, (int)recuperacao.km, __ATOMIC_RELAXED);
+
+    snprintf(msg, sizeof(msg), "Estado até ao LSN %llu + %ld registos do diário em %.1f ms: t=%d, %d clientes, %d agendamentos pendentes (%d sem cliente), %d viagens interrompidas, %ld km.",
+             (unsigned long long)desde, n, (agora_ns() - inicio) / 1e6, tempo, clientes, pendentes, orfaos,
+             recuperacao.n_viagens, recuperacao.km);
+    log_msg("[DIARIO]", msg);
+    free(recuperacao.viagens);
+    memset(&recuperacao, 0, sizeof(recuperacao));
+}
+
+// Um cliente que volta com o mesmo nome fica com os agendamentos
+// recuperados do diário que eram seus (o PID antigo já não serve)
+int adotar_agendamentos(pid_t pid, const char *username)
+{
+    int adotados = 0;
+    trancar(&m_agenda);
+    for (int i = 0; ctrl.agendamentos_orfaos > 0 && i < ctrl.agenda.capacidade; i++)
+    {
+        Agendamento *a = AGENDA(i);
+        if (!a->ativo || !a->orfao || strcmp(a->username, username) != 0)
+            continue;
+        a->orfao = 0;
+        indice_remover(&ctrl.agenda_pid, a->pid_cliente, i);
+        a->pid_cliente = pid;
+        indice_inserir(&ctrl.agenda_pid, pid, i);
+        diario_agendamento(DIARIO_REAGENDADO, i);
+        ctrl.agendamentos_orfaos--;
+        adotados++;
+    }
+    destrancar(&m_agenda);
+    return adotados;
+}
+
+// ============================================================================
+// GESTÃO DE AGENDAMENTOS E FROTA (IDs)
+// ============================================================================
+
+int registar_agendamento_na_lista(int id_servico, const char *user, pid_t pid, int h, int d, char *loc, int origem, int destino, int executar)
+{
+    trancar(&m_agenda);
+    int i = slab_alocar(&ctrl.agenda);
+    if (i == -1)
+    {
+        destrancar(&m_agenda);
+        log_nivel(LOG_ERRO, "[ERRO]", "Lista de agendamentos cheia!");
+        return -1;
+    }
+
+    AGENDA(i)->id = id_servico;
+    strcpy(AGENDA(i)->username, user);
+    AGENDA(i)->pid_cliente = pid;
+    AGENDA(i)->hora = h;
+    AGENDA(i)->distancia = d;
+    strcpy(AGENDA(i)->local, loc);
+    AGENDA(i)->origem = origem;
+    AGENDA(i)->destino = destino;
+    AGENDA(i)->ativo = 1;
+    AGENDA(i)->ultimo_aviso = -10;
+    AGENDA(i)->aguardar_confirmacao = executar;
+    AGENDA(i)->pos_heap = -1;
+    if (!executar)
+        heap_inserir(i);
+    indice_inserir(&ctrl.agenda_id, id_servico, i);
+    indice_inserir(&ctrl.agenda_pid, pid, i);
+    diario_agendamento(DIARIO_CRIADO, i);
+
+    char msg[100];
+    sprintf(msg, "Agendado ID %d para t=%d (Slot %d)", id_servico, h, i);
+    log_msg("[AGENDA]", msg);
+
+    destrancar(&m_agenda);
+    return i;
+}
+
+void grelha_inserir(int idx);
+
+// Sinal a um veículo ou aviso a um cliente decidido com um trinco tomado,
+// para enviar só depois de o largar. Até o sinal seguir, o veículo não volta
+// à grelha: uma viagem nova não pode apanhar o cancelamento da anterior.
+typedef struct
+{
+    pid_t pid;
+    int sinal; // SIGUSR1 ou SINAL_CANCELAR_PASSAGEIRO; 0 = aviso ao cliente
+    int id;    // serviço (no sigqueue, ou o agendamento cancelado no aviso)
+    int idx;   // slot do veículo (-1 no aviso)
+} Adiado;
+
+typedef struct
+{
+    Adiado *a;
+    int n, cap;
+} Adiados;
+
+void executar_adiado(const Adiado *a)
+{
+    if (a->sinal == 0)
+    {
+        char aviso[100];
+        snprintf(aviso, sizeof(aviso), "O teu agendamento (ID %d) foi cancelado pelo Admin.", a->id);
+        enviar_resposta(a->pid, OP_OK, aviso);
+    }
+    else if (reproducao.ativa)
+        return; // a telemetria do cancelamento já vem no traço
+    else if (a->sinal == SINAL_CANCELAR_PASSAGEIRO)
+    {
+        union sigval valor = {.sival_int = a->id};
+        sigqueue(a->pid, a->sinal, valor);
+    }
+    else
+        kill(a->pid, a->sinal);
+}
+
+// Sem memória para a lista faz-se já, como antes (os sinais com m_frota)
+void adiar(Adiados *l, pid_t pid, int sinal, int id, int idx)
+{
+    Adiado a = {pid, sinal, id, -1};
+    if (l->n == l->cap)
+    {
+        int cap = l->cap ? l->cap * 2 : 8;
+        Adiado *novo = realloc(l->a, cap * sizeof(Adiado));
+        if (novo == NULL)
+        {
+            executar_adiado(&a);
+            return;
+        }
+        l->a = novo;
+        l->cap = cap;
+    }
+    if (idx != -1)
+    {
+        a.idx = idx;
+        FROTA(idx)->sinais_pendentes++;
+    }
+    l->a[l->n++] = a;
+}
+
+// Chamar sem trincos
+void executar_adiados(Adiados *l)
+{
+    int sinais = 0;
+    for (int k = 0; k < l->n; k++)
+    {
+        executar_adiado(&l->a[k]);
+        sinais += l->a[k].idx != -1;
+    }
+
+    // Os veículos que entretanto ficaram livres podem voltar à grelha
+    if (sinais > 0)
+    {
+        int livres = 0;
+        trancar(&m_frota);
+        for (int k = 0; k < l->n; k++)
+        {
+            Veiculo *v = l->a[k].idx != -1 ? FROTA(l->a[k].idx) : NULL;
+            if (v == NULL || v->pid != l->a[k].pid || --v->sinais_pendentes > 0)
+                continue;
+            grelha_inserir(l->a[k].idx);
+            livres += v->na_grelha;
+        }
+        destrancar(&m_frota);
+        if (livres > 0)
+            acordar_despacho();
+    }
+    free(l->a);
+    l->a = NULL;
+    l->n = l->cap = 0;
+}
+
+// Cancela a viagem do veículo (chamar com m_frota; o sinal fica em l);
+// devolve quantos serviços iam nele
+int cancelar_veiculo(int i, Adiados *l)
+{
+    adiar(l, FROTA(i)->pid, SIGUSR1, 0, i);
+    strcpy(FROTA(i)->ultimo_status, "A cancelar...");
+    char msg[100];
+    snprintf(msg, sizeof(msg), "Sinal de cancelamento enviado ao Veículo %d (%d serviço(s)).", FROTA(i)->pid, FROTA(i)->n_passageiros);
+    log_msg("[SISTEMA]", msg);
+    return FROTA(i)->n_passageiros;
+}
+
+// Cancela um só serviço do veículo; os outros passageiros de uma viagem
+// partilhada seguem viagem (chamar com m_frota; o sinal fica em l)
+int cancelar_passageiro(int i, int id_servico, Adiados *l)
+{
+    if (FROTA(i)->n_passageiros <= 1)
+        return cancelar_veiculo(i, l);
+    adiar(l, FROTA(i)->pid, SINAL_CANCELAR_PASSAGEIRO, id_servico, i);
+    char msg[100];
+    snprintf(msg, sizeof(msg), "Cancelamento do Serviço ID %d enviado ao Veículo %d (viagem partilhada).", id_servico, FROTA(i)->pid);
+    log_msg("[SISTEMA]", msg);
+    return 1;
+}
+
+// Passageiro do veículo com este serviço (-1 se não vai nele)
+int procurar_passageiro(int i, int id_servico)
+{
+    for (int p = 0; p < LUGARES_MAX; p++)
+        if (id_servico != 0 && FROTA(i)->passageiros[p].id_servico == id_servico)
+            return p;
+    return -1;
+}
+
+// Remove um agendamento pendente (chamar com m_agenda; o aviso ao
+// cliente, se foi o admin, fica em l)
+int cancelar_agendamento(int i, int pelo_admin, Adiados *l)
+{
+    int id = AGENDA(i)->id;
+    pid_t pid_cli = AGENDA(i)->pid_cliente;
+    desativar_agendamento(i);
+
+    if (pelo_admin)
+        adiar(l, pid_cli, 0, id, -1);
+
+    char msg[100];
+    snprintf(msg, sizeof(msg), "Agendamento ID %d removido da lista.", id);
+    log_msg("[SISTEMA]", msg);
+    return 1;
+}
+
+// pid_solicitante == -1 é o admin; id_cancelar == 0 cancela todos os serviços
+// do solicitante. Com os índices só se visitam os serviços afetados.
+int cancelar_servico(pid_t pid_solicitante, int id_cancelar)
+{
+    int cancelados = 0;
+    int i, p;
+    Adiados adiados = {NULL, 0, 0};
+    trancar(&m_frota);
+
+    // --- 1. Cancelar Veículos em Andamento (FROTA) ---
+    if (id_cancelar != 0)
+    {
+        p = -1;
+        i = indice_proximo(&ctrl.frota_id, id_cancelar, &p);
+        int ps = i != -1 ? procurar_passageiro(i, id_cancelar) : -1;
+        if (ps != -1 && (pid_solicitante == -1 || FROTA(i)->passageiros[ps].pid_cliente == pid_solicitante))
+            cancelados += cancelar_passageiro(i, id_cancelar, &adiados);
+    }
+    else if (pid_solicitante != -1)
+    { // CLIENTE: todos os seus (numa viagem partilhada, só os dele)
+        p = -1;
+        while ((i = indice_proximo(&ctrl.frota_pid, pid_solicitante, &p)) != -1)
+        {
+            int meus = 0;
+            for (int k = 0; k < LUGARES_MAX; k++)
+                meus += FROTA(i)->passageiros[k].id_servico != 0 && FROTA(i)->passageiros[k].pid_cliente == pid_solicitante;
+            if (meus == FROTA(i)->n_passageiros)
+            {
+                cancelados += cancelar_veiculo(i, &adiados);
+                continue;
+            }
+            for (int k = 0; k < LUGARES_MAX; k++)
+                if (FROTA(i)->passageiros[k].id_servico != 0 && FROTA(i)->passageiros[k].pid_cliente == pid_solicitante)
+                    cancelados += cancelar_passageiro(i, FROTA(i)->passageiros[k].id_servico, &adiados);
+        }
+    }
+    else
+    { // ADMIN: todos
+        for (i = 0; i < ctrl.frota.capacidade; i++)
+            if (FROTA(i)->pid > 0 && FROTA(i)->ocupado)
+                cancelados += cancelar_veiculo(i, &adiados);
+    }
+    destrancar(&m_frota);
+
+    trancar(&m_agenda);
+    // --- 2. Cancelar Agendamentos Pendentes (AGENDA) ---
+    if (id_cancelar != 0)
+    {
+        i = procurar_agendamento(id_cancelar);
+        if (i != -1 && (pid_solicitante == -1 || AGENDA(i)->pid_cliente == pid_solicitante))
+            cancelados += cancelar_agendamento(i, pid_solicitante == -1, &adiados);
+    }
+    else if (pid_solicitante != -1)
+    { // CLIENTE: cancelar mexe no índice, por isso recomeça a procura
+        p = -1;
+        while ((i = indice_proximo(&ctrl.agenda_pid, pid_solicitante, &p)) != -1)
+        {
+            cancelados += cancelar_agendamento(i, 0, &adiados);
+            p = -1;
+        }
+    }
+    else
+    { // ADMIN: todos
+        for (i = 0; i < ctrl.agenda.capacidade; i++)
+            if (AGENDA(i)->ativo)
+                cancelados += cancelar_agendamento(i, 1, &adiados);
+    }
+    destrancar(&m_agenda);
+
+    executar_adiados(&adiados);
+    return cancelados;
+}
+
+// ============================================================================
+// GESTÃO DE VEÍCULOS
+// ============================================================================
+
+// --- Índice espacial dos veículos livres: grelha uniforme de células com
+// GRELHA_CELULA de lado, guardada num Indice (célula -> veículos) para o
+// mapa não ter limites. O mais próximo procura-se em anéis de células à
+// volta do local; as distâncias são de quarteirão (|dx| + |dy|).
+// Todas as funções grelha_* são chamadas com m_frota. ---
+#define GRELHA_CELULA 8
+#define GRELHA_ANEIS 32 // depois disto percorre a frota toda
+
+// Local "x,y" de um pedido; devolve 0 se o local for só um nome
+int ler_posicao(const char *local, int *x, int *y)
+{
+    int n = 0;
+    return sscanf(local, "%d,%d%n", x, y, &n) == 2 && local[n] == '\0';
+}
+
+// --- Catálogo de locais (locais.h): os pedidos por nome guardam os índices
+// da origem e do destino, por isso o despacho e o fim da viagem só olham
+// para a matriz. O texto "Origem>Destino" fica no agendamento (e no
+// diário) para a consulta e para voltar a obter os índices ao recuperar. ---
+
+// Índices da origem e do destino de um local "Origem>Destino"; ficam a -1
+// se o local for livre ou os nomes já não estiverem no catálogo
+void ler_percurso(const char *local, int *origem, int *destino)
+{
+    *origem = *destino = -1;
+    const char *sep = strchr(local, '>');
+    if (ctrl.locais == NULL || sep == NULL || sep - local >= LOCAIS_NOME)
+        return;
+    char nome[LOCAIS_NOME];
+    memcpy(nome, local, sep - local);
+    nome[sep - local] = '\0';
+    int a = locais_procurar(ctrl.locais, nome), b = locais_procurar(ctrl.locais, sep + 1);
+    if (a != -1 && b != -1)
+    {
+        *origem = a;
+        *destino = b;
+    }
+}
+
+// agendar <hora> <origem> <destino|km>: com km (>= 0) é o pedido antigo
+// (local livre e km dados pelo cliente), só aceite sem catálogo; com ele a
+// origem e o destino vêm do catálogo e os km da matriz, nunca do cliente.
+// Devolve NULL ou o erro para o cliente.
+const char *pedido_percurso(char *loc, size_t tam_loc, const char *fim, int km, int *d, int *origem, int *destino)
+{
+    *origem = *destino = -1;
+    if (ctrl.locais == NULL)
+    {
+        if (km < 0)
+            return "Erro: Sem catálogo de locais. Use: agendar <hora> <local> <km>";
+        *d = km;
+        return NULL;
+    }
+    if (km >= 0)
+        return "Erro: Os km vêm do catálogo. Use: agendar <hora> <origem> <destino>";
+
+    int a = locais_procurar(ctrl.locais, loc), b = locais_procurar(ctrl.locais, fim);
+    if (a == -1 || b == -1)
+        return "Erro: Local desconhecido (ver o catálogo de locais).";
+    if (a == b)
+        return "Erro: A origem e o destino são o mesmo local.";
+    if ((*d = locais_distancia(ctrl.locais, a, b)) == -1)
+        return "Erro: Não há caminho entre esses locais.";
+    *origem = a;
+    *destino = b;
+    snprintf(loc, tam_loc, "%s>%s", locais_local(ctrl.locais, a)->nome, locais_local(ctrl.locais, b)->nome);
+    return NULL;
+}
+
+static inline int grelha_coord(int v)
+{
+    return v >= 0 ? v / GRELHA_CELULA : -((-v + GRELHA_CELULA - 1) / GRELHA_CELULA);
+}
+
+static inline uint64_t grelha_chave(int cx, int cy)
+{
+    return (uint64_t)(uint32_t)cx << 32 | (uint32_t)cy;
+}
+
+static inline int distancia_quarteirao(int x1, int y1, int x2, int y2)
+{
+    return abs(x1 - x2) + abs(y1 - y2);
+}
+
+// Põe o veículo na grelha se estiver livre para uma viagem
+void grelha_inserir(int idx)
+{
+    Veiculo *v = FROTA(idx);
+    if (v->na_grelha || v->pid <= 0 || v->ocupado || v->fd_escrita == -1 || v->sinais_pendentes > 0)
+        return;
+    indice_inserir(&ctrl.grelha, grelha_chave(grelha_coord(v->x), grelha_coord(v->y)), idx);
+    v->na_grelha = 1;
+    ctrl.grelha_n++;
+}
+
+void grelha_remover(int idx)
+{
+    Veiculo *v = FROTA(idx);
+    if (!v->na_grelha)
+        return;
+    indice_remover(&ctrl.grelha, grelha_chave(grelha_coord(v->x), grelha_coord(v->y)), idx);
+    v->na_grelha = 0;
+    ctrl.grelha_n--;
+}
+
+// Veículo livre mais perto de (x, y), ou -1 se não houver nenhum
+int grelha_mais_proximo(int x, int y)
+{
+    if (ctrl.grelha_n == 0)
+        return -1;
+    int cx = grelha_coord(x), cy = grelha_coord(y);
+    int melhor = -1, melhor_d = INT_MAX;
+    for (int r = 0; r <= GRELHA_ANEIS; r++)
+    {
+        // Células à distância r (em células) da do local
+        for (int dx = -r; dx <= r; dx++)
+        {
+            int passo = (dx == -r || dx == r) ? 1 : 2 * r;
+            for (int dy = -r; dy <= r; dy += passo)
+            {
+                uint64_t chave = grelha_chave(cx + dx, cy + dy);
+                int i;
+                for (int p = -1; (i = indice_proximo(&ctrl.grelha, chave, &p)) != -1;)
+                {
+                    int d = distancia_quarteirao(x, y, FROTA(i)->x, FROTA(i)->y);
+                    if (d < melhor_d)
+                    {
+                        melhor_d = d;
+                        melhor = i;
+                    }
+                }
+            }
+        }
+        // Tudo o que está para lá do anel r fica a mais de r células
+        if (melhor != -1 && melhor_d <= r * GRELHA_CELULA)
+            return melhor;
+    }
+    if (melhor != -1)
+        return melhor;
+
+    for (int i = 0; i < ctrl.frota.capacidade; i++)
+    {
+        if (!FROTA(i)->na_grelha)
+            continue;
+        int d = distancia_quarteirao(x, y, FROTA(i)->x, FROTA(i)->y);
+        if (d < melhor_d)
+        {
+            melhor_d = d;
+            melhor = i;
+        }
+    }
+    return melhor;
+}
+
+// Cliente com outro serviço ainda no veículo (frota_pid tem uma entrada
+// por cliente e veículo, mesmo que ele vá com vários serviços)
+static int cliente_no_veiculo(int idx, pid_t pid_cli)
+{
+    for (int p = 0; p < LUGARES_MAX; p++)
+        if (FROTA(idx)->passageiros[p].id_servico != 0 && FROTA(idx)->passageiros[p].pid_cliente == pid_cli)
+            return 1;
+    return 0;
+}
+
+// Associa um serviço ao veículo e indexa-o por id e por cliente (chamar com m_frota)
+void atribuir_servico_veiculo(int idx, pid_t pid_cli, int id_servico, int distancia)
+{
+    Veiculo *v = FROTA(idx);
+    if (!v->ocupado)
+    {
+        grelha_remover(idx);
+        v->ocupado = 1;
+        v->km_viagem = 0;
+    }
+    for (int p = 0; p < LUGARES_MAX; p++)
+    {
+        if (v->passageiros[p].id_servico != 0)
+            continue;
+        if (!cliente_no_veiculo(idx, pid_cli))
+            indice_inserir(&ctrl.frota_pid, pid_cli, idx);
+        v->passageiros[p] = (Passageiro){id_servico, pid_cli, distancia, 0};
+        v->n_passageiros++;
+        indice_inserir(&ctrl.frota_id, id_servico, idx);
+        return;
+    }
+}
+
+// Tira um passageiro do veículo; km é a parte dele da viagem (chamar com m_frota)
+void largar_passageiro(int idx, int p, int km)
+{
+    Veiculo *v = FROTA(idx);
+    Passageiro *ps = &v->passageiros[p];
+    if (ps->id_servico == 0)
+        return;
+    if (ps->no_diario)
+    {
+        DiarioConcluido r = {ps->id_servico, km};
+        diario_registar(DIARIO_CONCLUIDO, &r, sizeof(r));
+    }
+    indice_remover(&ctrl.frota_id, ps->id_servico, idx);
+    pid_t pid_cli = ps->pid_cliente;
+    memset(ps, 0, sizeof(*ps));
+    v->n_passageiros--;
+    if (!cliente_no_veiculo(idx, pid_cli))
+        indice_remover(&ctrl.frota_pid, pid_cli, idx);
+}
+
+// Desfaz atribuir_servico_veiculo: os passageiros que ainda lá estavam
+// saem sem km e o veículo fica livre (chamar com m_frota)
+void terminar_servico_veiculo(int idx)
+{
+    if (!FROTA(idx)->ocupado)
+        return;
+    for (int p = 0; p < LUGARES_MAX; p++)
+        largar_passageiro(idx, p, 0);
+    ocupacao_libertar(&FROTA(idx)->ocup_ini, &FROTA(idx)->ocup_fim);
+    FROTA(idx)->ocupado = 0;
+    grelha_inserir(idx);
+}
+
+// Trata um evento de telemetria do veículo (chamar com m_frota)
+void processar_frame_veiculo(int idx, const TelemetriaFrame *f)
+{
+    Veiculo *v = FROTA(idx);
+
+    // Frames de um serviço que já não é o atual (ex: cancelado e reatribuído)
+    int p = v->ocupado ? procurar_passageiro(idx, f->id_servico) : -1;
+    if (p == -1)
+        return;
+
+    switch (f->tipo)
+    {
+    case TEL_INICIO:
+        strcpy(v->ultimo_status, "Início da viagem");
+        return;
+    case TEL_PROGRESSO:
+        snprintf(v->ultimo_status, sizeof(v->ultimo_status), "Progresso: %d%% (%d/%d km)",
+                 f->percentagem, f->km, v->distancia_viagem);
+        return;
+    case TEL_CONCLUIDO:
+    case TEL_CANCELADO:
+    case TEL_FALHA:
+        break;
+    default:
+        return;
+    }
+
+    // Cada passageiro traz a sua parte dos km; a recolha conta-se uma vez,
+    // quando sai o último
+    int km = f->km > 0 ? f->km : 0;
+    int ultimo = v->n_passageiros == 1;
+    v->km_viagem += km;
+    int total = __atomic_add_fetch(&ctrl.total_km, km, __ATOMIC_RELAXED);
+    if (ultimo)
+        __atomic_add_fetch(&ctrl.km_recolha, v->km_viagem < v->recolha ? v->km_viagem : v->recolha, __ATOMIC_RELAXED);
+    if (km > 0)
+    {
+        // Confirmação visual para saberes que contou
+        char msg[100];
+        snprintf(msg, sizeof(msg), "Contabilizados +%d Km (Total: %d).", km, total);
+        log_msg("[SISTEMA]", msg);
+    }
+    if (f->tipo == TEL_FALHA)
+    {
+        char buf[100];
+        snprintf(buf, sizeof(buf), "Serviço ID %d abortado: cliente incontactável.", f->id_servico);
+        log_msg("[FROTA]", buf);
+    }
+
+    largar_passageiro(idx, p, km);
+    if (!ultimo)
+        return;
+
+    // O fim do último serviço deixa o veículo livre outra vez
+    v->livre_desde = ler_tempo();
+    terminar_servico_veiculo(idx);
+    strcpy(v->ultimo_status, "Livre");
+
+    // Agendamentos em espera por frota podem avançar
+    acordar_despacho();
+}
+
+// Liberta o slot de um veículo cujo pipe chegou ao fim (processo terminou)
+void recolher_veiculo(int idx)
+{
+    trancar(&m_frota);
+    pid_t pidv = FROTA(idx)->pid;
+    int fd = FROTA(idx)->fd_leitura;
+    int fd_escrita = FROTA(idx)->fd_escrita;
+    int servico = 0;
+    for (int p = 0; servico == 0 && FROTA(idx)->ocupado && p < LUGARES_MAX; p++)
+        servico = FROTA(idx)->passageiros[p].id_servico;
+    terminar_servico_veiculo(idx);
+    grelha_remover(idx);
+    FROTA(idx)->pid = 0;
+    FROTA(idx)->fd_leitura = -1;
+    FROTA(idx)->fd_escrita = -1;
+    FROTA(idx)->buffer_len = 0;
+    ctrl.num_veiculos--;
+    slab_libertar(&ctrl.frota, idx);
+    destrancar(&m_frota);
+
+    // close() também remove o descritor do epoll
+    if (fd > 0)
+        close(fd);
+    if (fd_escrita > 0)
+        close(fd_escrita);
+    if (!reproducao.ativa)
+        waitpid(pidv, NULL, 0);
+
+    char buf[128];
+    if (servico > 0)
+        snprintf(buf, sizeof(buf), "Veículo slot %d (PID %d) terminou a meio do serviço ID %d.", idx, (int)pidv, servico);
+    else
+        snprintf(buf, sizeof(buf), "Veículo slot %d (PID %d) terminado e recolhido.", idx, (int)pidv);
+    log_msg("[FROTA]", buf);
+}
+
+// Lê tudo o que o veículo escreveu e processa os frames completos. Só esta
+// thread lê o pipe e liberta o slot, por isso o read() e o buffer dispensam
+// m_frota; só o tratamento dos frames o toma.
+void tratar_evento_veiculo(int idx)
+{
+    int terminou = 0;
+
+    trancar(&m_frota);
+    Veiculo *v = FROTA(idx);
+    int fd = v->pid > 0 ? v->fd_leitura : -1;
+    destrancar(&m_frota);
+    if (fd == -1)
+        return;
+
+    while (1)
+    {
+        int n = read(fd, v->buffer + v->buffer_len, sizeof(v->buffer) - v->buffer_len);
+        if (n == 0)
+        {
+            terminou = 1;
+            break;
+        }
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+                terminou = 1;
+            break;
+        }
+        v->buffer_len += n;
+
+        // Uma leitura pode trazer vários frames; o resto fica para a próxima
+        int pos = 0;
+        trancar(&m_frota);
+        while (v->buffer_len - pos >= (int)sizeof(TelemetriaFrame))
+        {
+            TelemetriaFrame f;
+            memcpy(&f, v->buffer + pos, sizeof(f));
+            traco_evento(TRACO_TELEMETRIA, &f, sizeof(f));
+            processar_frame_veiculo(idx, &f);
+            pos += sizeof(TelemetriaFrame);
+        }
+        destrancar(&m_frota);
+        v->buffer_len -= pos;
+        memmove(v->buffer, v->buffer + pos, v->buffer_len);
+    }
+
+    if (terminou)
+        recolher_veiculo(idx);
+}
+
+// Lança um processo veículo com os pipes de pedidos (stdin) e relatórios
+// (stdout). Usa posix_spawn em vez de fork: o glibc faz clone(CLONE_VFORK)
+// sem copiar as tabelas de páginas do controlador, e um exec falhado vem
+// no valor de retorno. Devolve o pid, ou -1 em caso de erro.
+pid_t lancar_processo_veiculo(int *fd_leitura, int *fd_escrita)
+{
+    int p_rel[2], p_ped[2];
+
+    if (reproducao.ativa)
+    {
+        // Veículo virtual: as viagens vão para /dev/null e a telemetria
+        // vem do traço
+        *fd_leitura = -1;
+        *fd_escrita = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (*fd_escrita == -1)
+            return -1;
+        return reproducao.proximo_pid++;
+    }
+
+    if (pipe2(p_rel, O_CLOEXEC) == -1)
+    {
+        log_nivel(LOG_ERRO, "[ERRO]", "Falha pipe anónimo");
+        return -1;
+    }
+    if (pipe2(p_ped, O_CLOEXEC) == -1)
+    {
+        log_nivel(LOG_ERRO, "[ERRO]", "Falha pipe anónimo");
+        close(p_rel[0]);
+        close(p_rel[1]);
+        return -1;
+    }
+
+    // dup2 limpa o O_CLOEXEC nas cópias que ficam como stdin/stdout
+    posix_spawn_file_actions_t acoes;
+    posix_spawn_file_actions_init(&acoes);
+    posix_spawn_file_actions_adddup2(&acoes, p_ped[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&acoes, p_rel[1], STDOUT_FILENO);
+
+    // O veículo recebe SIGUSR1 para cancelar: não herda a máscara desta thread
+    posix_spawnattr_t atributos;
+    sigset_t vazia;
+    sigemptyset(&vazia);
+    posix_spawnattr_init(&atributos);
+    posix_spawnattr_setsigmask(&atributos, &vazia);
+    posix_spawnattr_setflags(&atributos, POSIX_SPAWN_SETSIGMASK);
+
+    char *args[] = {"veiculo", VEICULO_ARG_POOL, NULL};
+    pid_t pid;
+    int64_t inicio = agora_ns();
+    int erro = posix_spawn(&pid, "./veiculo", &acoes, &atributos, args, environ);
+    posix_spawn_file_actions_destroy(&acoes);
+    posix_spawnattr_destroy(&atributos);
+
+    close(p_rel[1]);
+    close(p_ped[0]);
+    if (erro != 0)
+    {
+        char buf[100];
+        snprintf(buf, sizeof(buf), "Falha ao lançar o veículo: %s", strerror(erro));
+        log_nivel(LOG_ERRO, "[ERRO]", buf);
+        close(p_rel[0]);
+        close(p_ped[1]);
+        return -1;
+    }
+    hist_registar(&stats.criar_veiculo, agora_ns() - inicio);
+
+    fcntl(p_rel[0], F_SETFL, O_NONBLOCK);
+    *fd_leitura = p_rel[0];
+    *fd_escrita = p_ped[1];
+    return pid;
+}
+
+// Põe no slot idx o veículo acabado de lançar (chamar com m_frota)
+void instalar_veiculo(int idx, pid_t pid, int fd_leitura, int fd_escrita, int t_agora)
+{
+    FROTA(idx)->pid = pid;
+    FROTA(idx)->fd_leitura = fd_leitura;
+    FROTA(idx)->fd_escrita = fd_escrita;
+    FROTA(idx)->buffer_len = 0;
+    FROTA(idx)->livre_desde = t_agora;
+    if (!FROTA(idx)->ocupado)
+        strcpy(FROTA(idx)->ultimo_status, "Livre");
+    grelha_inserir(idx);
+
+    // O reactor passa a acordar quando o veículo escrever no pipe
+    if (fd_leitura == -1)
+        return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_TAG(EV_VEICULO, idx);
+    if (epoll_ctl(ctrl.fd_epoll, EPOLL_CTL_ADD, fd_leitura, &ev) == -1)
+    {
+        perror("[ERRO] Falha ao registar veiculo no epoll");
+        exit(1);
+    }
+}
+
+// Cria o processo veículo do slot idx (já reservado com pid = -1).
+// O veículo fica livre à espera de viagens no stdin.
+int criar_veiculo(int idx)
+{
+    int fd_leitura, fd_escrita;
+    pid_t pid = lancar_processo_veiculo(&fd_leitura, &fd_escrita);
+    if (pid == -1)
+        return 0;
+
+    int t_agora = ler_tempo();
+
+    trancar(&m_frota);
+    instalar_veiculo(idx, pid, fd_leitura, fd_escrita, t_agora);
+    destrancar(&m_frota);
+    return 1;
+}
+
+// Reserva um slot vazio para um novo veículo (chamar com m_frota)
+int reservar_slot_veiculo(void)
+{
+    int i = slab_alocar(&ctrl.frota);
+    if (i == -1)
+        return -1;
+    FROTA(i)->pid = -1;
+    FROTA(i)->fd_leitura = -1;
+    FROTA(i)->fd_escrita = -1;
+    FROTA(i)->x = 0; // os veículos novos saem da base, na origem
+    FROTA(i)->y = 0;
+    FROTA(i)->lugar = -1;
+    FROTA(i)->na_grelha = 0;
+    FROTA(i)->sinais_pendentes = 0;
+    ctrl.num_veiculos++;
+    return i;
+}
+
+// Desfaz reservar_slot_veiculo quando o veículo não chegou a ser criado
+void libertar_slot_veiculo(int idx)
+{
+    trancar(&m_frota);
+    terminar_servico_veiculo(idx);
+    FROTA(idx)->pid = 0;
+    ctrl.num_veiculos--;
+    slab_libertar(&ctrl.frota, idx);
+    destrancar(&m_frota);
+}
+
+// Acrescenta até quantos veículos livres ao pool (sem passar de pool_max).
+// Os slots são reservados e os veículos instalados com uma só aquisição
+// de m_frota cada; os processos são lançados entretanto, sem o mutex.
+int aumentar_pool(int quantos)
+{
+    if (quantos <= 0)
+        return 0;
+    int *slots = malloc(quantos * sizeof(int));
+    pid_t *pids = malloc(quantos * sizeof(pid_t));
+    int (*fds)[2] = malloc(quantos * sizeof(*fds));
+    if (slots == NULL || pids == NULL || fds == NULL)
+    {
+        free(slots);
+        free(pids);
+        free(fds);
+        return 0;
+    }
+
+    int n = 0;
+    trancar(&m_frota);
+    while (n < quantos && (slots[n] = reservar_slot_veiculo()) != -1)
+        n++;
+    destrancar(&m_frota);
+
+    for (int k = 0; k < n; k++)
+        pids[k] = lancar_processo_veiculo(&fds[k][0], &fds[k][1]);
+
+    int t_agora = ler_tempo();
+
+    int criados = 0;
+    trancar(&m_frota);
+    for (int k = 0; k < n; k++)
+    {
+        if (pids[k] != -1)
+        {
+            instalar_veiculo(slots[k], pids[k], fds[k][0], fds[k][1], t_agora);
+            criados++;
+            continue;
+        }
+        FROTA(slots[k])->pid = 0;
+        ctrl.num_veiculos--;
+        slab_libertar(&ctrl.frota, slots[k]);
+    }
+    destrancar(&m_frota);
+
+    free(slots);
+    free(pids);
+    free(fds);
+    return criados;
+}
+
+// Mantém o pool entre pool_min e pool_max: repõe veículos que morreram e
+// recolhe os extra que estão livres há mais de pool_inativo
+void manter_pool(void)
+{
+    int t_agora = ler_tempo();
+
+    trancar(&m_frota);
+    int em_falta = cfg.pool_min - ctrl.num_veiculos;
+    destrancar(&m_frota);
+    aumentar_pool(em_falta);
+
+    trancar(&m_frota);
+    int excedentes = ctrl.num_veiculos - cfg.pool_min;
+    for (int i = 0; i < ctrl.frota.capacidade && excedentes > 0; i++)
+    {
+        Veiculo *v = FROTA(i);
+        if (v->pid > 0 && !v->ocupado && v->fd_escrita != -1 && t_agora - v->livre_desde >= cfg.pool_inativo)
+        {
+            // Sem stdin o veículo sai do ciclo; o EOF no pipe faz o resto
+            grelha_remover(i);
+            close(v->fd_escrita);
+            v->fd_escrita = -1;
+            strcpy(v->ultimo_status, "A terminar");
+            excedentes--;
+        }
+    }
+    destrancar(&m_frota);
+
+    // Um veículo virtual não tem EOF para o reactor ver: é recolhido já
+    // (a reprodução corre numa só thread)
+    if (reproducao.ativa)
+        for (int i = 0; i < ctrl.frota.capacidade; i++)
+            if (FROTA(i)->pid > 0 && FROTA(i)->fd_escrita == -1 && !FROTA(i)->ocupado)
+                recolher_veiculo(i);
+}
+
+// Viagem a despachar: um pedido, ou vários que partilham o veículo. Todos
+// são recolhidos no local do primeiro e deixados por ordem de distância.
+typedef struct
+{
+    int n;
+    PedidoViagem pedido[LUGARES_MAX]; // distancia = km da recolha ao destino
+    int destino[LUGARES_MAX];         // locais do catálogo (-1 = local livre)
+    int origem;
+} Viagem;
+
+void viagem_acrescentar(Viagem *vg, const char *user, int pid_cli, int dist, const char *local, int origem, int destino, int id_servico)
+{
+    if (vg->n == 0)
+        vg->origem = origem;
+    PedidoViagem *p = &vg->pedido[vg->n];
+    memset(p, 0, sizeof(*p));
+    p->id_servico = id_servico;
+    p->pid_cliente = pid_cli;
+    p->distancia = dist;
+    snprintf(p->username, sizeof(p->username), "%s", user);
+    snprintf(p->local, sizeof(p->local), "%s", local);
+    vg->destino[vg->n++] = destino;
+}
+
+// Com o catálogo, uma viagem partilhada passa pelos destinos do mais perto
+// para o mais longe da origem, e cada passageiro sai quando o carro lá
+// chega: a distância dele passa a ser a do percurso até lá
+void viagem_percurso(Viagem *vg)
+{
+    if (vg->n < 2 || vg->origem == -1)
+        return;
+    int ordem[LUGARES_MAX], fim[LUGARES_MAX];
+    for (int k = 0; k < vg->n; k++)
+    {
+        if (vg->destino[k] == -1)
+            return;
+        int j = k;
+        for (; j > 0 && vg->pedido[ordem[j - 1]].distancia > vg->pedido[k].distancia; j--)
+            ordem[j] = ordem[j - 1];
+        ordem[j] = k;
+    }
+    int km = 0, lugar = vg->origem;
+    for (int j = 0; j < vg->n; j++)
+    {
+        int k = ordem[j];
+        int d = locais_distancia(ctrl.locais, lugar, vg->destino[k]);
+        if (d == -1)
+            return;
+        km += d;
+        fim[k] = km;
+        lugar = vg->destino[k];
+    }
+    for (int k = 0; k < vg->n; k++)
+        vg->pedido[k].distancia = fim[k];
+}
+
+// limite: veículos que a linha de ocupação pode ter durante a viagem
+// (INT_MAX quando a viagem já tinha lugar reservado por um agendamento)
+int lancar_veiculo(Viagem *vg, int limite)
+{
+    viagem_percurso(vg);
+    char buffer[200];
+    int novo = 0;
+    int dist = 0, ultimo = 0; // o passageiro que sai por último
+    for (int k = 0; k < vg->n; k++)
+    {
+        if (vg->pedido[k].distancia > dist)
+        {
+            dist = vg->pedido[k].distancia;
+            ultimo = k;
+        }
+    }
+    int origem = vg->origem, destino = vg->destino[ultimo];
+
+    int t_agora = ler_tempo();
+
+    trancar(&m_frota);
+
+    // 1. Preferir o veículo livre mais perto do local (qualquer um livre,
+    // se o local for só um nome)
+    int idx = -1;
+    int x, y, com_posicao;
+    if (origem != -1)
+    {
+        x = locais_local(ctrl.locais, origem)->x;
+        y = locais_local(ctrl.locais, origem)->y;
+        com_posicao = 1;
+    }
+    else
+        com_posicao = ler_posicao(vg->pedido[0].local, &x, &y);
+    if (com_posicao)
+        idx = grelha_mais_proximo(x, y);
+    else
+    {
+        for (int i = 0; i < ctrl.frota.capacidade; ++i)
+        {
+            if (FROTA(i)->pid > 0 && !FROTA(i)->ocupado && FROTA(i)->fd_escrita != -1)
+            {
+                idx = i;
+                break;
+            }
+        }
+    }
+
+    // 2. Se não houver, o pool cresce até pool_max
+    if (idx == -1)
+    {
+        idx = reservar_slot_veiculo();
+        novo = 1;
+    }
+
+    if (idx == -1)
+    {
+        destrancar(&m_frota);
+        return 0;
+    }
+
+    // O caminho até ao cliente faz parte da viagem (e ocupa o veículo); de
+    // um local do catálogo para outro é o da matriz
+    int recolha = -1;
+    if (origem != -1 && FROTA(idx)->lugar != -1)
+        recolha = locais_distancia(ctrl.locais, FROTA(idx)->lugar, origem);
+    if (recolha == -1)
+        recolha = com_posicao ? distancia_quarteirao(FROTA(idx)->x, FROTA(idx)->y, x, y) : 0;
+
+    // 3. Não tirar o veículo a agendamentos já aceites, contando a recolha.
+    // Não se tenta outro: o escolhido já é o de recolha mais curta.
+    int ocup_ini, ocup_fim;
+    if (!ocupacao_reservar(&ocup_ini, &ocup_fim, t_agora, t_agora + recolha + dist, limite))
+    {
+        if (novo)
+        {
+            // Desfaz reservar_slot_veiculo (libertar_slot_veiculo tranca)
+            FROTA(idx)->pid = 0;
+            ctrl.num_veiculos--;
+            slab_libertar(&ctrl.frota, idx);
+        }
+        destrancar(&m_frota);
+        return 0;
+    }
+    if (destino != -1)
+    {
+        // Com o catálogo sabe-se onde a viagem acaba
+        FROTA(idx)->x = locais_local(ctrl.locais, destino)->x;
+        FROTA(idx)->y = locais_local(ctrl.locais, destino)->y;
+    }
+    else if (com_posicao)
+    {
+        FROTA(idx)->x = x;
+        FROTA(idx)->y = y;
+    }
+    FROTA(idx)->lugar = destino;
+
+    for (int k = 0; k < vg->n; k++)
+        atribuir_servico_veiculo(idx, vg->pedido[k].pid_cliente, vg->pedido[k].id_servico, recolha + vg->pedido[k].distancia);
+    FROTA(idx)->distancia_viagem = recolha + dist;
+    FROTA(idx)->recolha = recolha;
+    FROTA(idx)->tempo_conclusao_estimado = t_agora + recolha + dist; //calcula quando carro acaba
+    FROTA(idx)->ocup_ini = ocup_ini;
+    FROTA(idx)->ocup_fim = ocup_fim;
+    strcpy(FROTA(idx)->ultimo_status, "A iniciar");
+    destrancar(&m_frota);
+
+    if (novo && !criar_veiculo(idx))
+    {
+        // Temos de libertar o lugar que reservámos
+        libertar_slot_veiculo(idx);
+        return 0;
+    }
+
+    for (int k = 0; k < vg->n; k++)
+    {
+        PedidoViagem *pedido = &vg->pedido[k];
+        pedido->distancia += recolha;
+        pedido->recolha = recolha;
+        pedido->t_inicio = t_agora; // o veículo conta os km a partir daqui
+        pedido->passageiros = vg->n;
+    }
+
+    // O veículo pode ter morrido (e o slot ter sido reaproveitado) desde que
+    // a viagem lhe foi atribuída: só segue se o slot ainda a tiver. O pipe
+    // é duplicado com o trinco para o número não poder ser reaproveitado
+    // por outro open() se o reator fechar o original antes do write.
+    int id_viagem = vg->pedido[0].id_servico, p_id = -1;
+    trancar(&m_frota);
+    int fd = -1;
+    if (indice_proximo(&ctrl.frota_id, id_viagem, &p_id) == idx)
+        fd = fcntl(FROTA(idx)->fd_escrita, F_DUPFD_CLOEXEC, 0);
+    if (fd != -1)
+    {
+        for (int k = 0; k < vg->n; k++)
+        {
+            PedidoViagem *pedido = &vg->pedido[k];
+            DiarioViagem r = {pedido->id_servico, FROTA(idx)->pid, pedido->pid_cliente, pedido->distancia, t_agora};
+            snprintf(r.username, sizeof(r.username), "%s", pedido->username);
+            diario_registar(DIARIO_DESPACHADO, &r, sizeof(r));
+        }
+        for (int p = 0; p < LUGARES_MAX; p++)
+            FROTA(idx)->passageiros[p].no_diario = FROTA(idx)->passageiros[p].id_servico != 0;
+    }
+    destrancar(&m_frota);
+
+    // Os pedidos de uma viagem vão num só write (cabem em PIPE_BUF)
+    ssize_t tam = vg->n * sizeof(PedidoViagem);
+    int enviado = fd != -1 && write(fd, vg->pedido, tam) == tam;
+    if (fd != -1)
+        close(fd);
+    if (!enviado)
+    {
+        // O veículo morreu entretanto; o EOF no pipe liberta o slot. Os
+        // passageiros saem com 0 km e os agendamentos que ficam (o despacho
+        // adia-os) vão outra vez inteiros para o diário, porque ao relê-lo
+        // o DESPACHADO acima já os tirou da agenda
+        trancar(&m_frota);
+        p_id = -1;
+        if (indice_proximo(&ctrl.frota_id, id_viagem, &p_id) == idx)
+            terminar_servico_veiculo(idx);
+        destrancar(&m_frota);
+        trancar(&m_agenda);
+        for (int k = 0; k < vg->n; k++)
+        {
+            int slot = procurar_agendamento(vg->pedido[k].id_servico);
+            if (slot != -1)
+                diario_agendamento(DIARIO_CRIADO, slot);
+        }
+        destrancar(&m_agenda);
+        return 0;
+    }
+
+    int n = snprintf(buffer, sizeof(buffer), "Veículo enviado (Serviço ID %d) para %s",
+                     vg->pedido[0].id_servico, vg->pedido[0].username);
+    for (int k = 1; k < vg->n && n < (int)sizeof(buffer); k++)
+        n += snprintf(buffer + n, sizeof(buffer) - n, " + (ID %d) %s", vg->pedido[k].id_servico, vg->pedido[k].username);
+    if (recolha > 0 && n < (int)sizeof(buffer))
+        snprintf(buffer + n, sizeof(buffer) - n, ", a %d km", recolha);
+    log_msg("[FROTA]", buffer);
+    return 1;
+}
+
+// Posição de um agendamento no mapa, se a tiver (chamar com m_agenda)
+static int posicao_agendamento(const Agendamento *a, int *x, int *y)
+{
+    if (a->origem != -1)
+    {
+        *x = locais_local(ctrl.locais, a->origem)->x;
+        *y = locais_local(ctrl.locais, a->origem)->y;
+        return 1;
+    }
+    return ler_posicao(a->local, x, y);
+}
+
+// b pode ir na viagem de a: recolha a menos de partilha_raio e hora até
+// partilha_janela depois da de a (chamar com m_agenda)
+int agendamentos_compativeis(const Agendamento *a, const Agendamento *b)
+{
+    if (b->hora - a->hora > cfg.partilha_janela)
+        return 0;
+    if (a->origem != -1 && b->origem != -1)
+    {
+        int d = locais_distancia(ctrl.locais, a->origem, b->origem);
+        return a->origem == b->origem || (d != -1 && d <= cfg.partilha_raio);
+    }
+    int ax, ay, bx, by;
+    if (posicao_agendamento(a, &ax, &ay) && posicao_agendamento(b, &bx, &by))
+        return distancia_quarteirao(ax, ay, bx, by) <= cfg.partilha_raio;
+    return strcmp(a->local, b->local) == 0;
+}
+
+// Junta os agendamentos vencidos (por ordem de hora) em viagens partilhadas
+// de até cfg.lugares passageiros: grupo[k] é o primeiro da viagem de k. Os
+// que já saíram do heap por estarem dentro da janela (hora no futuro) só
+// vão como acompanhantes; os que ficarem sozinhos voltam para o heap.
+// Devolve o número de viagens (chamar com m_agenda).
+int agrupar_agendamentos(int *vencidos, int *grupo, int n, int tempo_atual)
+{
+    int viagens = 0;
+    for (int k = 0; k < n; k++)
+        grupo[k] = -1;
+    for (int k = 0; k < n; k++)
+    {
+        if (grupo[k] != -1)
+            continue;
+        Agendamento *a = AGENDA(vencidos[k]);
+        if (a->hora > tempo_atual)
+        {
+            heap_inserir(vencidos[k]);
+            continue;
+        }
+        grupo[k] = k;
+        viagens++;
+        for (int j = k + 1, lugares = 1; j < n && lugares < cfg.lugares; j++)
+        {
+            Agendamento *b = AGENDA(vencidos[j]);
+            if (b->hora - a->hora > cfg.partilha_janela)
+                break;
+            if (grupo[j] == -1 && agendamentos_compativeis(a, b))
+            {
+                grupo[j] = k;
+                lugares++;
+            }
+        }
+    }
+    return viagens;
+}
+
+// Frota cheia para um agendamento vencido: propõe nova hora, no máximo de
+// 5 em 5 unidades de tempo, ou volta a tentar no próximo tick
+void adiar_agendamento(int i, int id_serv, int tempo_atual)
+{
+    int proxima_vaga = -1;
+    trancar(&m_agenda);
+    if (!AGENDA(i)->ativo || AGENDA(i)->id != id_serv)
+    {
+        destrancar(&m_agenda);
+        return;
+    }
+    int propor = tempo_atual - AGENDA(i)->ultimo_aviso >= 5;
+    int dist = AGENDA(i)->distancia;
+    pid_t pid_cli = AGENDA(i)->pid_cliente;
+    destrancar(&m_agenda);
+    if (propor)
+    {
+        proxima_vaga = ocupacao_proxima_vaga(tempo_atual + 1, dist, cfg.pool_max);
+        if (proxima_vaga <= tempo_atual)
+            proxima_vaga = tempo_atual + 5;
+    }
+
+    trancar(&m_agenda);
+    if (!AGENDA(i)->ativo || AGENDA(i)->id != id_serv)
+    {
+        destrancar(&m_agenda);
+        return;
+    }
+    if (!propor || AGENDA(i)->hora > tempo_atual)
+    {
+        // Volta ao heap; tenta outra vez no próximo tick ou quando um veículo
+        // ficar livre (ou à sua hora, se só ia adiantado numa viagem partilhada)
+        heap_inserir(i);
+        destrancar(&m_agenda);
+        return;
+    }
+    // MARCA COMO AGUARDANDO RESPOSTA (o lugar só volta a ser reservado se aceitar)
+    ocupacao_libertar(&AGENDA(i)->ocup_ini, &AGENDA(i)->ocup_fim);
+    AGENDA(i)->aguardar_confirmacao = 1;
+    AGENDA(i)->hora_proposta = proxima_vaga;
+    AGENDA(i)->ultimo_aviso = tempo_atual;
+    diario_agendamento(DIARIO_REAGENDADO, i);
+    destrancar(&m_agenda);
+
+    char proposta[200];
+    sprintf(proposta, "Frota cheia. Aceitas reagendar ID %d para t=%d? (Escreve: decisao %d s)", id_serv, proxima_vaga, id_serv);
+    enviar_resposta(pid_cli, OP_STATUS, proposta);
+}
+
+// Lança os agendamentos cuja hora já chegou. Só olha para o topo do heap,
+// por isso custa O(log n) por agendamento despachado. Com cfg.lugares > 1
+// os que têm a mesma recolha vão juntos no mesmo veículo.
+void verificar_agendamentos(void)
+{
+    // O instante lido depois do tempo é o desse avanço ou de um mais recente
+    int tempo_atual = ler_tempo();
+    int64_t instante_tempo = __atomic_load_n(&ctrl.instante_tempo, __ATOMIC_RELAXED);
+    // Duração real de uma unidade de tempo (no modo discreto o relógio salta)
+    int64_t periodo_ns = cfg.discreto ? 0 : 1000000000LL / cfg.escala;
+
+    // Só esta thread despacha, por isso os vetores podem ser reaproveitados
+    static int *vencidos = NULL, *ids = NULL, *grupo = NULL;
+    static int cap_vencidos = 0;
+    int n = 0;
+
+    trancar(&m_agenda);
+    if (cap_vencidos < ctrl.heap_n)
+    {
+        cap_vencidos = ctrl.heap_n;
+        vencidos = realloc(vencidos, cap_vencidos * sizeof(int));
+        ids = realloc(ids, cap_vencidos * sizeof(int));
+        grupo = realloc(grupo, cap_vencidos * sizeof(int));
+        if (vencidos == NULL || ids == NULL || grupo == NULL)
+        {
+            perror("[ERRO] Sem memória para o despacho");
+            exit(1);
+        }
+    }
+    // Com partilha, os que estão dentro da janela podem ir já como
+    // acompanhantes de um vencido
+    int vencidos_agora = 0;
+    int limite = cfg.lugares > 1 ? tempo_atual + cfg.partilha_janela : tempo_atual;
+    while (ctrl.heap_n > 0 && heap_proxima_hora() <= limite)
+    {
+        int i = ctrl.heap_agenda[0];
+        heap_remover(i);
+        vencidos_agora += AGENDA(i)->hora <= tempo_atual;
+        vencidos[n] = i;
+        ids[n++] = AGENDA(i)->id;
+    }
+    int viagens = n;
+    if (vencidos_agora == 0)
+    {
+        for (int k = 0; k < n; k++)
+            heap_inserir(vencidos[k]);
+        n = viagens = 0;
+    }
+    else if (cfg.lugares > 1)
+        viagens = agrupar_agendamentos(vencidos, grupo, n, tempo_atual);
+    else
+        for (int k = 0; k < n; k++)
+            grupo[k] = k;
+    destrancar(&m_agenda);
+
+    // Vários agendamentos na mesma hora: lança de uma vez os veículos que
+    // faltam em vez de um a um dentro do ciclo
+    if (viagens > 1)
+    {
+        int livres = 0;
+        trancar(&m_frota);
+        for (int i = 0; i < ctrl.frota.capacidade; i++)
+            if (FROTA(i)->pid > 0 && !FROTA(i)->ocupado && FROTA(i)->fd_escrita != -1)
+                livres++;
+        destrancar(&m_frota);
+        if (viagens - livres > 1)
+            aumentar_pool(viagens - livres);
+    }
+
+    for (int k = 0; k < n; k++)
+    {
+        if (grupo[k] != k)
+            continue;
+
+        // copiar para variáveis locais (podem ter sido cancelados entretanto)
+        Viagem vg = {0};
+        int membros[LUGARES_MAX], horas[LUGARES_MAX];
+        trancar(&m_agenda);
+        for (int j = k; j < n && vg.n < LUGARES_MAX; j++)
+        {
+            int i = vencidos[j];
+            if (grupo[j] != k || !AGENDA(i)->ativo || AGENDA(i)->id != ids[j])
+                continue;
+            Agendamento *a = AGENDA(i);
+            membros[vg.n] = j;
+            horas[vg.n] = a->hora;
+            viagem_acrescentar(&vg, a->username, a->pid_cliente, a->distancia, a->local, a->origem, a->destino, a->id);
+        }
+        destrancar(&m_agenda);
+        if (vg.n == 0)
+            continue;
+
+        if (lancar_veiculo(&vg, INT_MAX))
+        {
+            char aviso[100] = "Viatura a caminho.";
+            if (vg.n > 1)
+                snprintf(aviso, sizeof(aviso), "Viatura a caminho (viagem partilhada, %d passageiros).", vg.n);
+            for (int m = 0; m < vg.n; m++)
+            {
+                // Atraso desde que o relógio chegou à hora marcada (estimado a
+                // partir do último tick quando o agendamento já vinha de trás)
+                if (horas[m] <= tempo_atual)
+                    hist_registar(&stats.despacho, agora_ns() - instante_tempo + (int64_t)(tempo_atual - horas[m]) * periodo_ns);
+
+                int i = vencidos[membros[m]];
+                trancar(&m_agenda);
+                if (AGENDA(i)->ativo && AGENDA(i)->id == ids[membros[m]])
+                    desativar_agendamento(i);
+                destrancar(&m_agenda);
+                enviar_resposta(vg.pedido[m].pid_cliente, OP_OK, aviso);
+            }
+            continue;
+        }
+
+        for (int m = 0; m < vg.n; m++)
+            adiar_agendamento(vencidos[membros[m]], ids[membros[m]], tempo_atual);
+    }
+}
+
+// Dorme até haver trabalho para o despacho: um agendamento novo, uma
+// decisão de reagendamento, um veículo livre ou um tick com algo vencido
+void esperar_despacho(void)
+{
+    pthread_mutex_lock(&m_despacho);
+    while (!ctrl.acordar_agenda)
+        pthread_cond_wait(&c_despacho, &m_despacho);
+    ctrl.acordar_agenda = 0;
+    ctrl.despacho_ativo = 1;
+    pthread_mutex_unlock(&m_despacho);
+}
+
+// Fim de uma ronda do despacho; no modo discreto o reactor pode voltar a avançar o relógio
+void terminar_despacho(void)
+{
+    pthread_mutex_lock(&m_despacho);
+    ctrl.despacho_ativo = 0;
+    pthread_mutex_unlock(&m_despacho);
+
+    if (cfg.discreto)
+    {
+        uint64_t um = 1;
+        write(ctrl.fd_relogio, &um, sizeof(um));
+    }
+}
+
+// ============================================================================
+// GESTÃO DE PEDIDOS (CLIENTES)
+// ============================================================================
+
+// Linhas de texto guardadas para enviar depois de largar os mutexes
+#define TAM_LINHA 256
+
+typedef struct
+{
+    char *texto; // n linhas de TAM_LINHA
+    int n, cap;
+} Linhas;
+
+// Devolve espaço para mais uma linha, ou NULL se não houver memória
+char *nova_linha(Linhas *l)
+{
+    if (l->n == l->cap)
+    {
+        int cap = l->cap ? l->cap * 2 : 8;
+        char *novo = realloc(l->texto, (size_t)cap * TAM_LINHA);
+        if (novo == NULL)
+            return NULL;
+        l->texto = novo;
+        l->cap = cap;
+    }
+    return l->texto + (size_t)(l->n++) * TAM_LINHA;
+}
+
+// Um tratador por opcode. Quando é chamado a trama já tem o tamanho de
+// dados certo para o opcode e username é o da sessão do cliente.
+void pedido_login(const Trama *t, const char *sessao)
+{
+    char msg_buf[300];
+    const char *username = t->dados;
+    (void)sessao;
+    if (username[0] == '\0' || strlen(username) >= sizeof(CLIENTE(0)->username))
+    {
+        enviar_resposta(t->c.pid, OP_ERRO, "Nome de utilizador inválido.");
+        return;
+    }
+    // CORREÇÃO: Verifica se realmente conseguiu registar (se havia espaço)
+    int registo = registar_cliente(t->c.pid, username);
+    if (registo == -1)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), "Utilizador '%s' ja existe.", username);
+        enviar_resposta(t->c.pid, OP_ERRO, msg_buf);
+        log_msg("[LOGIN]", "Rejeitado: nome duplicado."); // Log adicional
+    }
+    else if (registo == 1)
+    {
+        // O cliente só lê uma resposta ao login, por isso o aviso vai nela
+        int adotados = adotar_agendamentos(t->c.pid, username);
+        if (adotados > 0)
+        {
+            snprintf(msg_buf, sizeof(msg_buf), "Login aceite. Recuperados %d agendamentos teus (usa consultar).", adotados);
+            enviar_resposta(t->c.pid, OP_OK, msg_buf);
+        }
+        else
+            enviar_resposta(t->c.pid, OP_OK, "Login aceite.");
+        sprintf(msg_buf, "Cliente %s (PID %d) entrou.", username, t->c.pid);
+        log_msg("[LOGIN]", msg_buf);
+    }
+    else
+    {
+        // Se a função retornou 0, é porque não havia espaço
+        enviar_resposta(t->c.pid, OP_ERRO, "Servidor cheio! Tente mais tarde.");
+        log_msg("[LOGIN]", "Rejeitado: Servidor cheio.");
+    }
+}
+
+void pedido_agendar(const Trama *t, const char *username)
+{
+    char msg_buf[300];
+    char loc[100];
+    DadosAgendar dados;
+    memcpy(&dados, t->dados, sizeof(dados));
+    int h = dados.hora, d;
+
+    // Depois dos números vêm a origem e o destino, cada um com o seu '\0'
+    const char *nome_origem = t->dados + sizeof(dados);
+    const char *nome_destino = nome_origem + strlen(nome_origem) + 1;
+    int origem, destino;
+    const char *erro = NULL;
+    if (nome_destino > t->dados + t->c.tamanho || strlen(nome_origem) >= sizeof(loc) || nome_origem[0] == '\0')
+        erro = "Erro sintaxe. Use: agendar <hora> <origem> <destino|km>";
+    else
+    {
+        snprintf(loc, sizeof(loc), "%s", nome_origem);
+        erro = pedido_percurso(loc, sizeof(loc), nome_destino, dados.km, &d, &origem, &destino);
+    }
+    if (erro != NULL)
+    {
+        enviar_resposta(t->c.pid, OP_ERRO, erro);
+    }
+    else
+    {
+        int novo_id = __atomic_fetch_add(&ctrl.proximo_id, cfg.shards, __ATOMIC_RELAXED);
+
+        sprintf(msg_buf, "Pedido Agendar (ID %d): %s, %dkm, %dh", novo_id, loc, d, h);
+        log_msg("[PEDIDO]", msg_buf);
+
+        int tempo_atual = ler_tempo();
+        if (h < tempo_atual)
+        {
+            char erro_msg[100];
+            sprintf(erro_msg, "Erro: Impossível agendar para %d (Atual: %d).", h, tempo_atual);
+            enviar_resposta(t->c.pid, OP_ERRO, erro_msg);
+        }
+        else if (h == tempo_atual)
+        {
+            Viagem vg = {0};
+            viagem_acrescentar(&vg, username, t->c.pid, d, loc, origem, destino, novo_id);
+            if (lancar_veiculo(&vg, cfg.pool_max))
+            {
+                char resp[100];
+                sprintf(resp, "Sucesso: Serviço ID %d iniciado de imediato!", novo_id);
+                enviar_resposta(t->c.pid, OP_OK, resp);
+            }
+            else
+            {
+                // FROTA CHEIA: Adicionar à lista 
+                int idx = registar_agendamento_na_lista(novo_id, username, t->c.pid, h, d, loc, origem, destino, 1);
+                if(idx != -1){
+                    int proxima_vaga = ocupacao_proxima_vaga(tempo_atual + 1, d, cfg.pool_max);
+
+                    if(proxima_vaga <= tempo_atual) 
+                        proxima_vaga = tempo_atual + 2;
+    
+                        // 3. Modifica o agendamento que acabámos de criar para ficar "Bloqueado" à espera de resposta
+                        trancar(&m_agenda);
+                        
+                        AGENDA(idx)->aguardar_confirmacao = 1;
+                        AGENDA(idx)->hora_proposta = proxima_vaga;
+                        AGENDA(idx)->ultimo_aviso = tempo_atual;
+                        diario_agendamento(DIARIO_REAGENDADO, idx);
+                        
+                        destrancar(&m_agenda);
+                        
+                        char confirm[100];
+                        sprintf(confirm, "Frota cheia! Agendamento ID %d colocado em espera prioritária.", novo_id);
+                        enviar_resposta(t->c.pid, OP_AVISO, confirm);
+                
+                }
+                else
+                {
+                    enviar_resposta(t->c.pid, OP_ERRO, "Frota e agenda cheias! Tente mais tarde.");
+                }
+                
+            }
+        }
+        else
+        {
+            // Admissão pela linha de ocupação: conta as viagens a decorrer
+            // e os agendamentos já aceites que se sobrepõem a [h, h+d)
+            int idx = -1;
+            if (h + d > tempo_atual + OCUPACAO_JANELA)
+            {
+                char erro_msg[100];
+                sprintf(erro_msg, "Erro: Só se aceitam agendamentos até t=%d (Atual: %d).", tempo_atual + OCUPACAO_JANELA - d, tempo_atual);
+                enviar_resposta(t->c.pid, OP_ERRO, erro_msg);
+            }
+            else if ((idx = registar_agendamento_na_lista(novo_id, username, t->c.pid, h, d, loc, origem, destino, 1)) == -1)
+            {
+                enviar_resposta(t->c.pid, OP_ERRO, "Agenda cheia! Tente mais tarde.");
+            }
+            else
+            {
+                int proxima_vaga = -1;
+                trancar(&m_agenda);
+                int admitido = ocupacao_reservar(&AGENDA(idx)->ocup_ini, &AGENDA(idx)->ocup_fim, h, h + d, cfg.pool_max);
+                if (admitido)
+                {
+                    AGENDA(idx)->aguardar_confirmacao = 0;
+                    heap_inserir(idx);
+                }
+                else
+                {
+                    proxima_vaga = ocupacao_proxima_vaga(h + 1, d, cfg.pool_max);
+                    if (proxima_vaga <= h)
+                        proxima_vaga = h + 5;
+                    AGENDA(idx)->hora_proposta = proxima_vaga;
+                    AGENDA(idx)->ultimo_aviso = tempo_atual;
+                }
+                diario_agendamento(DIARIO_REAGENDADO, idx);
+                destrancar(&m_agenda);
+
+                char confirm[200];
+                if (admitido)
+                {
+                    sprintf(confirm, "Sucesso: Agendamento ID %d registado para t=%d.", novo_id, h);
+                    enviar_resposta(t->c.pid, OP_OK, confirm);
+                }
+                else
+                {
+                    sprintf(confirm, "Previsão: Frota cheia em t=%d. Aceitas reagendar ID %d para t=%d? (decisao %d s)", h, novo_id, proxima_vaga, novo_id);
+                    enviar_resposta(t->c.pid, OP_STATUS, confirm);
+                }
+            }
+        }
+    }
+}
+
+void pedido_consultar(const Trama *t, const char *username)
+{
+    (void)username;
+    // Só formata as linhas com os mutexes tomados; o envio é feito depois
+    Linhas linhas = {NULL, 0, 0};
+    char *linha;
+
+    int i;
+    trancar(&m_agenda);
+    for (int p = -1; (i = indice_proximo(&ctrl.agenda_pid, t->c.pid, &p)) != -1;)
+    {
+        if ((linha = nova_linha(&linhas)) == NULL)
+            break;
+        snprintf(linha, TAM_LINHA, "PENDENTE | ID %d | %dh | %s (%dkm)",
+                 AGENDA(i)->id, AGENDA(i)->hora, AGENDA(i)->local, AGENDA(i)->distancia);
+    }
+    destrancar(&m_agenda);
+
+    trancar(&m_frota);
+    for (int p = -1; (i = indice_proximo(&ctrl.frota_pid, t->c.pid, &p)) != -1;)
+    {
+        for (int k = 0; k < LUGARES_MAX; k++)
+        {
+            Passageiro *ps = &FROTA(i)->passageiros[k];
+            if (ps->id_servico == 0 || ps->pid_cliente != t->c.pid || (linha = nova_linha(&linhas)) == NULL)
+                continue;
+            snprintf(linha, TAM_LINHA, "A DECORRER | ID %d | %s%s", ps->id_servico,
+                     FROTA(i)->ultimo_status, FROTA(i)->n_passageiros > 1 ? " (partilhada)" : "");
+        }
+    }
+    destrancar(&m_frota);
+
+    for (int k = 0; k < linhas.n; k++)
+        enviar_resposta(t->c.pid, OP_OK, linhas.texto + (size_t)k * TAM_LINHA);
+    if (linhas.n == 0)
+        enviar_resposta(t->c.pid, OP_OK, "Sem serviços ativos ou pendentes.");
+    free(linhas.texto);
+}
+
+void pedido_cancelar(const Trama *t, const char *username)
+{
+    char msg_buf[300];
+    int32_t id_alvo;
+    memcpy(&id_alvo, t->dados, sizeof(id_alvo));
+
+    sprintf(msg_buf, "Cliente %s pede cancelamento ID=%d", username, id_alvo);
+    log_msg("[PEDIDO]", msg_buf);
+
+    // Tenta cancelar no sistema (0 = todos os do cliente)
+    int n = cancelar_servico(t->c.pid, id_alvo);
+
+    char resp[100];
+    if (n > 0)
+    {
+        // SUCESSO: o cliente mostra-a como [CONTROLADOR]
+        sprintf(resp, "Sucesso: Cancelaste o serviço ID %d.", id_alvo);
+        enviar_resposta(t->c.pid, OP_OK, resp);
+    }
+    else
+    {
+        // FALHA: OP_ERRO para o cliente mostrar a vermelho/[ERRO]
+        sprintf(resp, "O serviço ID %d não existe ou não te pertence.", id_alvo);
+        enviar_resposta(t->c.pid, OP_ERRO, resp);
+    }
+}
+
+void pedido_capacidade(const Trama *t, const char *username)
+{
+    (void)username;
+    char msg_buf[300];
+    DadosCapacidade dados;
+    memcpy(&dados, t->dados, sizeof(dados));
+    int t1 = dados.t1, t2 = dados.t2;
+    if (t2 < t1)
+    {
+        enviar_resposta(t->c.pid, OP_ERRO, "Erro sintaxe. Use: capacidade <t1> <t2>");
+        return;
+    }
+
+    int tempo_atual = ler_tempo();
+    if (t1 < tempo_atual)
+        t1 = tempo_atual;
+    if (t2 >= tempo_atual + OCUPACAO_JANELA)
+        t2 = tempo_atual + OCUPACAO_JANELA - 1;
+    if (t2 < t1)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), "Erro: Esse intervalo já passou (Atual: %d).", tempo_atual);
+        enviar_resposta(t->c.pid, OP_ERRO, msg_buf);
+        return;
+    }
+
+    int livres = cfg.pool_max - ocupacao_maxima(t1, t2 + 1);
+    int vaga = ocupacao_proxima_vaga(t1, 1, cfg.pool_max);
+    if (livres < 0)
+        livres = 0;
+    if (vaga != -1 && vaga <= t2)
+        snprintf(msg_buf, sizeof(msg_buf), "Capacidade t=%d..%d: %d de %d veículos livres em todo o intervalo. Primeiro veículo livre em t=%d.",
+                 t1, t2, livres, cfg.pool_max, vaga);
+    else
+        snprintf(msg_buf, sizeof(msg_buf), "Capacidade t=%d..%d: frota toda comprometida (%d veículos).", t1, t2, cfg.pool_max);
+    enviar_resposta(t->c.pid, OP_OK, msg_buf);
+}
+
+void pedido_terminar(const Trama *t, const char *username)
+{
+    char msg_buf[300];
+    DadosTerminar dados = {0};
+    if (t->c.tamanho == sizeof(dados))
+        memcpy(&dados, t->dados, sizeof(dados));
+    int ocupado = 0;
+    trancar(&m_frota);
+    int p = -1;
+    if (indice_proximo(&ctrl.frota_pid, t->c.pid, &p) != -1)
+        ocupado = 1;
+    destrancar(&m_frota);
+
+    if (ocupado && !dados.manter)
+    {
+        enviar_resposta(t->c.pid, OP_ERRO, "Tens viagens a decorrer! Cancela-as antes de sair.");
+    }
+    else if (dados.manter)
+    {
+        // As viagens a decorrer acabam sozinhas; os avisos delas perdem-se
+        int orfaos = largar_cliente(t->c.pid);
+        snprintf(msg_buf, sizeof(msg_buf), "Cliente %s saiu (%d agendamentos à espera do próximo login).", username, orfaos);
+        log_msg("[LOGOUT]", msg_buf);
+        enviar_resposta(t->c.pid, OP_SAIR, "A desligar...");
+    }
+    else
+    {
+        remover_cliente(t->c.pid);
+        sprintf(msg_buf, "Cliente %s saiu.", username);
+        log_msg("[LOGOUT]", msg_buf);
+        enviar_resposta(t->c.pid, OP_SAIR, "A desligar...");
+    }
+}
+
+void pedido_decisao(const Trama *t, const char *username)
+{
+    (void)username;
+    char msg_buf[300];
+    DadosDecisao dados;
+    memcpy(&dados, t->dados, sizeof(dados));
+    int id_alvo = dados.id;
+
+    snprintf(msg_buf, sizeof(msg_buf), "Recebi decisao: %d %s", id_alvo, dados.aceitar ? "s" : "n");
+    log_nivel(LOG_DEBUG, "[DEBUG]", msg_buf);
+    int encontrou = 0;
+    int reagendado = 0;
+    // A resposta só segue depois de largar m_agenda
+    char resposta[200];
+    int op_resposta = OP_OK;
+    trancar(&m_agenda);
+    
+    int i = procurar_agendamento(id_alvo);
+    if(i != -1 && AGENDA(i)->pid_cliente == t->c.pid && AGENDA(i)->aguardar_confirmacao){
+        encontrou =1;
+        int d_viagem = AGENDA(i)->distancia;
+        int proposta = AGENDA(i)->hora_proposta;
+        if(dados.aceitar &&
+           !ocupacao_reservar(&AGENDA(i)->ocup_ini, &AGENDA(i)->ocup_fim, proposta, proposta + d_viagem, cfg.pool_max)){
+            // Entretanto outro agendamento ficou com o lugar: nova proposta
+            int nova = ocupacao_proxima_vaga(proposta + 1, d_viagem, cfg.pool_max);
+            if(nova <= proposta)
+                nova = proposta + 5;
+            AGENDA(i)->hora_proposta = nova;
+            diario_agendamento(DIARIO_REAGENDADO, i);
+
+            sprintf(resposta, "A frota já está cheia em t=%d. Aceitas reagendar ID %d para t=%d? (decisao %d s)", proposta, id_alvo, nova, id_alvo);
+            op_resposta = OP_STATUS;
+        }
+        else if(dados.aceitar){
+            heap_remover(i); // a hora é a chave do heap
+            AGENDA(i)->hora = AGENDA(i)->hora_proposta;
+            AGENDA(i)->aguardar_confirmacao = 0;
+            heap_inserir(i);
+            diario_agendamento(DIARIO_REAGENDADO, i);
+            reagendado = 1;
+            
+            sprintf(resposta, "Reagendamento confirmado para t=%d.", AGENDA(i)->hora);
+            
+            sprintf(msg_buf, "Agendamento ID %d reagendado para t=%d pelo cliente.", id_alvo, AGENDA(i)->hora);
+            log_msg("[AGENDA]", msg_buf);
+
+        }else{
+            desativar_agendamento(i);
+
+            strcpy(resposta, "Pedido cancelado a seu pedido.");
+            log_msg("[AGENDA]", "Cliente recusou reagendamento. Pedido removido.");
+        }
+    }
+    destrancar(&m_agenda);
+
+    if(encontrou)
+        enviar_resposta(t->c.pid, op_resposta, resposta);
+    if(reagendado)
+        acordar_despacho();
+    if(!encontrou){
+        enviar_resposta(t->c.pid, OP_ERRO, "Pedido não encontrado ou não requer decisão.");
+    }
+}
+
+// Despacho dos pedidos: o opcode indexa a tabela. min e max limitam o
+// tamanho dos dados; com sessao o pedido só é aceite depois do login.
+typedef struct
+{
+    uint16_t min, max;
+    int sessao;
+    void (*tratar)(const Trama *t, const char *username);
+} OpcodePedido;
+
+static const OpcodePedido opcodes_pedido[N_OPCODES_PEDIDO] = {
+    [OP_LOGIN] = {2, TRAMA_DADOS_MAX, 0, pedido_login},
+    [OP_AGENDAR] = {sizeof(DadosAgendar) + 3, TRAMA_DADOS_MAX, 1, pedido_agendar},
+    [OP_CONSULTAR] = {0, 0, 1, pedido_consultar},
+    [OP_CANCELAR] = {sizeof(int32_t), sizeof(int32_t), 1, pedido_cancelar},
+    [OP_TERMINAR] = {0, sizeof(DadosTerminar), 1, pedido_terminar},
+    [OP_DECISAO] = {sizeof(DadosDecisao), sizeof(DadosDecisao), 1, pedido_decisao},
+    [OP_CAPACIDADE] = {sizeof(DadosCapacidade), sizeof(DadosCapacidade), 1, pedido_capacidade},
+};
+
+// Posição nas estatísticas: o opcode, ou 0 ("outro") se não for um pedido
+int opcode_stats(const Trama *t)
+{
+    return t->c.opcode < N_OPCODES_PEDIDO && opcodes_pedido[t->c.opcode].tratar != NULL ? t->c.opcode : 0;
+}
+
+void processar_pedido(const Trama *t)
+{
+    traco_evento(TRACO_PEDIDO, t, trama_tamanho(t));
+    const OpcodePedido *op = &opcodes_pedido[opcode_stats(t)];
+    if (op->tratar == NULL || t->c.tamanho < op->min || t->c.tamanho > op->max)
+    {
+        enviar_resposta(t->c.pid, OP_ERRO, "Pedido desconhecido ou mal formado.");
+        return;
+    }
+
+    char username[50] = "";
+    if (op->sessao)
+    {
+        if (procurar_sessao(t->c.pid, username, sizeof(username)) == -1)
+        {
+            enviar_resposta(t->c.pid, OP_ERRO, "Sem sessão: faz login primeiro.");
+            return;
+        }
+    }
+    op->tratar(t, username);
+}
+
+// ============================================================================
+// INTERFACE ADMIN
+// ============================================================================
+
+// Cópia das tabelas para as consultas do admin (só uma thread a usa: a de
+// eventos ou, num shard, o trabalhador dos pedidos do encaminhador)
+static char *copia_admin = NULL;
+static size_t tam_copia_admin = 0;
+
+void processar_comando_admin(FILE *f, char *cmd)
+{
+    char *token = strtok(cmd, " ");
+    char *param = strtok(NULL, " ");
+
+    if (!token)
+        return;
+
+    if (strcmp(token, "listar") == 0)
+    {
+        fprintf(f, "\n--- AGENDAMENTOS PENDENTES ---\n");
+        int vazia = 1;
+        int n = slab_copiar(&ctrl.agenda, &m_agenda, &copia_admin, &tam_copia_admin);
+        Agendamento *agenda = (Agendamento *)copia_admin;
+        for (int i = 0; i < n; i++)
+        {
+            if (agenda[i].ativo)
+            {
+                fprintf(f, "ID %d | Cliente: %s | Hora: %d | Destino: %s\n",
+                       agenda[i].id, agenda[i].username, agenda[i].hora, agenda[i].local);
+                vazia = 0;
+            }
+        }
+        if (vazia)
+            fprintf(f, "(Vazio)\n");
+        fprintf(f, "------------------------------\n");
+    }
+    else if (strcmp(token, "frota") == 0)
+    {
+        fprintf(f, "\n--- ESTADO DA FROTA ---\n");
+        int vazia = 1;
+        int n = slab_copiar(&ctrl.frota, &m_frota, &copia_admin, &tam_copia_admin);
+        Veiculo *frota = (Veiculo *)copia_admin;
+        int num_veiculos = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (frota[i].pid != 0)
+                num_veiculos++;
+            if (frota[i].pid > 0 && frota[i].ocupado)
+            {
+                char servicos[64];
+                int len = 0;
+                for (int p = 0; p < LUGARES_MAX; p++)
+                    if (frota[i].passageiros[p].id_servico != 0)
+                        len += snprintf(servicos + len, sizeof(servicos) - len, "%s%d", len ? "+" : "",
+                                        frota[i].passageiros[p].id_servico);
+                fprintf(f, "Taxi %d @%d,%d [ID Serviço %s]: %s\n",
+                       frota[i].pid, frota[i].x, frota[i].y, servicos,
+                       frota[i].ultimo_status);
+                vazia = 0;
+            }
+            else if (frota[i].pid > 0)
+            {
+                fprintf(f, "Taxi %d @%d,%d [Livre]: %s\n", frota[i].pid, frota[i].x, frota[i].y, frota[i].ultimo_status);
+                vazia = 0;
+            }
+        }
+        fprintf(f, "(Pool: %d veículos, min %d, max %d)\n", num_veiculos, cfg.pool_min, cfg.pool_max);
+        if (vazia)
+            fprintf(f, "(Nenhum veículo ativo)\n");
+        fprintf(f, "-----------------------\n");
+    }
+    else if (strcmp(token, "cancelar") == 0)
+    {
+        if (!param)
+        {
+            fprintf(f, "[ERRO] Uso: cancelar <ID_SERVICO> (ou 0 para tudo)\n");
+        }
+        else
+        {
+            int id_alvo = atoi(param);
+            fprintf(f, "[ADMIN] A cancelar serviço ID %d (ou todos se 0)...\n", id_alvo);
+
+            int num = cancelar_servico(-1, id_alvo);
+            fprintf(f, "[ADMIN] %d serviços cancelados.\n", num);
+        }
+    }
+    else if (strcmp(token, "utiliz") == 0)
+    {
+        fprintf(f, "\n--- UTILIZADORES ---\n");
+        int n = slab_copiar(&ctrl.clientes, &m_clientes, &copia_admin, &tam_copia_admin);
+        ClienteInfo *clientes = (ClienteInfo *)copia_admin;
+        for (int i = 0; i < n; i++)
+            if (clientes[i].pid > 0)
+                fprintf(f, "- %s (PID %d)\n", clientes[i].username, clientes[i].pid);
+        fprintf(f, "--------------------\n");
+    }
+    else if (strcmp(token, "km") == 0)
+    {
+        fprintf(f, "[ADMIN] Total KMs: %d (%d em vazio até aos clientes)\n",
+                __atomic_load_n(&ctrl.total_km, __ATOMIC_RELAXED), __atomic_load_n(&ctrl.km_recolha, __ATOMIC_RELAXED));
+    }
+    else if (strcmp(token, "hora") == 0)
+    {
+        fprintf(f, "[ADMIN] Tempo Simulado: %d\n", ler_tempo());
+    }
+    else if (strcmp(token, "stats") == 0)
+    {
+        fprintf(f, "\n");
+        mostrar_stats(f);
+        fprintf(f, "-----------------------\n");
+    }
+    else if (strcmp(token, "terminar") == 0)
+        exit(0);
+    else
+    {
+        fprintf(f, "[ERRO] Comando desconhecido: %s\n", token);
+    }
+
+    fflush(f);
+}
+
+// Comando de administração reenviado pelo encaminhador a este shard: a
+// resposta segue em pedaços pelo pipe do encaminhador e acaba em OP_ADMIN_FIM
+void responder_admin(const Trama *t)
+{
+    if (t->c.pid != getppid())
+        return;
+
+    char *texto = NULL;
+    size_t tam = 0;
+    FILE *f = open_memstream(&texto, &tam);
+    if (f == NULL)
+        return;
+    char linha[TRAMA_DADOS_MAX + 1];
+    snprintf(linha, sizeof(linha), "%s", t->dados);
+    processar_comando_admin(f, linha);
+    fclose(f);
+
+    // Sem O_NONBLOCK na escrita: uma resposta grande não pode perder pedaços
+    char pipe_name[100];
+    snprintf(pipe_name, sizeof(pipe_name), PIPE_CLIENTE, t->c.pid);
+    int fd = open(pipe_name, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd != -1 && fcntl(fd, F_SETFL, 0) != -1)
+    {
+        Trama r;
+        int pedaco = TRAMA_DADOS_MAX - 1;
+        for (size_t pos = 0; pos < tam; pos += pedaco)
+        {
+            trama_iniciar(&r, OP_ADMIN_TEXTO, getpid(), t->c.seq, 0);
+            char parte[TRAMA_DADOS_MAX];
+            snprintf(parte, sizeof(parte), "%.*s", pedaco, texto + pos);
+            trama_texto(&r, parte);
+            if (!trama_escrever(fd, &r))
+                break;
+        }
+        trama_iniciar(&r, OP_ADMIN_FIM, getpid(), t->c.seq, 0);
+        if (!trama_escrever(fd, &r))
+            log_nivel(LOG_AVISO, "[AVISO]", "Não consegui responder ao encaminhador");
+    }
+    if (fd != -1)
+        close(fd);
+    free(texto);
+}
+
+
+// ============================================================================
+// TRABALHADORES (PEDIDOS DOS CLIENTES)
+// ============================================================================
+
+// Os pedidos lidos do FIFO e do anel são repartidos pelo pid do cliente
+// (pid % trabalhadores): os de um cliente são tratados pela ordem em que
+// chegaram e os de clientes diferentes em paralelo. Uma resposta lenta ou
+// uma espera por um trinco só atrasa os clientes do mesmo trabalhador; quem
+// lê os pedidos (o reactor, que também trata da telemetria e do relógio, e
+// a thread do anel) nunca espera por um trabalhador.
+#define FILA_TRABALHO 256 // pedidos em espera por trabalhador
 
-    if (pid == 0)
-    {
-        // --- FILHO (VEÍCULO) ---
-        close(p[0]);
-        close(STDOUT_FILENO);
-        dup(p[1]);
-        close(p[1]);
+typedef struct
+{
+    Trama t;
+    int canal;    // canal do anel por onde chegou (-1 = FIFO)
+    int64_t lido; // quando foi lido, para as estatísticas
+} Trabalho;
 
-        sprintf(str_pid, "%d", pid_cli);
-        sprintf(str_dist, "%d", dist);
+typedef struct
+{
+    pthread_mutex_t m; // folha: não se bloqueia nenhum outro mutex com este
+    pthread_cond_t c_pedido; // há pedidos na fila
+    Trabalho fila[FILA_TRABALHO];
+    int inicio, n;
+    pthread_t t;
+} Trabalhador;
 
-        execl("./veiculo", "veiculo", user, str_pid, str_dist, local, NULL);
-        perror("[ERRO] execl falhou");
-        _exit(1);
-    }
-    else if (pid > 0)
-    {
-        // --- PAI (CONTROLADOR) ---
-        close(p[1]);
-        
+static struct
+{
+    Trabalhador *t;
+    int n;         // 0 = cada pedido é tratado pela thread que o leu
+    int pendentes; // pedidos lidos e ainda não tratados (atómico)
+} trabalho;
 
-        pthread_mutex_lock(&m_frota);
+// Trata um pedido e conta-o nas estatísticas
+void executar_pedido(const Trama *t, int canal, int64_t lido)
+{
+    seq_pedido_atual = t->c.seq;
+    canal_pedido_atual = canal;
+    processar_pedido(t);
+    seq_pedido_atual = 0;
+    canal_pedido_atual = -1;
+    hist_registar(&stats.comando[opcode_stats(t)], agora_ns() - lido);
+}
 
-        ctrl.frota[idx].pid = pid;
-        ctrl.frota[idx].pid_cliente = pid_cli;
-        ctrl.frota[idx].fd_leitura = p[0];
-        ctrl.frota[idx].distancia_viagem = dist;
-        ctrl.frota[idx].id_servico = id_servico;
-        strcpy(ctrl.frota[idx].ultimo_status, "A iniciar");
+void *thread_trabalhador(void *arg)
+{
+    Trabalhador *w = arg;
+    Trabalho job;
 
-        //calcula quando carro acaba
-        pthread_mutex_lock(&m_tempo);
-        int t_agora = ctrl.tempo;
-        pthread_mutex_unlock(&m_tempo);
+    while (1)
+    {
+        pthread_mutex_lock(&w->m);
+        while (w->n == 0)
+            pthread_cond_wait(&w->c_pedido, &w->m);
+        job = w->fila[w->inicio];
+        w->inicio = (w->inicio + 1) % FILA_TRABALHO;
+        w->n--;
+        pthread_mutex_unlock(&w->m);
 
-        ctrl.frota[idx].tempo_conclusao_estimado = t_agora + dist;
+        executar_pedido(&job.t, job.canal, job.lido);
 
-        if (pthread_create(&ctrl.frota[idx].thread_id, NULL, thread_veiculo, &ctrl.frota[idx]) != 0)
+        // No modo discreto o reactor só avança o relógio sem pedidos por tratar
+        if (__atomic_sub_fetch(&trabalho.pendentes, 1, __ATOMIC_ACQ_REL) == 0 && cfg.discreto)
         {
-            perror("[ERRO] Falha ao criar thread veiculo");
-            exit(1);
+            uint64_t um = 1;
+            write(ctrl.fd_relogio, &um, sizeof(um));
         }
-
-        ctrl.num_veiculos++;
-        sprintf(buffer, "Veículo enviado (Serviço ID %d) para %s", id_servico, user);
-        log_msg("[FROTA]", buffer);
-        pthread_mutex_unlock(&m_frota);
-        return 1;
     }
-    else
-    { // falha no fork
-        perror("[ERRO] Fork falhou");   
-        close(p[0]);
-        close(p[1]);
-
-        // Temos de libertar o lugar que reservámos
-        pthread_mutex_lock(&m_frota);
-        ctrl.frota[idx].ocupado = 0;
-        pthread_mutex_unlock(&m_frota);
-    }
-    
-    return 0;
+    return NULL;
 }
 
-void verificar_agendamentos(void)
+void iniciar_trabalhadores(void)
 {
-
-    int tempo_atual;
-    pthread_mutex_lock(&m_tempo);
-    tempo_atual = ctrl.tempo;
-    pthread_mutex_unlock(&m_tempo);
-
-    pthread_mutex_lock(&m_agenda);
-    for (int i = 0; i < MAX_AGENDAMENTOS; ++i)
+    if (cfg.trabalhadores == 0)
+        return;
+    trabalho.t = calloc(cfg.trabalhadores, sizeof(Trabalhador));
+    if (trabalho.t == NULL)
+    {
+        perror("[ERRO] Sem memória para os trabalhadores");
+        exit(1);
+    }
+    for (int i = 0; i < cfg.trabalhadores; i++)
     {
-        if (ctrl.agenda[i].ativo && ctrl.agenda[i].hora <= tempo_atual && !ctrl.agenda[i].aguardar_confirmacao)
+        Trabalhador *w = &trabalho.t[i];
+        pthread_mutex_init(&w->m, NULL);
+        pthread_cond_init(&w->c_pedido, NULL);
+        if (pthread_create(&w->t, NULL, thread_trabalhador, w) != 0)
         {
-            // copiar para variáveis locais
-            char user[50];
-            char local[100];
-            int pid_cli = ctrl.agenda[i].pid_cliente;
-            int dist = ctrl.agenda[i].distancia;
-            int id_serv = ctrl.agenda[i].id;
-            strcpy(user, ctrl.agenda[i].username);
-            strcpy(local, ctrl.agenda[i].local);
-
-            pthread_mutex_unlock(&m_agenda);
-
-            if (lancar_veiculo(user, pid_cli, dist, local, id_serv))
-            {
-                pthread_mutex_lock(&m_agenda);
-                ctrl.agenda[i].ativo = 0;
-                enviar_resposta(pid_cli, "info", "Viatura a caminho.");
-            }
-            else
-            {
-                printf("Aqui");
-
-                pthread_mutex_lock(&m_agenda); 
-                if (tempo_atual - ctrl.agenda[i].ultimo_aviso >= 5) {
-                    int proxima_vaga = obter_proxima_vaga();
-                if(proxima_vaga <= tempo_atual)
-                    proxima_vaga = tempo_atual + 5;
-                    
-                    char proposta[200];
-                    sprintf(proposta, "Frota cheia. Aceitas reagendar ID %d para t=%d? (Escreve: decisao %d s)", id_serv, proxima_vaga, id_serv);
-                    enviar_resposta(pid_cli, "status", proposta);
-
-                    // MARCA COMO AGUARDANDO RESPOSTA
-                    ctrl.agenda[i].aguardar_confirmacao = 1;
-                    ctrl.agenda[i].hora_proposta = proxima_vaga;
-                    ctrl.agenda[i].ultimo_aviso = tempo_atual;
-                }
-            }
+            perror("[ERRO] Falha ao criar trabalhador");
+            exit(1);
         }
+        pthread_detach(w->t);
     }
-    pthread_mutex_unlock(&m_agenda);
+    trabalho.n = cfg.trabalhadores;
 }
 
+// Passa o pedido ao trabalhador do cliente. Com a fila dele cheia o
+// pedido é recusado logo com OP_ERRO, sem esperar: o cliente pode repetir.
+void distribuir_pedido(const Trama *t, int canal, int64_t lido)
+{
+    if (trabalho.n == 0)
+    {
+        executar_pedido(t, canal, lido);
+        return;
+    }
 
+    Trabalhador *w = &trabalho.t[(uint32_t)t->c.pid % trabalho.n];
+    pthread_mutex_lock(&w->m);
+    if (w->n == FILA_TRABALHO)
+    {
+        pthread_mutex_unlock(&w->m);
+        __atomic_add_fetch(&stats.pedidos_recusados, 1, __ATOMIC_RELAXED);
+        seq_pedido_atual = t->c.seq;
+        canal_pedido_atual = canal;
+        enviar_resposta(t->c.pid, OP_ERRO, "Controlador ocupado: tenta outra vez daqui a pouco.");
+        seq_pedido_atual = 0;
+        canal_pedido_atual = -1;
+        return;
+    }
+    __atomic_add_fetch(&trabalho.pendentes, 1, __ATOMIC_ACQ_REL);
+    Trabalho *job = &w->fila[(w->inicio + w->n) % FILA_TRABALHO];
+    job->t.c = t->c;
+    memcpy(job->t.dados, t->dados, t->c.tamanho + 1);
+    job->canal = canal;
+    job->lido = lido;
+    if (w->n++ == 0)
+        pthread_cond_signal(&w->c_pedido);
+    pthread_mutex_unlock(&w->m);
+}
 
 // ============================================================================
-// GESTÃO DE PEDIDOS (CLIENTES)
+// REACTOR DE EVENTOS
 // ============================================================================
 
-void processar_comando_cliente(Mensagem *m)
+// Lê todas as mensagens pendentes no FIFO dos clientes
+void tratar_evento_clientes(void)
 {
-    char msg_buf[300];
-    int h, d;
-    char loc[100];
+    // Cada write de um cliente é uma trama inteira (< PIPE_BUF), mas
+    // guardamos o resto de uma leitura parcial para a próxima vez por precaução
+    static char buffer[64 * sizeof(Trama)];
+    static size_t usados = 0;
 
-    if (strcmp(m->comando, "login") == 0)
+    while (1)
     {
-        int existe = 0;
-        pthread_mutex_lock(&m_clientes);
-        for (int i = 0; i < NUTILIZADORES; i++)
+        int n = read(ctrl.fd_clientes, buffer + usados, sizeof(buffer) - usados);
+        if (n <= 0)
         {
-            if (ctrl.clientes[i].pid > 0 && strcmp(ctrl.clientes[i].username, m->username) == 0)
-            {
-                existe = 1;
-                break;
-            }
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                perror("[ERRO] leitura fifo clientes");
+            break;
         }
-        pthread_mutex_unlock(&m_clientes);
-
-        char pipe_cli[100];
-        sprintf(pipe_cli, PIPE_CLIENTE, m->pid);
-        int fd = open(pipe_cli, O_WRONLY | O_NONBLOCK);
+        usados += n;
+        int64_t lido = agora_ns();
 
-        if (existe)
+        size_t pos = 0;
+        Trama t;
+        int k;
+        while ((k = trama_extrair(buffer + pos, usados - pos, &t)) > 0)
         {
-            if (fd != -1)
-            {
-                Mensagem erro;
-                erro.pid = getpid();
-                strcpy(erro.comando, "erro");
-                sprintf(erro.mensagem, "Utilizador '%s' ja existe.", m->username);
-                write(fd, &erro, sizeof(Mensagem));
-                close(fd);
-            }
-            log_msg("[LOGIN]", "Rejeitado: nome duplicado."); // Log adicional
+            distribuir_pedido(&t, -1, lido);
+            __atomic_add_fetch(&stats.pedidos_fifo, 1, __ATOMIC_RELAXED);
+            pos += k;
         }
-        else
+        if (k < 0)
         {
-            // CORREÇÃO: Verifica se realmente conseguiu registar (se havia espaço)
-            if (registar_cliente(m->pid, m->username))
-            {
-                if (fd != -1)
-                {
-                    Mensagem resposta;
-                    resposta.pid = getpid();
-                    strcpy(resposta.comando, "login_ok");
-                    strcpy(resposta.mensagem, "Login aceite.");
-                    write(fd, &resposta, sizeof(Mensagem));
-                    close(fd);
-                }
-                sprintf(msg_buf, "Cliente %s (PID %d) entrou.", m->username, m->pid);
-                log_msg("[LOGIN]", msg_buf);
-            }
-            else
-            {
-                // Se a função retornou 0, é porque não havia espaço
-                if (fd != -1)
-                {
-                    Mensagem erro;
-                    erro.pid = getpid();
-                    strcpy(erro.comando, "erro");
-                    strcpy(erro.mensagem, "Servidor cheio! Tente mais tarde.");
-                    write(fd, &erro, sizeof(Mensagem));
-                    close(fd);
-                }
-                log_msg("[LOGIN]", "Rejeitado: Servidor cheio.");
-            }
+            // Lixo ou um cliente de outra versão: não há como voltar a alinhar
+            log_nivel(LOG_AVISO, "[AVISO]", "Trama inválida no FIFO dos clientes; buffer descartado.");
+            pos = usados;
         }
+        usados -= pos;
+        memmove(buffer, buffer + pos, usados);
     }
-    else if (strcmp(m->comando, "agendar") == 0)
-    {
-        if (sscanf(m->mensagem, "%d %99s %d", &h, loc, &d) == 3)
-        {
-
-            int novo_id;
-            pthread_mutex_lock(&m_agenda);
-            novo_id = ctrl.proximo_id++;
-            pthread_mutex_unlock(&m_agenda);
+}
 
-            sprintf(msg_buf, "Pedido Agendar (ID %d): %s, %dkm, %dh", novo_id, loc, d, h);
-            log_msg("[PEDIDO]", msg_buf);
+// Lê o stdin do administrador e executa cada linha completa
+void tratar_evento_admin(void)
+{
+    static char linha[100];
+    static size_t usados = 0;
 
-            pthread_mutex_lock(&m_tempo);
-            int tempo_atual = ctrl.tempo;
-            pthread_mutex_unlock(&m_tempo);
-            if (h < tempo_atual)
-            {
-                char erro_msg[100];
-                sprintf(erro_msg, "Erro: Impossível agendar para %d (Atual: %d).", h, ctrl.tempo);
-                enviar_resposta(m->pid, m->comando, erro_msg);
-            }
-            else if (h == tempo_atual)
-            {
-                if (lancar_veiculo(m->username, m->pid, d, loc, novo_id))
-                {
-                    char resp[100];
-                    sprintf(resp, "Sucesso: Serviço ID %d iniciado de imediato!", novo_id);
-                    enviar_resposta(m->pid, m->comando, resp);
-                }
-                else
-                {
-                    // FROTA CHEIA: Adicionar à lista 
-                    int idx = registar_agendamento_na_lista(novo_id, m->username, m->pid, h, d, loc, 1);
-                    if(idx != -1){
-                        int proxima_vaga = obter_proxima_vaga();
-
-                        if(proxima_vaga <= tempo_atual) 
-                            proxima_vaga = tempo_atual + 2;
-        
-                            // 3. Modifica o agendamento que acabámos de criar para ficar "Bloqueado" à espera de resposta
-                            pthread_mutex_lock(&m_agenda);
-                            
-                            ctrl.agenda[idx].aguardar_confirmacao = 1;
-                            ctrl.agenda[idx].hora_proposta = proxima_vaga;
-                            ctrl.agenda[idx].ultimo_aviso = tempo_atual;
-                            
-                            pthread_mutex_unlock(&m_agenda);
-                            
-                            char confirm[100];
-                            sprintf(confirm, "Frota cheia! Agendamento ID %d colocado em espera prioritária.", novo_id);
-                            enviar_resposta(m->pid, "aviso", confirm);
-                    
-                    }
-                    
-                }
-            }
-            else
-            {
-                int ocupados_na_hora = 0;
+    while (1)
+    {
+        int n = read(STDIN_FILENO, linha + usados, sizeof(linha) - 1 - usados);
+        if (n == 0)
+        {
+            // stdin fechado (ex: redirecionado de um ficheiro): deixa de o vigiar
+            epoll_ctl(ctrl.fd_epoll, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            break;
+        }
+        if (n < 0)
+            break;
+        usados += n;
+        linha[usados] = '\0';
 
-                pthread_mutex_lock(&m_frota);
-                for(int i = 0; i<NVEICULOS; i++){
-                    if(ctrl.frota[i].ocupado && ctrl.frota[i].tempo_conclusao_estimado > h){
-                        ocupados_na_hora++;
-                    }   
-                }
-                pthread_mutex_unlock(&m_frota);
+        char *inicio = linha;
+        char *fim;
+        while ((fim = strchr(inicio, '\n')) != NULL)
+        {
+            *fim = '\0';
+            traco_evento(TRACO_ADMIN, inicio, strlen(inicio));
+            processar_comando_admin(stdout, inicio);
+            inicio = fim + 1;
+        }
+        usados -= inicio - linha;
+        memmove(linha, inicio, usados);
 
-                if(ocupados_na_hora >= NVEICULOS){
-                    int idx = registar_agendamento_na_lista(novo_id, m->username, m->pid, h, d, loc, 1);
-                
-                    if (idx == -1)
-                    {
-                        int proxima_vaga = obter_proxima_vaga();
+        if (usados == sizeof(linha) - 1)
+            usados = 0; // linha demasiado longa
+    }
+}
 
-                        if(proxima_vaga <= h)
-                            proxima_vaga = h +5;
-                            
-                        pthread_mutex_lock(&m_agenda);
-                        ctrl.agenda[idx].aguardar_confirmacao = 1;
-                        ctrl.agenda[idx].hora_proposta = proxima_vaga;
-                        ctrl.agenda[idx].ultimo_aviso = tempo_atual;
-                        pthread_mutex_unlock(&m_agenda);
+// Num shard o stdin é um pipe que só o encaminhador tem aberto para
+// escrita: os comandos de administração vêm por ali em tramas OP_ADMIN e
+// nunca pelo FIFO, onde qualquer cliente pode escrever
+void tratar_evento_admin_shard(void)
+{
+    static char buffer[16 * sizeof(Trama)];
+    static size_t usados = 0;
 
-                        char confirm[200];
-                        sprintf(confirm, "Previsão: Frota cheia em t=%d. Aceitas reagendar ID %d para t=%d? (decisao %d s)", h, novo_id, proxima_vaga, novo_id);
-                        enviar_resposta(m->pid, "status", confirm);
+    while (1)
+    {
+        int n = read(STDIN_FILENO, buffer + usados, sizeof(buffer) - usados);
+        if (n == 0)
+        {
+            // O encaminhador morreu: já não há quem mande comandos
+            epoll_ctl(ctrl.fd_epoll, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            break;
+        }
+        if (n < 0)
+            break;
+        usados += n;
 
-                    }
-                }else {
-                    registar_agendamento_na_lista(novo_id, m->username, m->pid, h, d, loc, 0);
-                    
-                    char confirm[100];
-                    sprintf(confirm, "Sucesso: Agendamento ID %d registado para t=%d.", novo_id, h);
-                    enviar_resposta(m->pid, m->comando, confirm);
-                }
-                
+        size_t pos = 0;
+        Trama t;
+        int k;
+        while ((k = trama_extrair(buffer + pos, usados - pos, &t)) > 0)
+        {
+            if (t.c.opcode == OP_ADMIN && t.c.tamanho > 0)
+            {
+                traco_evento(TRACO_ADMIN, t.dados, strlen(t.dados));
+                responder_admin(&t);
             }
+            pos += k;
         }
-        else
+        if (k < 0)
         {
-            enviar_resposta(m->pid, m->comando, "Erro sintaxe. Use: agendar <hora> <local> <km>");
+            log_nivel(LOG_AVISO, "[AVISO]", "Trama inválida do encaminhador; buffer descartado.");
+            pos = usados;
         }
+        usados -= pos;
+        memmove(buffer, buffer + pos, usados);
     }
-    else if (strcmp(m->comando, "consultar") == 0)
-    {
-        int encontrou = 0;
-        char pipe_cli[100];
-        snprintf(pipe_cli, sizeof(pipe_cli), PIPE_CLIENTE, m->pid);
-        int fd_resp = open(pipe_cli, O_WRONLY | O_NONBLOCK);
+}
 
-        if (fd_resp != -1)
-        {
-            Mensagem resp;
-            resp.pid = getpid();
-            strcpy(resp.comando, "resposta");
+// Avança o tempo simulado, acorda os veículos que esperam por ele e faz
+// o trabalho de cada tick
+void avancar_relogio(int unidades)
+{
+    int32_t u = unidades;
+    traco_evento(TRACO_RELOGIO, &u, sizeof(u));
 
-            pthread_mutex_lock(&m_agenda);
-            for (int i = 0; i < MAX_AGENDAMENTOS; i++)
-            {
-                if (ctrl.agenda[i].ativo && ctrl.agenda[i].pid_cliente == m->pid)
-                {
-                    char buffer[256];
-                    sprintf(buffer, "PENDENTE | ID %d | %dh | %s (%dkm)",
-                            ctrl.agenda[i].id, ctrl.agenda[i].hora, ctrl.agenda[i].local, ctrl.agenda[i].distancia);
-                    strcpy(resp.mensagem, buffer);
-                    write(fd_resp, &resp, sizeof(Mensagem));
-                    encontrou = 1;
-                }
-            }
-            pthread_mutex_unlock(&m_agenda);
+    int tempo_atual = ler_tempo() + unidades;
+    acertar_relogio(tempo_atual);
+    syscall(SYS_futex, &ctrl.relogio->tempo, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
 
-            pthread_mutex_lock(&m_frota);
-            for (int i = 0; i < ctrl.num_veiculos; i++)
-            {
-                if (ctrl.frota[i].pid > 0 && ctrl.frota[i].pid_cliente == m->pid)
-                {
-                    char buffer[256];
-                    sprintf(buffer, "A DECORRER | ID %d | %s",
-                            ctrl.frota[i].id_servico, ctrl.frota[i].ultimo_status);
-                    strcpy(resp.mensagem, buffer);
-                    write(fd_resp, &resp, sizeof(Mensagem));
-                    encontrou = 1;
-                }
-            }
-            pthread_mutex_unlock(&m_frota);
+    ocupacao_avancar(tempo_atual);
+    manter_pool();
 
-            if (!encontrou)
-            {
-                strcpy(resp.mensagem, "Sem serviços ativos ou pendentes.");
-                write(fd_resp, &resp, sizeof(Mensagem));
-            }
-            close(fd_resp);
-        }
-    }
-    else if (strcmp(m->comando, "cancelar") == 0)
-    {
-        int id_alvo = atoi(m->mensagem);
+    // Só acorda o despacho se o topo do heap já venceu (O(1))
+    trancar(&m_agenda);
+    int proxima = heap_proxima_hora();
+    destrancar(&m_agenda);
+    if (proxima != -1 && proxima <= tempo_atual)
+        acordar_despacho();
+}
 
-        sprintf(msg_buf, "Cliente %s pede cancelamento ID=%d", m->username, id_alvo);
-        log_msg("[PEDIDO]", msg_buf);
+void tratar_evento_relogio(void)
+{
+    uint64_t expiracoes;
+    if (read(ctrl.fd_relogio, &expiracoes, sizeof(expiracoes)) != sizeof(expiracoes))
+        return;
 
-        if (id_alvo == 0 && strcmp(m->mensagem, "0") != 0)
-        {
-            enviar_resposta(m->pid, "erro", "ID inválido! Insira um número.");
-        }
-        else
-        {
-            // 2. Tenta cancelar no sistema
-            int n = cancelar_servico(m->pid, id_alvo);
+    // No modo discreto o eventfd só serve para acordar o reactor
+    if (!cfg.discreto)
+        avancar_relogio((int)expiracoes);
+}
 
-            char resp[100];
-            if (n > 0)
-            {
-                // SUCESSO: Envia com tag "info" (ou usa o default que vai cair no [CONTROLADOR])
-                sprintf(resp, "Sucesso: Cancelaste o serviço ID %d.", id_alvo);
-                enviar_resposta(m->pid, "cancelar", resp);
-            }
-            else
-            {
-                // FALHA: Envia com tag "erro" para o cliente mostrar a vermelho/[ERRO]
-                sprintf(resp, "O serviço ID %d não existe ou não te pertence.", id_alvo);
-                enviar_resposta(m->pid, "erro", resp);
-            }
-        }
-    }
-    else if (strcmp(m->comando, "terminar") == 0)
-    {
-        int ocupado = 0;
-        pthread_mutex_lock(&m_frota);
-        for (int i = 0; i < ctrl.num_veiculos; i++)
-        {
-            if (ctrl.frota[i].pid > 0 && ctrl.frota[i].pid_cliente == m->pid)
-            {
-                ocupado = 1;
-                break;
-            }
-        }
-        pthread_mutex_unlock(&m_frota);
+// Modo discreto: hora do próximo evento, ou -1 se ainda há algo pendente
+// no tempo atual (despacho a meio, pedidos por tratar, veículo que já
+// devia ter terminado e ainda não reportou) ou se não há nada agendado
+int proximo_evento_discreto(void)
+{
+    pthread_mutex_lock(&m_despacho);
+    int ocupado = ctrl.acordar_agenda || ctrl.despacho_ativo;
+    pthread_mutex_unlock(&m_despacho);
+    if (ocupado || __atomic_load_n(&trabalho.pendentes, __ATOMIC_ACQUIRE) > 0)
+        return -1;
+
+    int tempo_atual = ler_tempo();
 
-        char pipe_cli[100];
-        sprintf(pipe_cli, PIPE_CLIENTE, m->pid);
-        int fd_resp = open(pipe_cli, O_WRONLY | O_NONBLOCK);
+    int proximo = -1;
+    trancar(&m_agenda);
+    int h = heap_proxima_hora();
+    destrancar(&m_agenda);
+    if (h != -1)
+        // Um agendamento vencido que ficou à espera de frota volta a ser
+        // tentado no tick seguinte, como no modo em tempo real
+        proximo = h > tempo_atual ? h : tempo_atual + 1;
 
-        if (fd_resp != -1)
+    trancar(&m_frota);
+    for (int i = 0; i < ctrl.frota.capacidade; i++)
+    {
+        Veiculo *v = FROTA(i);
+        if (!v->ocupado)
+            continue;
+        if (v->tempo_conclusao_estimado <= tempo_atual)
         {
-            Mensagem resp;
-            resp.pid = getpid();
-            if (ocupado)
-            {
-                strcpy(resp.comando, "erro");
-                strcpy(resp.mensagem, "Tens viagens a decorrer! Cancela-as antes de sair.");
-            }
-            else
-            {
-                strcpy(resp.comando, "exit_ok");
-                strcpy(resp.mensagem, "A desligar...");
-                remover_cliente(m->pid);
-                sprintf(msg_buf, "Cliente %s saiu.", m->username);
-                log_msg("[LOGOUT]", msg_buf);
-            }
-            write(fd_resp, &resp, sizeof(Mensagem));
-            close(fd_resp);
+            destrancar(&m_frota);
+            return -1;
         }
-    } else if(strcmp (m ->comando, "decisao") == 0){
-        int id_alvo;
-        char respo;
+        if (proximo == -1 || v->tempo_conclusao_estimado < proximo)
+            proximo = v->tempo_conclusao_estimado;
+    }
+    destrancar(&m_frota);
+    return proximo;
+}
 
-        printf("[DEBUG] Recebi decisao: '%s'\n", m->mensagem);
-        if(sscanf(m->mensagem, "%d %c", &id_alvo, &respo) == 2){
-            int encontrou = 0;
-            pthread_mutex_lock(&m_agenda);
-            
-            for(int i=0; i<MAX_AGENDAMENTOS; i++){
-                if(ctrl.agenda[i].ativo && ctrl.agenda[i].id == id_alvo && ctrl.agenda[i].pid_cliente == m->pid){
-                    encontrou =1;
-                    if(respo == 's' || respo == 'S'){
-                        ctrl.agenda[i].hora = ctrl.agenda[i].hora_proposta;
-                        ctrl.agenda[i].aguardar_confirmacao = 0;
-                        
-                        char confirma[100];
-                        sprintf(confirma, "Reagendamento confirmado para t=%d.", ctrl.agenda[i].hora);
-                        enviar_resposta(m->pid, "info", confirma);
-                        
-                        sprintf(msg_buf, "Agendamento ID %d reagendado para t=%d pelo cliente.", id_alvo, ctrl.agenda[i].hora);
-                        log_msg("[AGENDA]", msg_buf);
+void avancar_relogio_discreto(void)
+{
+    int proximo = proximo_evento_discreto();
+    if (proximo == -1)
+        return;
 
-                    }else{
-                        ctrl.agenda[i].ativo = 0;
+    int unidades = proximo - ler_tempo();
+    if (unidades > 0)
+        avancar_relogio(unidades);
+}
 
-                        enviar_resposta(m->pid, "info", "Pedido cancelado a seu pedido.");
-                        log_msg("[AGENDA]", "Cliente recusou reagendamento. Pedido removido.");
-                    }
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&m_agenda);
+// Pedidos dos clientes que usam o anel em memória partilhada. Só dorme
+// (no futex da fila) quando a fila está vazia.
+void *thread_anel(void *arg)
+{
+    (void)arg;
+    Trama m;
+    int canal;
 
-            if(!encontrou){
-                enviar_resposta(m->pid, "erro", "Pedido não encontrado ou não requer decisão.");
-            }
-        }else{
-            enviar_resposta(m->pid, "erro", "Erro sintaxe. Use: decisao <ID> <s/n>");
+    while (1)
+    {
+        while (anel_receber_pedido(ctrl.anel, &canal, &m))
+        {
+            distribuir_pedido(&m, canal, agora_ns());
+            __atomic_add_fetch(&stats.pedidos_anel, 1, __ATOMIC_RELAXED);
         }
+        anel_esperar_pedido(ctrl.anel);
     }
+    return NULL;
 }
 
-void *thread_clientes(void *arg)
+// Uma única thread espera por clientes, admin, relógio e todos os veículos,
+// e só acorda quando algum deles tem trabalho
+void *thread_eventos(void *arg)
 {
     (void)arg;
-    Mensagem m;
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_TAG(EV_CLIENTES, 0);
+    epoll_ctl(ctrl.fd_epoll, EPOLL_CTL_ADD, ctrl.fd_clientes, &ev);
+
+    ev.data.u64 = EV_TAG(EV_RELOGIO, 0);
+    epoll_ctl(ctrl.fd_epoll, EPOLL_CTL_ADD, ctrl.fd_relogio, &ev);
+
+    // Num shard o stdin é o pipe dos comandos do encaminhador
+    ev.data.u64 = EV_TAG(EV_ADMIN, 0);
+    if (epoll_ctl(ctrl.fd_epoll, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1)
+        log_nivel(LOG_AVISO, "[AVISO]", "stdin não suporta epoll; comandos admin desativados.");
+
+    struct epoll_event eventos[32];
     while (1)
     {
-        if (ctrl.fd_clientes != -1)
+        int n = epoll_wait(ctrl.fd_epoll, eventos, 32, -1);
+        if (n < 0)
         {
-            int n = read(ctrl.fd_clientes, &m, sizeof(Mensagem));
-            if (n > 0)
-            {
-                processar_comando_cliente(&m);
-            }
-            else if (n == 0)
-            {
-                close(ctrl.fd_clientes);
-                ctrl.fd_clientes = open(PIPE_CONTROLADOR, O_RDONLY | O_NONBLOCK);
-            }
-            else if (n < 0 && errno != EAGAIN)
+            if (errno == EINTR)
+                continue;
+            perror("[ERRO] epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t tipo = eventos[i].data.u64 >> 32;
+            uint32_t idx = (uint32_t)eventos[i].data.u64;
+
+            switch (tipo)
             {
-                perror("[ERRO] leitura fifo clientes");
+            case EV_CLIENTES:
+                tratar_evento_clientes();
+                break;
+            case EV_ADMIN:
+                if (cfg.shards > 1)
+                    tratar_evento_admin_shard();
+                else
+                    tratar_evento_admin();
+                break;
+            case EV_RELOGIO:
+                tratar_evento_relogio();
+                break;
+            case EV_VEICULO:
+                tratar_evento_veiculo(idx);
+                break;
             }
         }
-        usleep(10000);
+
+        // Tudo o que estava pendente foi tratado: salta para o próximo evento
+        if (cfg.discreto)
+            avancar_relogio_discreto();
     }
     return NULL;
 }
 
 // ============================================================================
-// INTERFACE ADMIN
+// REPRODUÇÃO DE TRAÇOS
 // ============================================================================
 
-void *thread_admin(void *arg)
+// Na reprodução não há thread de despacho: corre aqui enquanto houver
+// trabalho para ela, logo a seguir a cada entrada do traço
+void despachar_reproducao(void)
 {
-    (void)arg;
-    char cmd[100];
     while (1)
     {
+        pthread_mutex_lock(&m_despacho);
+        int acordar = ctrl.acordar_agenda;
+        ctrl.acordar_agenda = 0;
+        pthread_mutex_unlock(&m_despacho);
+        if (!acordar)
+            return;
 
-        if (fgets(cmd, sizeof(cmd), stdin) == NULL)
-        {
-            clearerr(stdin);
-            usleep(100000);
-            continue;
-        }
-        size_t L = strlen(cmd);
-        if (L > 0 && cmd[L - 1] == '\n')
-            cmd[L - 1] = '\0';
-        char *token = strtok(cmd, " ");
-        char *param = strtok(NULL, " ");
+        int64_t inicio = agora_ns();
+        verificar_agendamentos();
+        hist_registar(&stats.ronda, agora_ns() - inicio);
+    }
+}
 
-        if (!token)
-            continue;
+// Passa o traço cfg.replay pelos mesmos caminhos das entradas reais, numa
+// só thread e com o relógio a avançar só com os registos do traço, por
+// isso duas reproduções do mesmo traço (com as mesmas opções) dão as mesmas
+// respostas. A telemetria vai para o veículo que tem o serviço nesta
+// reprodução. Termina com o resumo das respostas e o ritmo conseguido.
+void reproduzir_traco(void)
+{
+    CabecalhoTraco cab;
+    FILE *f = traco_ler_abrir(cfg.replay, &cab);
+    if (f == NULL)
+        exit(1);
+    FILE *admin = fopen("/dev/null", "we");
+    if (admin == NULL)
+    {
+        perror("[ERRO] Falha ao abrir /dev/null");
+        exit(1);
+    }
+
+    acertar_relogio(cab.tempo);
+    ocupacao_avancar(cab.tempo);
+    ctrl.proximo_id = cab.proximo_id;
+    manter_pool();
 
-        if (strcmp(token, "listar") == 0)
+    RegistoTraco r;
+    static char dados[TRACO_MAX_DADOS + 1];
+    long registos[TRACO_RELOGIO + 1] = {0};
+    long invalidos = 0, sem_veiculo = 0;
+    int64_t inicio = agora_ns();
+
+    while (traco_ler(f, &r, dados))
+    {
+        if (cfg.replay_velocidade > 0)
         {
-            printf("\n--- AGENDAMENTOS PENDENTES ---\n");
-            int vazia = 1;
-            pthread_mutex_lock(&m_agenda);
-            for (int i = 0; i < MAX_AGENDAMENTOS; i++)
-            {
-                if (ctrl.agenda[i].ativo)
-                {
-                    printf("ID %d | Cliente: %s | Hora: %d | Destino: %s\n",
-                           ctrl.agenda[i].id, ctrl.agenda[i].username, ctrl.agenda[i].hora, ctrl.agenda[i].local);
-                    vazia = 0;
-                }
-            }
-            pthread_mutex_unlock(&m_agenda);
-            if (vazia)
-                printf("(Vazio)\n");
-            printf("------------------------------\n");
+            // Ritmo gravado (dividido pela velocidade)
+            int64_t alvo = inicio + r.ns / cfg.replay_velocidade;
+            struct timespec ts = {alvo / 1000000000LL, alvo % 1000000000LL};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
         }
-        else if (strcmp(token, "frota") == 0)
+
+        Trama t;
+        TelemetriaFrame tel;
+        int32_t unidades;
+        if (r.tipo == TRACO_PEDIDO && trama_extrair(dados, r.tamanho, &t) == r.tamanho)
         {
-            printf("\n--- ESTADO DA FROTA ---\n");
-            int vazia = 1;
-            pthread_mutex_lock(&m_frota);
-            for (int i = 0; i < ctrl.num_veiculos; i++)
-            {
-                if (ctrl.frota[i].pid > 0)
-                {
-                    printf("Taxi %d [ID Serviço %d]: %s\n",
-                           ctrl.frota[i].pid, ctrl.frota[i].id_servico,
-                           ctrl.frota[i].ultimo_status);
-                    vazia = 0;
-                }
-            }
-            pthread_mutex_unlock(&m_frota);
-            if (vazia)
-                printf("(Nenhum veículo ativo)\n");
-            printf("-----------------------\n");
+            executar_pedido(&t, -1, agora_ns());
         }
-        else if (strcmp(token, "cancelar") == 0)
+        else if (r.tipo == TRACO_ADMIN)
         {
-            if (!param)
-            {
-                printf("[ERRO] Uso: cancelar <ID_SERVICO> (ou 0 para tudo)\n");
-            }
-            else
+            dados[r.tamanho] = '\0';
+            if (strncmp(dados, "terminar", 8) == 0)
             {
-                int id_alvo = atoi(param);
-                printf("[ADMIN] A cancelar serviço ID %d (ou todos se 0)...\n", id_alvo);
-
-                int num = cancelar_servico(-1, id_alvo);
-                printf("[ADMIN] %d serviços cancelados.\n", num);
+                registos[r.tipo]++;
+                break;
             }
+            processar_comando_admin(admin, dados);
         }
-        else if (strcmp(token, "utiliz") == 0)
-        {
-            printf("\n--- UTILIZADORES ---\n");
-            pthread_mutex_lock(&m_clientes);
-            for (int i = 0; i < NUTILIZADORES; i++)
-                if (ctrl.clientes[i].pid > 0)
-                    printf("- %s (PID %d)\n", ctrl.clientes[i].username, ctrl.clientes[i].pid);
-            pthread_mutex_unlock(&m_clientes);
-            printf("--------------------\n");
-        }
-        else if (strcmp(token, "km") == 0)
+        else if (r.tipo == TRACO_TELEMETRIA && r.tamanho == sizeof(tel))
         {
-            pthread_mutex_lock(&m_km);
-            printf("[ADMIN] Total KMs: %d\n", ctrl.total_km);
-            pthread_mutex_unlock(&m_km);
+            memcpy(&tel, dados, sizeof(tel));
+            trancar(&m_frota);
+            int p = -1;
+            int idx = indice_proximo(&ctrl.frota_id, tel.id_servico, &p);
+            if (idx != -1)
+                processar_frame_veiculo(idx, &tel);
+            else
+                sem_veiculo++;
+            destrancar(&m_frota);
         }
-        else if (strcmp(token, "hora") == 0)
+        else if (r.tipo == TRACO_RELOGIO && r.tamanho == sizeof(unidades))
         {
-            pthread_mutex_lock(&m_tempo);
-            printf("[ADMIN] Tempo Simulado: %d\n", ctrl.tempo);
-            pthread_mutex_unlock(&m_tempo);
+            memcpy(&unidades, dados, sizeof(unidades));
+            avancar_relogio(unidades);
         }
-        else if (strcmp(token, "terminar") == 0)
-            exit(0);
         else
         {
-            printf("[ERRO] Comando desconhecido: %s\n", token);
+            invalidos++;
+            continue;
         }
-
-        fflush(stdout);
+        registos[r.tipo]++;
+        despachar_reproducao();
     }
-    return NULL;
+    fclose(f);
+    fclose(admin);
+
+    int64_t duracao = agora_ns() - inicio;
+    long total = registos[TRACO_PEDIDO] + registos[TRACO_ADMIN] + registos[TRACO_TELEMETRIA] + registos[TRACO_RELOGIO];
+    int tempo_final = ler_tempo();
+    int total_km = __atomic_load_n(&ctrl.total_km, __ATOMIC_RELAXED);
+
+    // Os registos pendentes saem antes do relatório
+    registo_terminar();
+    printf("\n--- REPRODUÇÃO DE %s ---\n", cfg.replay);
+    printf("Registos: %ld (pedidos %ld, admin %ld, telemetria %ld, relógio %ld) | Inválidos: %ld\n", total,
+           registos[TRACO_PEDIDO], registos[TRACO_ADMIN], registos[TRACO_TELEMETRIA], registos[TRACO_RELOGIO], invalidos);
+    printf("Telemetria sem veículo: %ld | Tempo simulado: %d -> %d | Total KMs: %d\n", sem_veiculo, cab.tempo,
+           tempo_final, total_km);
+    printf("Duração: %.3f s | %.0f registos/s\n", duracao / 1e9, duracao > 0 ? total * 1e9 / duracao : 0.0);
+    printf("Respostas: %llu | Resumo: %016llx\n", (unsigned long long)reproducao.respostas,
+           (unsigned long long)reproducao.resumo);
+    mostrar_stats(stdout);
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-
+    carregar_config(argc, argv);
     setup_inicial();
-    pthread_t t_admin, t_clientes, t_relogio;
-    if (pthread_create(&t_admin, NULL, thread_admin, NULL) != 0)
+    recuperar_estado();
+    iniciar_checkpoint();
+    manter_pool(); // arranca já com pool_min veículos prontos
+    iniciar_trabalhadores();
+
+    if (reproducao.ativa)
     {
-        perror("[ERRO] Falha ao criar thread admin");
-        exit(1);
+        reproduzir_traco();
+        exit(0);
+    }
+    if (cfg.traco[0] != '\0')
+    {
+        // Começa depois da recuperação: o traço só tem o que entra a seguir
+        if (traco_abrir(cfg.traco, ctrl.tempo, ctrl.proximo_id))
+            log_msg("[SISTEMA]", "A gravar o traço das entradas.");
+        else
+            perror("[AVISO] Não foi possível criar o traço");
     }
-    if (pthread_create(&t_clientes, NULL, thread_clientes, NULL) != 0)
+
+    pthread_t t_eventos;
+    if (pthread_create(&t_eventos, NULL, thread_eventos, NULL) != 0)
     {
-        perror("[ERRO] Falha ao criar thread clientes");
+        perror("[ERRO] Falha ao criar thread de eventos");
         exit(1);
     }
-    if (pthread_create(&t_relogio, NULL, thread_relogio, NULL) != 0)
+
+    pthread_t t_anel;
+    if (ctrl.anel != NULL && pthread_create(&t_anel, NULL, thread_anel, NULL) != 0)
     {
-        perror("[ERRO] Falha ao criar thread relogio");
+        perror("[ERRO] Falha ao criar thread do anel");
         exit(1);
     }
 
+    // A thread principal fica com o despacho dos agendamentos
     while (1)
     {
-        //verificar_agendamentos();
-        for (int i = 0; i < NVEICULOS; i++)
-        {
-            int should_join = 0;
-            pthread_mutex_lock(&m_frota);
-            if (ctrl.frota[i].pid > 0 && ctrl.frota[i].thread_finalizada)
-                should_join = 1;
-            pthread_mutex_unlock(&m_frota);
-
-            if (should_join)
-            {
-                /* copiar tid e fd para fora do lock */
-                pthread_t tid;
-                int fd;
-                pid_t pidv;
-
-                pthread_mutex_lock(&m_frota);
-                tid = ctrl.frota[i].thread_id;
-                fd = ctrl.frota[i].fd_leitura;
-                pidv = ctrl.frota[i].pid;
-                pthread_mutex_unlock(&m_frota);
-
-                /* join (SEM mutexes bloqueados) */
-                pthread_join(tid, NULL);
-
-                /* cleanup do slot */
-                if (fd > 0)
-                    close(fd);
-                pthread_mutex_lock(&m_frota);
-                ctrl.frota[i].pid = 0;
-                //ctrl.frota[i].fd_leitura = -1;  
-                ctrl.frota[i].ocupado = 0;
-                ctrl.frota[i].thread_finalizada = 0;
-                ctrl.num_veiculos--;
-                pthread_mutex_unlock(&m_frota);
-
-                char buf[128];
-                snprintf(buf, sizeof(buf), "Veículo slot %d (PID %d) terminado e recolhido.", i, (int)pidv);
-                log_msg("[FROTA]", buf);
-            }
-        }
+        esperar_despacho();
+        int64_t inicio = agora_ns();
         verificar_agendamentos();
+        hist_registar(&stats.ronda, agora_ns() - inicio);
+        terminar_despacho();
     }
 
     return 0;
-}
\ No newline at end of file
+}
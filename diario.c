@@ -0,0 +1,403 @@
+#include "diario.h"
+
+// ============================================================================
+// CRC32 (polinómio refletido 0xEDB88320, o mesmo do zlib)
+// ============================================================================
+
+static uint32_t tabela_crc[256];
+static pthread_once_t tabela_crc_feita = PTHREAD_ONCE_INIT;
+
+static void construir_tabela_crc(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        tabela_crc[i] = c;
+    }
+}
+
+static uint32_t crc32_continuar(uint32_t crc, const void *dados, size_t n)
+{
+    const unsigned char *p = dados;
+    crc = ~crc;
+    while (n--)
+        crc = tabela_crc[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t crc_registo(const CabecalhoDiario *c, const void *dados)
+{
+    uint32_t crc = crc32_continuar(0, (const char *)c + sizeof(c->crc), sizeof(*c) - sizeof(c->crc));
+    return crc32_continuar(crc, dados, c->tamanho);
+}
+
+// ============================================================================
+// ESTADO
+// ============================================================================
+
+// Dois buffers: quem regista enche o pendente enquanto a thread escreve o outro
+typedef struct
+{
+    char *dados;
+    size_t usados;
+    size_t cap;
+} BufferDiario;
+
+static struct
+{
+    pthread_mutex_t m; // folha: não se bloqueia nenhum outro mutex com este
+    pthread_cond_t c;
+    BufferDiario pendente;
+    BufferDiario escrita;
+    char *ficheiro;
+    int fd;
+    int sync_ms;
+    uint64_t proximo_lsn;
+    uint64_t compactar_ate; // 0 = nada a compactar
+    int ativo;
+    int terminar;
+    pthread_t escritor;
+} diario = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, .fd = -1, .proximo_lsn = 1};
+
+static int64_t agora_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int escrever_tudo(int fd, const char *p, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(fd, p, n);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return 0;
+        p += w;
+        n -= w;
+    }
+    return 1;
+}
+
+// ============================================================================
+// REPRODUÇÃO
+// ============================================================================
+
+// Entrega os registos válidos depois de desde e devolve o tamanho da
+// parte boa do ficheiro (-1 se o primeiro a aplicar não for desde + 1)
+static off_t reproduzir(int fd, uint64_t desde, AplicarDiario aplicar, long *n)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+        return 0;
+
+    char *tudo = malloc(st.st_size);
+    if (tudo == NULL)
+        return 0;
+    size_t lidos = 0;
+    while (lidos < (size_t)st.st_size)
+    {
+        ssize_t r = pread(fd, tudo + lidos, st.st_size - lidos, lidos);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        lidos += r;
+    }
+
+    size_t pos = 0;
+    while (pos + sizeof(CabecalhoDiario) <= lidos)
+    {
+        CabecalhoDiario c;
+        memcpy(&c, tudo + pos, sizeof(c));
+        if (c.tamanho > DIARIO_MAX_DADOS || pos + sizeof(c) + c.tamanho > lidos)
+            break;
+        const char *dados = tudo + pos + sizeof(c);
+        if (c.crc != crc_registo(&c, dados))
+            break;
+        // Registos que o estado guardado já inclui (antes de uma compactação)
+        if (c.lsn <= desde && diario.proximo_lsn == desde + 1)
+        {
+            pos += sizeof(c) + c.tamanho;
+            continue;
+        }
+        if (c.lsn != diario.proximo_lsn)
+        {
+            if (*n == 0 && c.lsn > desde + 1)
+            {
+                free(tudo);
+                return -1;
+            }
+            break;
+        }
+
+        aplicar(&c, dados);
+        diario.proximo_lsn++;
+        (*n)++;
+        pos += sizeof(c) + c.tamanho;
+    }
+    free(tudo);
+    return pos;
+}
+
+// ============================================================================
+// ESCRITA EM GRUPO
+// ============================================================================
+
+// Diretório do ficheiro, para sincronizar a entrada depois de um rename
+static int abrir_diretorio(const char *ficheiro)
+{
+    char dir[4096];
+    const char *barra = strrchr(ficheiro, '/');
+    if (barra == NULL)
+        return open(".", O_RDONLY | O_CLOEXEC);
+    snprintf(dir, sizeof(dir), "%.*s", (int)(barra - ficheiro + 1), ficheiro);
+    return open(dir, O_RDONLY | O_CLOEXEC);
+}
+
+// Reescreve o diário só com os registos depois de ate (só a thread de
+// escrita mexe no ficheiro, por isso não há escritas a meio)
+static void compactar(uint64_t ate)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", diario.ficheiro);
+    int novo = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (novo == -1)
+    {
+        perror("[ERRO] Falha ao compactar o diário");
+        return;
+    }
+
+    off_t fim = lseek(diario.fd, 0, SEEK_END);
+    off_t pos = 0;
+    CabecalhoDiario c;
+    while (pos + (off_t)sizeof(c) <= fim && pread(diario.fd, &c, sizeof(c), pos) == sizeof(c) && c.lsn <= ate)
+        pos += sizeof(c) + c.tamanho;
+
+    char buf[64 * 1024];
+    int ok = 1;
+    while (ok && pos < fim)
+    {
+        ssize_t r = pread(diario.fd, buf, sizeof(buf), pos);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0 || !escrever_tudo(novo, buf, r))
+            ok = 0;
+        pos += r;
+    }
+    if (!ok || fdatasync(novo) == -1 || rename(tmp, diario.ficheiro) == -1)
+    {
+        perror("[ERRO] Falha ao compactar o diário");
+        close(novo);
+        unlink(tmp);
+        return;
+    }
+    int dir = abrir_diretorio(diario.ficheiro);
+    if (dir != -1)
+    {
+        fsync(dir);
+        close(dir);
+    }
+    close(diario.fd);
+    diario.fd = novo;
+}
+
+static void *thread_diario(void *arg)
+{
+    (void)arg;
+    int64_t ultimo_sync = agora_ms();
+    int por_sincronizar = 0;
+
+    while (1)
+    {
+        pthread_mutex_lock(&diario.m);
+        while (diario.pendente.usados == 0 && !diario.terminar && diario.compactar_ate == 0)
+        {
+            if (por_sincronizar && diario.sync_ms > 0)
+            {
+                // Há dados escritos à espera do próximo fdatasync
+                struct timespec limite;
+                clock_gettime(CLOCK_MONOTONIC, &limite);
+                int64_t falta = ultimo_sync + diario.sync_ms - agora_ms();
+                if (falta <= 0)
+                    break;
+                limite.tv_sec += falta / 1000;
+                limite.tv_nsec += (falta % 1000) * 1000000L;
+                if (limite.tv_nsec >= 1000000000L)
+                {
+                    limite.tv_sec++;
+                    limite.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&diario.c, &diario.m, &limite);
+            }
+            else
+                pthread_cond_wait(&diario.c, &diario.m);
+        }
+        BufferDiario b = diario.escrita;
+        diario.escrita = diario.pendente;
+        diario.pendente = b;
+        int terminar = diario.terminar;
+        uint64_t compactar_ate = diario.compactar_ate;
+        diario.compactar_ate = 0;
+        pthread_mutex_unlock(&diario.m);
+
+        if (diario.escrita.usados > 0)
+        {
+            if (!escrever_tudo(diario.fd, diario.escrita.dados, diario.escrita.usados))
+                perror("[ERRO] Falha ao escrever no diário");
+            diario.escrita.usados = 0;
+            por_sincronizar = 1;
+        }
+
+        int64_t agora = agora_ms();
+        if (por_sincronizar && (terminar || diario.sync_ms == 0 || (diario.sync_ms > 0 && agora - ultimo_sync >= diario.sync_ms)))
+        {
+            fdatasync(diario.fd);
+            por_sincronizar = 0;
+            ultimo_sync = agora;
+        }
+        if (compactar_ate > 0 && !terminar)
+            compactar(compactar_ate);
+        if (terminar)
+            return NULL;
+    }
+}
+
+// ============================================================================
+// INTERFACE
+// ============================================================================
+
+long diario_abrir(const char *ficheiro, int sync_ms, uint64_t desde_lsn, AplicarDiario aplicar)
+{
+    pthread_once(&tabela_crc_feita, construir_tabela_crc);
+
+    int fd = open(ficheiro, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    long n = 0;
+    diario.proximo_lsn = desde_lsn + 1;
+    off_t bom = reproduzir(fd, desde_lsn, aplicar, &n);
+    if (bom == -1)
+    {
+        close(fd);
+        return -2;
+    }
+    // Corta o resto de uma escrita interrompida para os próximos registos
+    // ficarem logo a seguir ao último bom
+    if (ftruncate(fd, bom) == -1 || lseek(fd, bom, SEEK_SET) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    diario.fd = fd;
+    diario.ficheiro = strdup(ficheiro);
+    diario.sync_ms = sync_ms;
+    diario.terminar = 0;
+    pthread_condattr_t atrib;
+    pthread_condattr_init(&atrib);
+    pthread_condattr_setclock(&atrib, CLOCK_MONOTONIC);
+    pthread_cond_init(&diario.c, &atrib);
+    pthread_condattr_destroy(&atrib);
+
+    if (pthread_create(&diario.escritor, NULL, thread_diario, NULL) != 0)
+    {
+        close(fd);
+        diario.fd = -1;
+        return -1;
+    }
+    __atomic_store_n(&diario.ativo, 1, __ATOMIC_RELEASE);
+    return n;
+}
+
+void diario_escrever(int tipo, int32_t tempo, const void *dados, int tamanho)
+{
+    CabecalhoDiario c;
+    memset(&c, 0, sizeof(c));
+    c.tipo = tipo;
+    c.tamanho = tamanho;
+    c.tempo = tempo;
+
+    pthread_mutex_lock(&diario.m);
+    if (!diario.ativo || diario.terminar)
+    {
+        pthread_mutex_unlock(&diario.m);
+        return;
+    }
+    BufferDiario *b = &diario.pendente;
+    size_t precisa = b->usados + sizeof(c) + tamanho;
+    if (precisa > b->cap)
+    {
+        size_t cap = b->cap ? b->cap : 64 * 1024;
+        while (cap < precisa)
+            cap *= 2;
+        char *novo = realloc(b->dados, cap);
+        if (novo == NULL)
+        {
+            pthread_mutex_unlock(&diario.m);
+            perror("[ERRO] Sem memória para o diário");
+            return;
+        }
+        b->dados = novo;
+        b->cap = cap;
+    }
+    c.lsn = diario.proximo_lsn++;
+    c.crc = crc_registo(&c, dados);
+    memcpy(b->dados + b->usados, &c, sizeof(c));
+    memcpy(b->dados + b->usados + sizeof(c), dados, tamanho);
+    int acordar = b->usados == 0;
+    b->usados = precisa;
+    if (acordar)
+        pthread_cond_signal(&diario.c);
+    pthread_mutex_unlock(&diario.m);
+}
+
+// LSN do último registo aceite (0 se ainda não houve nenhum)
+uint64_t diario_ultimo_lsn(void)
+{
+    pthread_mutex_lock(&diario.m);
+    uint64_t lsn = diario.proximo_lsn - 1;
+    pthread_mutex_unlock(&diario.m);
+    return lsn;
+}
+
+void diario_compactar(uint64_t ate_lsn)
+{
+    pthread_mutex_lock(&diario.m);
+    if (diario.ativo && ate_lsn > diario.compactar_ate)
+    {
+        diario.compactar_ate = ate_lsn;
+        pthread_cond_signal(&diario.c);
+    }
+    pthread_mutex_unlock(&diario.m);
+}
+
+// CRC32 avulso, para quem guarda outros ficheiros com o mesmo cuidado
+uint32_t diario_crc32(const void *dados, size_t n)
+{
+    pthread_once(&tabela_crc_feita, construir_tabela_crc);
+    return crc32_continuar(0, dados, n);
+}
+
+// Escreve e sincroniza o que falta; registos posteriores são ignorados
+void diario_fechar(void)
+{
+    pthread_mutex_lock(&diario.m);
+    if (!diario.ativo || diario.terminar || pthread_equal(pthread_self(), diario.escritor))
+    {
+        pthread_mutex_unlock(&diario.m);
+        return;
+    }
+    diario.terminar = 1;
+    pthread_cond_signal(&diario.c);
+    pthread_mutex_unlock(&diario.m);
+
+    pthread_join(diario.escritor, NULL);
+    close(diario.fd);
+    diario.fd = -1;
+}
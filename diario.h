@@ -0,0 +1,43 @@
+#ifndef DIARIO_H
+#define DIARIO_H
+
+#include "comum.h"
+
+// Diário (write-ahead log) do controlador: as mudanças de estado são
+// acrescentadas ao fim de um ficheiro como registos binários, cada um com
+// cabeçalho e CRC32. Quem regista só copia o registo para um buffer em
+// memória; uma thread escreve o buffer inteiro de uma vez e faz fdatasync
+// em grupo, conforme sync_ms:
+//    0  -> fdatasync depois de cada escrita
+//    N  -> no máximo um fdatasync a cada N ms
+//   -1  -> nunca (fica a cargo do sistema operativo)
+// Ao abrir, os registos válidos posteriores a desde_lsn (o que um estado
+// guardado já inclui) são entregues a aplicar() pela ordem em que foram
+// escritos. Um fim truncado ou corrompido (escrita interrompida por uma
+// falha) é cortado do ficheiro. Depois de um estado com LSN L estar em
+// disco, diario_compactar(L) deita fora os registos até L.
+
+typedef struct {
+    uint32_t crc;       // CRC32 do resto do cabeçalho e dos dados
+    uint16_t tipo;
+    uint16_t tamanho;   // bytes de dados a seguir ao cabeçalho
+    uint64_t lsn;       // número de sequência do registo (1, 2, ...)
+    int32_t tempo;      // tempo simulado quando foi registado
+    int32_t reservado;
+} CabecalhoDiario;
+
+#define DIARIO_MAX_DADOS 1024
+
+typedef void (*AplicarDiario)(const CabecalhoDiario *c, const void *dados);
+
+// Reproduz o ficheiro e arranca a thread de escrita; devolve o número de
+// registos reproduzidos, -1 se o ficheiro não puder ser aberto ou -2 se
+// houver um buraco entre desde_lsn e o primeiro registo (falta o estado)
+long diario_abrir(const char *ficheiro, int sync_ms, uint64_t desde_lsn, AplicarDiario aplicar);
+void diario_escrever(int tipo, int32_t tempo, const void *dados, int tamanho);
+uint64_t diario_ultimo_lsn(void);
+uint32_t diario_crc32(const void *dados, size_t n);
+void diario_compactar(uint64_t ate_lsn);
+void diario_fechar(void);
+
+#endif
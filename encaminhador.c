@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+#include "comum.h"
+#include "anel.h"
+#include <poll.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// Encaminhador: fica com o FIFO conhecido (PIPE_CONTROLADOR) e reparte os
+// utilizadores por N controladores (shards) pela chave do username que vem
+// no cabeçalho de cada trama. Cada
+// shard é um controlador normal lançado com --shard=k --shards=N: tem o seu
+// FIFO (PIPE_CONTROLADOR.k), a sua parte da frota e dos limites, e responde
+// diretamente ao pipe do cliente. Os comandos de administração escritos
+// aqui vão a todos os shards e as respostas são juntadas. Vão pelo stdin de
+// cada shard, um pipe que só o encaminhador tem aberto para escrita: o FIFO
+// é de toda a gente e o pid de quem envia vem da própria trama.
+
+#define MAX_SHARDS 64
+#define ADMIN_TIMEOUT_MS 2000 // espera máxima pela resposta de um shard
+#define ABRIR_TIMEOUT_MS 5000 // espera máxima até um shard abrir o FIFO
+
+extern char **environ;
+
+typedef struct
+{
+    pid_t pid; // 0 = parado
+    int fd;    // FIFO de pedidos do shard (-1 = por abrir)
+    int fd_admin; // pipe dos comandos de administração (stdin do shard)
+    char fifo[64];
+} Shard;
+
+static struct
+{
+    Shard shards[MAX_SHARDS];
+    int n;
+    char **args; // opções passadas tal e qual aos controladores
+    int n_args;
+    int fd_pedidos;
+    int fd_pedidos_escrita; // mantém o FIFO aberto para nunca dar EOF
+    int fd_respostas;       // respostas dos shards aos comandos de administração
+    char pipe_respostas[64];
+    int seq;
+    int fd_admin; // stdin; -1 depois de fechado
+    volatile sig_atomic_t terminar;
+} enc;
+
+static void handler_sinal(int s)
+{
+    enc.terminar = 1;
+}
+
+static void limpar_recursos(void)
+{
+    unlink(PIPE_CONTROLADOR);
+    unlink(enc.pipe_respostas);
+}
+
+// O cliente põe em cada trama a chave do seu username (chave_utilizador),
+// por isso o shard sai do cabeçalho sem olhar para os dados
+static unsigned shard_de(const Trama *t)
+{
+    return t->c.chave % enc.n;
+}
+
+// ============================================================================
+// SHARDS
+// ============================================================================
+
+static int lancar_shard(int k)
+{
+    char arg_shard[32], arg_shards[32];
+    snprintf(arg_shard, sizeof(arg_shard), "--shard=%d", k);
+    snprintf(arg_shards, sizeof(arg_shards), "--shards=%d", enc.n);
+
+    char *argv[enc.n_args + 4];
+    int a = 0;
+    argv[a++] = "./controlador";
+    argv[a++] = arg_shard;
+    argv[a++] = arg_shards;
+    for (int i = 0; i < enc.n_args; i++)
+        argv[a++] = enc.args[i];
+    argv[a] = NULL;
+
+    // O stdin do shard não é o do administrador: é o pipe dos comandos
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) == -1)
+        return 0;
+    posix_spawn_file_actions_t acoes;
+    posix_spawn_file_actions_init(&acoes);
+    posix_spawn_file_actions_adddup2(&acoes, p[0], STDIN_FILENO);
+    int erro = posix_spawn(&enc.shards[k].pid, argv[0], &acoes, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&acoes);
+    close(p[0]);
+    if (erro != 0)
+    {
+        close(p[1]);
+        enc.shards[k].pid = 0;
+        errno = erro;
+        return 0;
+    }
+    enc.shards[k].fd_admin = p[1];
+    return 1;
+}
+
+// Espera que o shard tenha o FIFO aberto para leitura
+static int abrir_shard(int k)
+{
+    Shard *s = &enc.shards[k];
+    for (int espera = 0; s->pid > 0 && espera < ABRIR_TIMEOUT_MS; espera += 10)
+    {
+        s->fd = open(s->fifo, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (s->fd != -1)
+        {
+            // Daqui em diante as escritas bloqueiam se o shard se atrasar
+            fcntl(s->fd, F_SETFL, 0);
+            return 1;
+        }
+        if (errno != ENXIO && errno != ENOENT)
+            break;
+        usleep(10000);
+    }
+    return 0;
+}
+
+static int enviar_shard(int k, const Trama *m)
+{
+    Shard *s = &enc.shards[k];
+    for (int tentativa = 0; tentativa < 2; tentativa++)
+    {
+        if (s->fd == -1 && !abrir_shard(k))
+            return 0;
+        if (trama_escrever(s->fd, m))
+            return 1;
+        // EPIPE: o shard morreu; volta a tentar se entretanto foi relançado
+        close(s->fd);
+        s->fd = -1;
+    }
+    return 0;
+}
+
+// Um shard que morre é relançado: recupera o estado pelo seu diário
+static void vigiar_shards(void)
+{
+    pid_t pid;
+    int estado;
+    while ((pid = waitpid(-1, &estado, WNOHANG)) > 0)
+    {
+        for (int k = 0; k < enc.n; k++)
+        {
+            if (enc.shards[k].pid != pid)
+                continue;
+            enc.shards[k].pid = 0;
+            if (enc.shards[k].fd != -1)
+                close(enc.shards[k].fd);
+            enc.shards[k].fd = -1;
+            if (enc.shards[k].fd_admin != -1)
+                close(enc.shards[k].fd_admin);
+            enc.shards[k].fd_admin = -1;
+            if (enc.terminar)
+                break;
+            printf("[ENCAMINHADOR] Shard %d (PID %d) terminou; a relançar...\n", k, pid);
+            if (!lancar_shard(k))
+                perror("[ERRO] Falha ao relançar shard");
+        }
+    }
+}
+
+// ============================================================================
+// ADMINISTRAÇÃO
+// ============================================================================
+
+// Junta em f o texto da resposta de um shard; devolve 0 se não chegou a tempo
+static int receber_admin(int seq, FILE *f)
+{
+    int restante = ADMIN_TIMEOUT_MS;
+    while (restante > 0)
+    {
+        struct pollfd p = {enc.fd_respostas, POLLIN, 0};
+        struct timespec antes, depois;
+        clock_gettime(CLOCK_MONOTONIC, &antes);
+        if (poll(&p, 1, restante) <= 0)
+            return 0;
+        clock_gettime(CLOCK_MONOTONIC, &depois);
+        restante -= (depois.tv_sec - antes.tv_sec) * 1000 + (depois.tv_nsec - antes.tv_nsec) / 1000000;
+
+        Trama r;
+        if (trama_ler(enc.fd_respostas, &r) <= 0 || r.c.seq != seq)
+            continue; // resposta atrasada de um comando anterior
+        if (r.c.opcode == OP_ADMIN_FIM)
+            return 1;
+        if (r.c.opcode == OP_ADMIN_TEXTO)
+            fputs(r.dados, f);
+    }
+    return 0;
+}
+
+static void comando_admin(char *linha)
+{
+    char cmd[32] = "";
+    if (sscanf(linha, "%31s", cmd) != 1)
+        return;
+    if (strcmp(cmd, "terminar") == 0)
+    {
+        enc.terminar = 1;
+        return;
+    }
+
+    // Os IDs de serviço dizem de que shard são (id - 1 = k mod N)
+    int so = -1, id;
+    if (strcmp(cmd, "cancelar") == 0 && sscanf(linha, "%*s %d", &id) == 1 && id > 0)
+        so = (id - 1) % enc.n;
+    int km = strcmp(cmd, "km") == 0;
+    long total_km = 0;
+
+    for (int k = 0; k < enc.n; k++)
+    {
+        if (so != -1 && k != so)
+            continue;
+        Trama m;
+        trama_iniciar(&m, OP_ADMIN, getpid(), ++enc.seq, 0);
+        trama_texto(&m, linha);
+        if (enc.shards[k].fd_admin == -1 || !trama_escrever(enc.shards[k].fd_admin, &m))
+        {
+            printf("[ERRO] Shard %d indisponível.\n", k);
+            continue;
+        }
+
+        char *texto = NULL;
+        size_t tam = 0;
+        FILE *f = open_memstream(&texto, &tam);
+        if (f == NULL)
+            continue;
+        int ok = receber_admin(m.c.seq, f);
+        fclose(f);
+
+        int v;
+        if (km && sscanf(texto, "[ADMIN] Total KMs: %d", &v) == 1)
+        {
+            printf("[SHARD %d] %d km\n", k, v);
+            total_km += v;
+        }
+        else
+            printf("\n=== SHARD %d (PID %d) ===\n%s", k, enc.shards[k].pid, texto + (texto[0] == '\n'));
+        if (!ok)
+            printf("[AVISO] O shard %d não respondeu a tempo.\n", k);
+        free(texto);
+    }
+    if (km)
+        printf("[ADMIN] Total KMs: %ld\n", total_km);
+}
+
+static void tratar_admin(void)
+{
+    static char linha[100];
+    static size_t usados = 0;
+
+    int n = read(enc.fd_admin, linha + usados, sizeof(linha) - 1 - usados);
+    if (n == 0)
+        enc.fd_admin = -1; // stdin fechado: deixa de o vigiar (poll ignora fd -1)
+    if (n <= 0)
+        return;
+    usados += n;
+    linha[usados] = '\0';
+
+    char *inicio = linha;
+    char *fim;
+    while ((fim = strchr(inicio, '\n')) != NULL)
+    {
+        *fim = '\0';
+        comando_admin(inicio);
+        inicio = fim + 1;
+    }
+    usados -= inicio - linha;
+    memmove(linha, inicio, usados);
+    if (usados == sizeof(linha) - 1)
+        usados = 0; // linha demasiado longa
+}
+
+// ============================================================================
+// PEDIDOS DOS CLIENTES
+// ============================================================================
+
+static void tratar_pedidos(void)
+{
+    static char buffer[64 * sizeof(Trama)];
+    static size_t usados = 0;
+
+    while (1)
+    {
+        int n = read(enc.fd_pedidos, buffer + usados, sizeof(buffer) - usados);
+        if (n <= 0)
+            break;
+        usados += n;
+
+        // Só se lê o cabeçalho: a trama segue para o shard tal como veio
+        size_t pos = 0;
+        Trama t;
+        int tam;
+        while ((tam = trama_extrair(buffer + pos, usados - pos, &t)) > 0)
+        {
+            // A administração só vem do stdin; pelo FIFO é um cliente a fingir
+            if (t.c.opcode == OP_ADMIN || t.c.opcode == OP_ADMIN_TEXTO || t.c.opcode == OP_ADMIN_FIM)
+            {
+                fprintf(stderr, "[AVISO] Trama de administração do PID %d no FIFO ignorada.\n", t.c.pid);
+                pos += tam;
+                continue;
+            }
+            int k = shard_de(&t);
+            if (!enviar_shard(k, &t))
+                fprintf(stderr, "[ERRO] Pedido do PID %d perdido: shard %d indisponível.\n", t.c.pid, k);
+            pos += tam;
+        }
+        if (tam < 0)
+        {
+            fprintf(stderr, "[ERRO] Trama inválida no FIFO; buffer descartado.\n");
+            pos = usados;
+        }
+        usados -= pos;
+        memmove(buffer, buffer + pos, usados);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    setbuf(stdout, NULL);
+    enc.n = 2;
+    enc.args = malloc(argc * sizeof(char *));
+    for (int a = 1; a < argc; a++)
+    {
+        if (strncmp(argv[a], "--shards=", 9) == 0)
+            enc.n = atoi(argv[a] + 9);
+        else if (strncmp(argv[a], "--shard=", 8) == 0)
+        {
+            printf("Uso: ./encaminhador [--shards=N] [opções do controlador]\n");
+            return 1;
+        }
+        else
+            enc.args[enc.n_args++] = argv[a];
+    }
+    if (enc.n < 1 || enc.n > MAX_SHARDS)
+    {
+        printf("[ERRO] --shards tem de estar entre 1 e %d.\n", MAX_SHARDS);
+        return 1;
+    }
+
+    int fd_check = open(PIPE_CONTROLADOR, O_WRONLY | O_NONBLOCK);
+    if (fd_check != -1)
+    {
+        printf("[ERRO] Já existe uma instância do programa controlador em execução!\n");
+        close(fd_check);
+        return 1;
+    }
+
+    enc.fd_admin = STDIN_FILENO;
+    signal(SIGINT, handler_sinal);
+    signal(SIGTERM, handler_sinal);
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(enc.pipe_respostas, sizeof(enc.pipe_respostas), PIPE_CLIENTE, getpid());
+    atexit(limpar_recursos);
+
+    // Os clientes com --anel usariam o anel de um controlador antigo
+    shm_unlink(SHM_ANEL);
+
+    if (mkfifo(PIPE_CONTROLADOR, 0666) == -1 && errno != EEXIST)
+    {
+        perror("[ERRO] Falha no mkfifo");
+        return 1;
+    }
+    enc.fd_pedidos = open(PIPE_CONTROLADOR, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    enc.fd_pedidos_escrita = open(PIPE_CONTROLADOR, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    // Só os shards (do mesmo utilizador) escrevem as respostas; um FIFO
+    // com este nome deixado por outro processo não serve
+    unlink(enc.pipe_respostas);
+    if (mkfifo(enc.pipe_respostas, 0600) == -1)
+    {
+        perror("[ERRO] Falha no mkfifo");
+        return 1;
+    }
+    enc.fd_respostas = open(enc.pipe_respostas, O_RDWR | O_CLOEXEC);
+    if (enc.fd_pedidos == -1 || enc.fd_pedidos_escrita == -1 || enc.fd_respostas == -1)
+    {
+        perror("[ERRO] Falha no open do FIFO");
+        return 1;
+    }
+
+    for (int k = 0; k < enc.n; k++)
+    {
+        enc.shards[k].fd = -1;
+        enc.shards[k].fd_admin = -1;
+        snprintf(enc.shards[k].fifo, sizeof(enc.shards[k].fifo), "%s.%d", PIPE_CONTROLADOR, k);
+        if (!lancar_shard(k))
+        {
+            perror("[ERRO] Falha ao lançar shard");
+            enc.terminar = 1;
+            break;
+        }
+    }
+    for (int k = 0; k < enc.n && !enc.terminar; k++)
+    {
+        if (!abrir_shard(k))
+        {
+            printf("[ERRO] O shard %d não arrancou.\n", k);
+            enc.terminar = 1;
+        }
+    }
+
+    if (!enc.terminar)
+    {
+        printf("\n=== ENCAMINHADOR: %d SHARDS ===\n", enc.n);
+        printf("(listar, utiliz, frota, km, hora, stats e cancelar vão a todos os shards)\n");
+    }
+    while (!enc.terminar)
+    {
+        struct pollfd p[2] = {{enc.fd_pedidos, POLLIN, 0}, {enc.fd_admin, POLLIN, 0}};
+        if (poll(p, 2, 500) > 0)
+        {
+            if (p[0].revents & POLLIN)
+                tratar_pedidos();
+            if (p[1].revents & (POLLIN | POLLHUP))
+                tratar_admin();
+        }
+        vigiar_shards();
+    }
+
+    // Cada shard avisa os seus clientes e recolhe os seus veículos
+    printf("\n[ENCAMINHADOR] A encerrar os shards...\n");
+    Trama m;
+    trama_iniciar(&m, OP_ADMIN, getpid(), 0, 0);
+    trama_texto(&m, "terminar");
+    for (int k = 0; k < enc.n; k++)
+    {
+        if (enc.shards[k].pid <= 0)
+            continue;
+        if (enc.shards[k].fd_admin == -1 || !trama_escrever(enc.shards[k].fd_admin, &m))
+            kill(enc.shards[k].pid, SIGINT);
+    }
+    for (int k = 0; k < enc.n; k++)
+        if (enc.shards[k].pid > 0)
+            waitpid(enc.shards[k].pid, NULL, 0);
+    return 0;
+}
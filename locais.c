@@ -0,0 +1,89 @@
+#include "locais.h"
+#include <sys/mman.h>
+
+// ============================================================================
+// CATÁLOGO DE LOCAIS
+// ============================================================================
+
+Catalogo *locais_abrir(const char *ficheiro)
+{
+    int fd = open(ficheiro, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(CabecalhoLocais))
+    {
+        fprintf(stderr, "[AVISO] Catálogo de locais %s inválido: ignorado.\n", ficheiro);
+        close(fd);
+        return NULL;
+    }
+
+    void *mapa = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapa == MAP_FAILED)
+    {
+        perror("[AVISO] mmap do catálogo de locais");
+        return NULL;
+    }
+
+    // O tamanho tem de bater certo com o cabeçalho para os acessos à
+    // matriz não precisarem de verificações
+    const CabecalhoLocais *cab = mapa;
+    if (memcmp(cab->magico, LOCAIS_MAGICO, sizeof(cab->magico)) != 0 || cab->versao != LOCAIS_VERSAO ||
+        cab->n == 0 || cab->n > LOCAIS_MAX || cab->cap_tabela < 2 * cab->n ||
+        (cab->cap_tabela & (cab->cap_tabela - 1)) != 0 ||
+        locais_tamanho(cab->n, cab->cap_tabela) != (size_t)st.st_size)
+    {
+        fprintf(stderr, "[AVISO] Catálogo de locais %s inválido ou de outra versão: ignorado.\n", ficheiro);
+        munmap(mapa, st.st_size);
+        return NULL;
+    }
+
+    Catalogo *c = malloc(sizeof(Catalogo));
+    if (c == NULL)
+    {
+        munmap(mapa, st.st_size);
+        return NULL;
+    }
+    c->cab = cab;
+    c->locais = (const Local *)(cab + 1);
+    c->tabela = (const int32_t *)(c->locais + cab->n);
+    c->dist = (const uint16_t *)(c->tabela + cab->cap_tabela);
+    c->tamanho = st.st_size;
+    return c;
+}
+
+void locais_fechar(Catalogo *c)
+{
+    if (c == NULL)
+        return;
+    munmap((void *)c->cab, c->tamanho);
+    free(c);
+}
+
+int locais_procurar(const Catalogo *c, const char *nome)
+{
+    uint32_t mascara = c->cab->cap_tabela - 1;
+    uint32_t p = locais_hash(nome) & mascara;
+    for (uint32_t k = 0; k <= mascara; k++, p = (p + 1) & mascara)
+    {
+        int32_t i = c->tabela[p];
+        if (i < 0 || (uint32_t)i >= c->cab->n)
+            return -1;
+        if (strncmp(c->locais[i].nome, nome, LOCAIS_NOME) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int locais_distancia(const Catalogo *c, int a, int b)
+{
+    uint16_t d = c->dist[(size_t)a * c->cab->n + b];
+    return d == LOCAIS_SEM_CAMINHO ? -1 : d;
+}
+
+const Local *locais_local(const Catalogo *c, int i)
+{
+    return &c->locais[i];
+}
@@ -0,0 +1,64 @@
+#ifndef LOCAIS_H
+#define LOCAIS_H
+
+#include "comum.h"
+
+// Catálogo de locais com nome e a matriz de distâncias entre todos eles,
+// calculada de antemão pelo programa catalogo. O ficheiro é mapeado só de
+// leitura tal como está em disco:
+//   CabecalhoLocais
+//   Local[n]
+//   int32_t tabela[cap_tabela]   hash FNV-1a do nome -> índice (-1 = vazio)
+//   uint16_t dist[n * n]         km de i para j (LOCAIS_SEM_CAMINHO = não há)
+// Os km são também o tempo da viagem (um km por unidade de tempo), por isso
+// a mesma matriz serve para as duas coisas.
+#define LOCAIS_MAGICO "TAXILOC"
+#define LOCAIS_VERSAO 1
+#define LOCAIS_NOME 32
+#define LOCAIS_MAX 4096
+#define LOCAIS_SEM_CAMINHO 0xFFFF
+
+typedef struct {
+    char magico[8];
+    uint32_t versao;
+    uint32_t n;
+    uint32_t cap_tabela; // potência de 2, pelo menos 2 * n
+    uint32_t reservado;
+} CabecalhoLocais;
+
+typedef struct {
+    char nome[LOCAIS_NOME];
+    int32_t x, y;
+} Local;
+
+typedef struct {
+    const CabecalhoLocais *cab;
+    const Local *locais;
+    const int32_t *tabela;
+    const uint16_t *dist;
+    size_t tamanho;
+} Catalogo;
+
+static inline uint32_t locais_hash(const char *nome)
+{
+    uint32_t h = 2166136261u;
+    for (; *nome; nome++)
+        h = (h ^ (unsigned char)*nome) * 16777619u;
+    return h;
+}
+
+static inline size_t locais_tamanho(uint32_t n, uint32_t cap_tabela)
+{
+    return sizeof(CabecalhoLocais) + n * sizeof(Local) + cap_tabela * sizeof(int32_t) + (size_t)n * n * sizeof(uint16_t);
+}
+
+// NULL se o ficheiro não existir ou não for um catálogo válido (com aviso)
+Catalogo *locais_abrir(const char *ficheiro);
+void locais_fechar(Catalogo *c);
+// Índice do local com este nome, ou -1
+int locais_procurar(const Catalogo *c, const char *nome);
+// km de a para b, ou -1 se não houver caminho
+int locais_distancia(const Catalogo *c, int a, int b);
+const Local *locais_local(const Catalogo *c, int i);
+
+#endif
@@ -0,0 +1,125 @@
+#include "traco.h"
+
+// ============================================================================
+// GRAVAÇÃO
+// ============================================================================
+
+static struct
+{
+    pthread_mutex_t m; // folha: não se bloqueia nenhum outro mutex com este
+    FILE *f;
+    int64_t inicio; // CLOCK_MONOTONIC do início, em ns
+    int ativo;
+} traco = {PTHREAD_MUTEX_INITIALIZER};
+
+static int64_t monotonico_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int traco_abrir(const char *ficheiro, int32_t tempo, int32_t proximo_id)
+{
+    FILE *f = fopen(ficheiro, "we");
+    if (f == NULL)
+        return 0;
+    // Buffer grande: um registo custa uma cópia e o write() vem de longe a longe
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    CabecalhoTraco cab;
+    memset(&cab, 0, sizeof(cab));
+    memcpy(cab.magico, TRACO_MAGICO, sizeof(cab.magico));
+    cab.versao = TRACO_VERSAO;
+    cab.tempo = tempo;
+    cab.proximo_id = proximo_id;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cab.inicio = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    if (fwrite(&cab, sizeof(cab), 1, f) != 1)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    pthread_mutex_lock(&traco.m);
+    traco.f = f;
+    traco.inicio = monotonico_ns();
+    __atomic_store_n(&traco.ativo, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&traco.m);
+    return 1;
+}
+
+int traco_ativo(void)
+{
+    return __atomic_load_n(&traco.ativo, __ATOMIC_ACQUIRE);
+}
+
+void traco_registar(int tipo, int32_t tempo, const void *dados, int tamanho)
+{
+    if (!traco_ativo() || tamanho < 0 || tamanho > TRACO_MAX_DADOS)
+        return;
+
+    RegistoTraco r;
+    memset(&r, 0, sizeof(r));
+    r.tipo = tipo;
+    r.tamanho = tamanho;
+    r.tempo = tempo;
+
+    pthread_mutex_lock(&traco.m);
+    if (traco.f == NULL)
+    {
+        pthread_mutex_unlock(&traco.m);
+        return;
+    }
+    // O instante é tirado com o mutex para os registos ficarem por ordem
+    r.ns = monotonico_ns() - traco.inicio;
+    if (fwrite(&r, sizeof(r), 1, traco.f) != 1 || fwrite(dados, 1, tamanho, traco.f) != (size_t)tamanho)
+    {
+        perror("[ERRO] Falha ao escrever no traço; gravação desligada");
+        fclose(traco.f);
+        traco.f = NULL;
+        __atomic_store_n(&traco.ativo, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&traco.m);
+}
+
+// Escreve o que falta; registos posteriores são ignorados
+void traco_fechar(void)
+{
+    pthread_mutex_lock(&traco.m);
+    __atomic_store_n(&traco.ativo, 0, __ATOMIC_RELEASE);
+    if (traco.f != NULL && fclose(traco.f) != 0)
+        perror("[ERRO] Falha ao fechar o traço");
+    traco.f = NULL;
+    pthread_mutex_unlock(&traco.m);
+}
+
+// ============================================================================
+// LEITURA
+// ============================================================================
+
+FILE *traco_ler_abrir(const char *ficheiro, CabecalhoTraco *cab)
+{
+    FILE *f = fopen(ficheiro, "re");
+    if (f == NULL)
+    {
+        perror("[ERRO] Não foi possível abrir o traço");
+        return NULL;
+    }
+    if (fread(cab, sizeof(*cab), 1, f) != 1 || memcmp(cab->magico, TRACO_MAGICO, sizeof(cab->magico)) != 0 ||
+        cab->versao != TRACO_VERSAO)
+    {
+        fprintf(stderr, "[ERRO] %s não é um traço do controlador (ou é de outra versão).\n", ficheiro);
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+int traco_ler(FILE *f, RegistoTraco *r, void *dados)
+{
+    if (fread(r, sizeof(*r), 1, f) != 1 || r->tamanho > TRACO_MAX_DADOS)
+        return 0;
+    return fread(dados, 1, r->tamanho, f) == r->tamanho;
+}
@@ -0,0 +1,52 @@
+#ifndef TRACO_H
+#define TRACO_H
+
+#include "comum.h"
+
+// Traço do controlador: tudo o que entra (pedidos dos clientes, comandos
+// do admin, telemetria dos veículos e avanços do relógio) é acrescentado a
+// um ficheiro binário pela ordem em que foi tratado, para depois ser
+// reproduzido com ./controlador --replay. Formato:
+//   CabecalhoTraco
+//   RegistoTraco + tamanho bytes de dados, repetido até ao fim
+// Um fim truncado (controlador morto a meio de uma escrita) é ignorado na
+// leitura. Registar só copia para o buffer do stdio, sob um mutex folha.
+#define TRACO_MAGICO "TAXITRC"
+#define TRACO_VERSAO 1
+
+#define TRACO_PEDIDO 1     // Trama de um cliente (cabeçalho + dados)
+#define TRACO_ADMIN 2      // linha de comando do admin, sem o '\n'
+#define TRACO_TELEMETRIA 3 // TelemetriaFrame de um veículo
+#define TRACO_RELOGIO 4    // int32_t: unidades que o relógio avançou
+
+typedef struct {
+    char magico[8];
+    uint32_t versao;
+    int32_t tempo;      // tempo simulado no início da gravação
+    int32_t proximo_id; // próximo id de serviço no início da gravação
+    int32_t reservado;
+    int64_t inicio;     // CLOCK_REALTIME do início, em ns
+} CabecalhoTraco;
+
+typedef struct {
+    uint8_t tipo;
+    uint8_t reservado;
+    uint16_t tamanho; // bytes de dados a seguir
+    int32_t tempo;    // tempo simulado quando foi tratado
+    int64_t ns;       // tempo real desde o início da gravação
+} RegistoTraco;
+
+#define TRACO_MAX_DADOS 1024
+
+// 0 se o ficheiro não puder ser criado
+int traco_abrir(const char *ficheiro, int32_t tempo, int32_t proximo_id);
+int traco_ativo(void);
+void traco_registar(int tipo, int32_t tempo, const void *dados, int tamanho);
+void traco_fechar(void);
+
+// Leitura: NULL se o ficheiro não existir ou não for um traço válido
+FILE *traco_ler_abrir(const char *ficheiro, CabecalhoTraco *cab);
+// 1 se leu um registo inteiro; 0 no fim (ou num registo truncado)
+int traco_ler(FILE *f, RegistoTraco *r, void *dados);
+
+#endif
@@ -1,124 +1,321 @@
 #include "comum.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
-char pipe_cliente_nome[100];
-int fd_cliente_pipe = -1;
+// Passageiros da viagem atual (só um, se a viagem não for partilhada)
+typedef struct {
+    PedidoViagem p;
+    int fd;     // pipe do cliente (-1 = fechado)
+    int fim;    // km em que sai: o destino, ou onde a viagem acabou para ele
+    int ativo;  // ainda não saiu do carro
+} Passageiro;
+
+Passageiro passageiros[LUGARES_MAX];
+int n_passageiros = 0;
 int km_percorridos_final = 0;
+RelogioPartilhado *relogio = NULL;
+
+// 1 = cancelar a viagem atual, 2 = cancelar e terminar o processo
+volatile sig_atomic_t cancelar_viagem = 0;
+// Serviços cancelados a meio de uma viagem partilhada, ainda por tratar
+volatile sig_atomic_t cancelar_ids[LUGARES_MAX];
+volatile sig_atomic_t n_cancelar_ids = 0;
 
 // ============================================================================
 // GESTÃO DE RECURSOS E SINAIS
 // ============================================================================
 
 void limpar_recursos() {
-    if (fd_cliente_pipe != -1) close(fd_cliente_pipe);
+    for (int i = 0; i < n_passageiros; i++)
+        if (passageiros[i].fd != -1) close(passageiros[i].fd);
     // Não é preciso unlink porque o veículo já não cria pipe próprio
 }
 
 void trata_sinal_cancelar(int s) {
     // Requisito: "Caso receba o sinal SIGUSR1 deve cancelar o serviço"
-    printf("[RELATORIO] %d\n", km_percorridos_final);
-    printf("Viagem cancelada pelo controlador!\n"); 
-    fflush(stdout); // Garante que o controlador lê isto imediatamente
-    
-    // Avisa o cliente se possível
-    if (fd_cliente_pipe != -1) {
-        Mensagem m;
-        m.pid = getpid();
-        strcpy(m.comando, "fim");
-        strcpy(m.mensagem, "Viagem cancelada pela central!");
-        write(fd_cliente_pipe, &m, sizeof(Mensagem));
-    }
-    exit(0); // Chama o atexit(limpar_recursos)
+    // O trabalho é feito fora do handler; o veículo volta a ficar livre
+    cancelar_viagem = (s == SIGINT) ? 2 : 1;
 }
 
-void setup_ambiente(int pid_cliente) {
-    setbuf(stdout, NULL); // Desativa buffer para o controlador ler logo
+void trata_sinal_passageiro(int s, siginfo_t *info, void *ctx) {
+    (void)s;
+    (void)ctx;
+    if (n_cancelar_ids < LUGARES_MAX) cancelar_ids[n_cancelar_ids++] = info->si_value.sival_int;
+}
+
+void setup_ambiente() {
     atexit(limpar_recursos);
     
-    // Configura sinais para cancelamento
-    signal(SIGUSR1, trata_sinal_cancelar);
-    signal(SIGINT, trata_sinal_cancelar);
+    // Configura sinais para cancelamento (sem SA_RESTART para interromper o sleep/read)
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trata_sinal_cancelar;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    sa.sa_handler = NULL;
+    sa.sa_sigaction = trata_sinal_passageiro;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SINAL_CANCELAR_PASSAGEIRO, &sa, NULL);
+}
+
+// Mapeia o relógio simulado do controlador; devolve 0 se não estiver disponível
+int ligar_relogio() {
+    char *env = getenv(RELOGIO_ENV);
+    if (env == NULL) return 0;
+
+    void *p = mmap(NULL, sizeof(RelogioPartilhado), PROT_READ, MAP_SHARED, atoi(env), 0);
+    if (p == MAP_FAILED) return 0;
+    relogio = p;
+    return 1;
+}
 
-    // Define o nome do pipe do cliente para enviar notificações
-    sprintf(pipe_cliente_nome, PIPE_CLIENTE, pid_cliente);
+int ler_relogio() {
+    return __atomic_load_n(&relogio->tempo, __ATOMIC_ACQUIRE);
+}
+
+// Dorme até o tempo simulado chegar a alvo ou até haver um cancelamento.
+// O limite de 100 ms cobre um sinal que chegue entre a verificação e o futex.
+void esperar_relogio(int alvo) {
+    struct timespec limite = {0, 100000000};
+    int agora;
+    while ((agora = ler_relogio()) < alvo && !cancelar_viagem && !n_cancelar_ids)
+        syscall(SYS_futex, &relogio->tempo, FUTEX_WAIT, agora, &limite, NULL, 0);
 }
 
 // ============================================================================
 // FASES DO SERVIÇO
 // ============================================================================
 
-void iniciar_viagem(const char *local) {
-    // 1. Contactar Cliente
-    fd_cliente_pipe = open(pipe_cliente_nome, O_WRONLY);
-    if (fd_cliente_pipe == -1) {
-        printf("Erro: Cliente incontactável. Abortar.\n"); 
-        exit(1);
+// Envia um evento ao Controlador (via stdout, um frame por write)
+void enviar_telemetria(int tipo, int id_servico, int km, int percentagem) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    TelemetriaFrame f;
+    f.tipo = tipo;
+    f.id_servico = id_servico;
+    f.km = km;
+    f.percentagem = percentagem;
+    f.timestamp = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    write(STDOUT_FILENO, &f, sizeof(f));
+}
+
+void avisar_cliente(Passageiro *ps, int opcode, const char *texto) {
+    if (ps->fd == -1) return;
+    Trama t;
+    trama_iniciar(&t, opcode, getpid(), 0, 0);
+    trama_texto(&t, texto);
+    trama_escrever(ps->fd, &t);
+}
+
+int passageiros_a_bordo() {
+    int n = 0;
+    for (int i = 0; i < n_passageiros; i++) n += passageiros[i].ativo;
+    return n;
+}
+
+// O passageiro i sai ao km fim: reporta ao Controlador a parte dele dos km
+// (CONCLUIDO/CANCELADO/FALHA marcam o fim do serviço) e avisa o cliente
+void largar_passageiro(int i, int fim, int tipo, const char *aviso_cliente) {
+    Passageiro *ps = &passageiros[i];
+    if (!ps->ativo) return;
+    ps->ativo = 0;
+    ps->fim = fim;
+
+    int fins[LUGARES_MAX], partes[LUGARES_MAX];
+    for (int k = 0; k < n_passageiros; k++) fins[k] = passageiros[k].fim;
+    repartir_km(n_passageiros, fins, fim, partes);
+    enviar_telemetria(tipo, ps->p.id_servico, partes[i], 0);
+
+    if (aviso_cliente != NULL) avisar_cliente(ps, OP_FIM, aviso_cliente);
+    if (ps->fd != -1) {
+        close(ps->fd);
+        ps->fd = -1;
     }
+}
 
-    Mensagem msg;
-    msg.pid = getpid();
-    strcpy(msg.comando, "status");
-    
-    // Informa que chegou e começa logo (Simplificação do Prof)
-    sprintf(msg.mensagem, "Veículo chegou a %s. A iniciar viagem...", local);
-    write(fd_cliente_pipe, &msg, sizeof(Mensagem));
+void cancelar_todos(const char *aviso_cliente) {
+    for (int i = 0; i < n_passageiros; i++)
+        largar_passageiro(i, km_percorridos_final, TEL_CANCELADO, aviso_cliente);
+}
 
+// Passageiros cancelados sozinhos (SINAL_CANCELAR_PASSAGEIRO) saem já
+void tratar_cancelamentos() {
+    sigset_t s, antes;
+    sigemptyset(&s);
+    sigaddset(&s, SINAL_CANCELAR_PASSAGEIRO);
+    sigprocmask(SIG_BLOCK, &s, &antes);
+    int ids[LUGARES_MAX], n = n_cancelar_ids;
+    for (int k = 0; k < n; k++) ids[k] = cancelar_ids[k];
+    n_cancelar_ids = 0;
+    sigprocmask(SIG_SETMASK, &antes, NULL);
 
+    for (int k = 0; k < n; k++)
+        for (int i = 0; i < n_passageiros; i++)
+            if (passageiros[i].ativo && passageiros[i].p.id_servico == ids[k])
+                largar_passageiro(i, km_percorridos_final, TEL_CANCELADO, "A tua viagem foi cancelada pela central!");
+}
+
+// Vai até ao local dos clientes: os primeiros recolha km da viagem.
+// Devolve 0 se a viagem ficar sem passageiros pelo caminho.
+int ir_buscar_cliente(int recolha, int t_inicio) {
+    if (recolha <= 0) return 1;
+    while (1) {
+        esperar_relogio(t_inicio + recolha);
+        km_percorridos_final = ler_relogio() - t_inicio;
+        if (km_percorridos_final > recolha) km_percorridos_final = recolha;
+        if (cancelar_viagem) {
+            cancelar_todos("Viagem cancelada pela central!");
+            return 0;
+        }
+        tratar_cancelamentos();
+        if (passageiros_a_bordo() == 0) return 0;
+        if (km_percorridos_final >= recolha) return 1;
+    }
 }
 
-void realizar_viagem_simulada(int distancia_total) {
-    //printf("Início da viagem de %dkm.\n", distancia_total); // Para o Controlador
+int iniciar_viagem() {
+    // 1. Contactar os clientes; quem não responder fica para trás
+    for (int i = 0; i < n_passageiros; i++) {
+        Passageiro *ps = &passageiros[i];
+        if (!ps->ativo) continue;
+        char pipe_cliente_nome[100];
+        sprintf(pipe_cliente_nome, PIPE_CLIENTE, ps->p.pid_cliente);
+        ps->fd = open(pipe_cliente_nome, O_WRONLY);
+        if (ps->fd == -1) {
+            largar_passageiro(i, km_percorridos_final, TEL_FALHA, NULL); // Cliente incontactável
+            continue;
+        }
+
+        // Informa que chegou e começa logo (Simplificação do Prof)
+        char texto[256];
+        if (n_passageiros > 1)
+            snprintf(texto, sizeof(texto), "Veículo chegou a %s (viagem partilhada, %d passageiros). A iniciar viagem...",
+                     ps->p.local, n_passageiros);
+        else
+            snprintf(texto, sizeof(texto), "Veículo chegou a %s. A iniciar viagem...", ps->p.local);
+        avisar_cliente(ps, OP_STATUS, texto);
+    }
+
+    for (int i = 0; i < n_passageiros; i++) {
+        if (passageiros[i].ativo) {
+            enviar_telemetria(TEL_INICIO, passageiros[i].p.id_servico, km_percorridos_final, 0);
+            return 1;
+        }
+    }
+    return 0;
+}
 
+void realizar_viagem_simulada(int t_inicio) {
     int perc = 0;
+    int distancia_total = 0;
+    for (int i = 0; i < n_passageiros; i++)
+        if (passageiros[i].ativo && passageiros[i].p.distancia > distancia_total)
+            distancia_total = passageiros[i].p.distancia;
     
-    
-    // Loop simples de simulação
-    while (km_percorridos_final < distancia_total) {
-        sleep(1); // Avanço do tempo (1s = 1 unidade de tempo)
-        km_percorridos_final++;
+    // 1 km por unidade de tempo simulado, contada desde a atribuição.
+    // O relógio pode saltar várias unidades de uma vez (escala alta ou modo discreto).
+    while (passageiros_a_bordo() > 0 && !cancelar_viagem) {
+        esperar_relogio(t_inicio + km_percorridos_final + 1);
+        if (cancelar_viagem) break;
+        km_percorridos_final = ler_relogio() - t_inicio;
+        if (km_percorridos_final > distancia_total)
+            km_percorridos_final = distancia_total;
+        tratar_cancelamentos();
+
+        // Deixa quem já chegou ao destino
+        int id_progresso = 0;
+        for (int i = 0; i < n_passageiros; i++) {
+            Passageiro *ps = &passageiros[i];
+            if (ps->ativo && ps->p.distancia <= km_percorridos_final)
+                largar_passageiro(i, ps->p.distancia, TEL_CONCLUIDO, "Chegámos ao destino.");
+            if (ps->ativo && id_progresso == 0) id_progresso = ps->p.id_servico;
+        }
         
-        int nova_perc = (km_percorridos_final * 100) / distancia_total;
+        int nova_perc = distancia_total > 0 ? (km_percorridos_final * 100) / distancia_total : 100;
         
         // Reporta a cada 10% ao Controlador (via stdout)
-        if (nova_perc / 10 > perc / 10) {
-            printf("Progresso: %d%% (%d/%d km)\n", nova_perc, km_percorridos_final, distancia_total);
-            fflush(stdout); // Importante para o pipe anónimo não ficar preso
+        if (id_progresso != 0 && nova_perc / 10 > perc / 10) {
+            enviar_telemetria(TEL_PROGRESSO, id_progresso, km_percorridos_final, nova_perc);
         }
         perc = nova_perc;
     }
 
-    // Reporta o total final ao Controlador
-    printf("[RELATORIO] %d\n", km_percorridos_final);
-    printf("Viagem concluída com sucesso.\n");
-    
-    // Avisa o Cliente
-    Mensagem msg_fim;
-    msg_fim.pid = getpid();
-    strcpy(msg_fim.comando, "fim");
-    strcpy(msg_fim.mensagem, "Chegámos ao destino.");
-    write(fd_cliente_pipe, &msg_fim, sizeof(Mensagem));
+    if (cancelar_viagem)
+        cancelar_todos("Viagem cancelada pela central!");
+}
+
+// Espera pela próxima viagem; devolve 0 se o controlador fechou o pipe
+int esperar_pedido(PedidoViagem *p) {
+    size_t lidos = 0;
+    while (lidos < sizeof(PedidoViagem)) {
+        int n = read(STDIN_FILENO, (char *)p + lidos, sizeof(PedidoViagem) - lidos);
+        if (n == 0) return 0;
+        if (n < 0) {
+            if (errno == EINTR && cancelar_viagem != 2) continue;
+            return 0;
+        }
+        lidos += n;
+    }
+    return 1;
+}
+
+// Lê os pedidos de uma viagem (vários seguidos se for partilhada)
+int esperar_viagem() {
+    if (!esperar_pedido(&passageiros[0].p)) return 0;
+    n_passageiros = passageiros[0].p.passageiros;
+    if (n_passageiros < 1) n_passageiros = 1;
+    if (n_passageiros > LUGARES_MAX) n_passageiros = LUGARES_MAX;
+    for (int i = 1; i < n_passageiros; i++)
+        if (!esperar_pedido(&passageiros[i].p)) return 0;
+    for (int i = 0; i < n_passageiros; i++) {
+        passageiros[i].fd = -1;
+        passageiros[i].fim = passageiros[i].p.distancia;
+        passageiros[i].ativo = 1;
+    }
+    return 1;
 }
 
 int main(int argc, char *argv[]) {
     // Validação para impedir execução manual
-    if (argc != 5) {
+    if (argc != 2 || strcmp(argv[1], VEICULO_ARG_POOL) != 0) {
         printf("[ERRO] Este programa é iniciado automaticamente pelo Controlador.\n");
         return 1;
     }
 
-    // Parsing dos argumentos recebidos do Controlador
-    // argv[1]=user, argv[2]=pid_cli, argv[3]=dist, argv[4]=local
-    int pid_cliente = atoi(argv[2]);
-    int distancia = atoi(argv[3]);
-    char *local = argv[4];
-
     // 1. Configuração
-    setup_ambiente(pid_cliente);
+    if (!ligar_relogio()) {
+        fprintf(stderr, "[ERRO] Relógio simulado do controlador indisponível.\n");
+        return 1;
+    }
+    setup_ambiente();
 
-    // 2. Avisar chegada e início automático
-    iniciar_viagem(local);
+    // O veículo fica à espera de viagens até o controlador fechar o pipe
+    while (esperar_viagem()) {
+        // Um cancelamento recebido enquanto estava livre já não se aplica
+        if (cancelar_viagem == 1) cancelar_viagem = 0;
+        n_cancelar_ids = 0;
+        km_percorridos_final = 0;
+        int t_inicio = passageiros[0].p.t_inicio;
+
+        // 2. Ir buscar os clientes, avisar chegada e início automático
+        if (!ir_buscar_cliente(passageiros[0].p.recolha, t_inicio)) {
+            if (cancelar_viagem == 2) break;
+            cancelar_viagem = 0;
+            continue;
+        }
+        if (!iniciar_viagem())
+            continue;
 
-    // 3. Simular o percurso
-    realizar_viagem_simulada(distancia);
+        // 3. Simular o percurso
+        realizar_viagem_simulada(t_inicio);
+
+        if (cancelar_viagem == 2) break;
+        cancelar_viagem = 0;
+    }
 
     return 0;
-}
\ No newline at end of file
+}